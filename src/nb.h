@@ -20,11 +20,21 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include "nb_cfg.h"
 
 #define SVERSION "1.0.3"
 
+/*
+** Code address or heap reference (32 bit with 'cfg_WIDE_ADDRESSES')
+*/
+#ifdef cfg_WIDE_ADDRESSES
+typedef uint32_t nb_addr_t;
+#else
+typedef uint16_t nb_addr_t;
+#endif
+
 /*
 ** Data types for 'nb_define_external_function()'
 */
@@ -47,19 +57,37 @@ enum {
   NB_XFUNC,    // 'call' external function
 };
 
+#define NB_UNBOUNDED    (0xFFFFFFFF) // result of 'nb_code_analysis()'
+
 /*
 ** To be implemented by the user
 */
-char *nb_get_code_line(void *fp, char *line, int max_line_len);
 void nb_print(const char * format, ...);
 
+// source code line reader of 'nb_compile()', e.g. a wrapper of 'fgets()'
+typedef char *(*nb_get_code_line_t)(void *fp, char *line, int max_line_len);
+
 /*
 ** Compiler / Interpreter
 */
+// 'nb_init()', the external functions and the modules have to be defined before the first
+// 'nb_create()', which freezes them (the compilers can run in parallel from then on)
 void nb_init(void);
 uint8_t nb_define_external_function(char *name, uint8_t num_params, uint8_t *types, uint8_t return_type);
+// compile a library once, the programs use it via 'IMPORT "name"' (return the number of errors),
+// the VMs execute the module code from the module itself
+uint16_t nb_define_module(char *name, const char *p_src, size_t len);
 void *nb_create(void);
-uint16_t nb_compile(void *pv_vm, void *fp);
+// link a restored VM (memory copy) to its module again (return false if missing or changed)
+bool nb_link_module(void *pv_vm);
+uint16_t nb_compile(void *pv_vm, void *fp, nb_get_code_line_t get_line);
+// compile the source code buffer in place (no '\0' termination required)
+uint16_t nb_compile_buffer(void *pv_vm, const char *p_src, size_t len);
+// compile only the changed lines of the previously compiled buffer (cfg_LINE_NUMBERS)
+uint16_t nb_recompile_buffer(void *pv_vm, const char *p_src, size_t len);
+// compile only the main program, the subroutines on first use (cfg_LINE_NUMBERS),
+// the buffer has to stay valid until the next compilation
+uint16_t nb_compile_lazy(void *pv_vm, const char *p_src, size_t len);
 uint16_t nb_run(void *pv_vm, uint16_t *p_cycles);
 void nb_reset(void *pv_vm);
 void nb_destroy(void * pv_vm);
@@ -69,14 +97,28 @@ void nb_destroy(void * pv_vm);
 */
 void nb_dump_code(void *pv_vm);
 void nb_output_symbol_table(void *pv_vm);
+// static analysis of the code at 'addr' (1 = programm start or a label address): return the
+// worst-case number of cycles, the max. stack depth and GOSUB nesting (NB_UNBOUNDED/255 = unknown)
+uint32_t nb_code_analysis(void *pv_vm, nb_addr_t addr, uint8_t *p_stack, uint8_t *p_calls);
+void nb_output_code_analysis(void *pv_vm);
+
+/*
+** Profile-guided compilation (cfg_PROFILE)
+*/
+// compile the next programs with counters for the IF branches, WHILE loops, and GOSUB calls
+void nb_collect_profile(void *pv_vm, bool on);
+// write the counts of the program runs into 'p_buf', return the size (0 = no profile or buffer too small)
+uint16_t nb_get_profile(void *pv_vm, uint8_t *p_buf, uint16_t size);
+// use the profile for the next compilations (NULL = none), it is ignored for another source code
+bool nb_set_profile(void *pv_vm, const uint8_t *p_prof, uint16_t size);
 
 /*
 ** Call a function in the VM
 */
 // return 0 if not found
-uint16_t nb_get_label_address(void *pv_vm, char *name);
+nb_addr_t nb_get_label_address(void *pv_vm, char *name);
 // return 255 if not found
-void nb_set_pc(void * pv_vm, uint16_t addr);
+void nb_set_pc(void * pv_vm, nb_addr_t addr);
 
 /*
 ** Stack/parameter functions
@@ -93,6 +135,6 @@ int32_t nb_peek_num(void *pv_vm, uint8_t idx);
 /*
 ** Array/String access functions
 */
-uint16_t nb_pop_arr_ref(void *pv_vm);
-uint16_t nb_read_arr(void *pv_vm, uint16_t ref, uint8_t *arr, uint16_t bytes);
-uint16_t nb_write_arr(void *pv_vm, uint16_t ref, uint8_t *arr, uint16_t bytes);
+nb_addr_t nb_pop_arr_ref(void *pv_vm);
+uint16_t nb_read_arr(void *pv_vm, nb_addr_t ref, uint8_t *arr, uint16_t bytes);
+uint16_t nb_write_arr(void *pv_vm, nb_addr_t ref, uint8_t *arr, uint16_t bytes);
@@ -0,0 +1,691 @@
+/*
+
+Copyright 2024-2025 Joachim Stolberg
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+/*
+** Static code analysis of the compiled byte code: max. stack depth, GOSUB nesting,
+** and the worst-case number of cycles (executed instructions) of the programm and
+** its subroutines. Loops are bounded only as FOR loops with constant start, end
+** and step values, which do not modify the loop variable in the body.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "nb.h"
+#include "nb_int.h"
+
+#define UNBOUNDED8      (0xFF)
+#define MAX_SUCC        (258) // ON...GOTO or SELECT with 255 addresses + skip
+
+// Subroutine (or programm) analysis result
+typedef struct {
+    nb_addr_t addr;     // start address
+    nb_addr_t from;     // first unbounded code region, 0 = none
+    nb_addr_t to;
+    uint32_t cycles;    // worst-case number of cycles
+    uint8_t  stack;     // max. stack depth (values)
+    uint8_t  calls;     // max. GOSUB nesting
+    bool     done;      // false while analyzed (recursion)
+    uint8_t  written[cfg_NUM_VARS / 8]; // variables written by the subroutine and its callees
+} sub_t;
+
+typedef struct {
+    t_VM    *vm;
+    sub_t   *p_sub;
+    uint16_t num_sub;
+    uint16_t max_sub;
+    nb_addr_t a_succ[MAX_SUCC]; // successors of an instruction
+    int8_t   a_delta[MAX_SUCC]; // stack depth change for each successor
+} ana_inst_t;
+
+static uint16_t analyze_sub(ana_inst_t *pAi, nb_addr_t addr);
+static bool loop_bound(ana_inst_t *pAi, uint16_t idx, uint8_t *p_depth, uint32_t *p_mult, nb_addr_t start, nb_addr_t next);
+static bool writes_var(ana_inst_t *pAi, uint16_t idx, nb_addr_t pc, uint8_t var);
+static uint16_t successors(t_VM *vm, nb_addr_t pc, nb_addr_t *p_addr, int8_t *p_delta);
+static int8_t stack_effect(uint8_t instr);
+static nb_addr_t jump_addr(t_VM *vm, nb_addr_t pc);
+static int16_t written_var(t_VM *vm, nb_addr_t pc);
+static uint32_t for_loop_count(t_VM *vm, nb_addr_t addr, uint8_t var);
+static bool const_value(t_VM *vm, nb_addr_t *p_pc, int32_t *p_value);
+static uint32_t sat_add(uint32_t a, uint32_t b);
+static uint32_t sat_mul(uint32_t a, uint32_t b);
+static void unbounded(sub_t *p_sub, nb_addr_t from, nb_addr_t to);
+static uint16_t line_of(t_VM *vm, nb_addr_t addr);
+static void sub_name(t_VM *vm, nb_addr_t addr, char *p_name, uint16_t size);
+
+/***************************************************************************************************
+**    global functions
+***************************************************************************************************/
+uint32_t nb_code_analysis(void *pv_vm, nb_addr_t addr, uint8_t *p_stack, uint8_t *p_calls) {
+    ana_inst_t ai = {.vm = pv_vm};
+    uint32_t cycles = NB_UNBOUNDED;
+
+    *p_stack = UNBOUNDED8;
+    *p_calls = UNBOUNDED8;
+    if(addr == 0 || addr >= ai.vm->code_size) {
+        return cycles;
+    }
+    uint16_t idx = analyze_sub(&ai, addr);
+    if(ai.p_sub != NULL) {
+        *p_stack = ai.p_sub[idx].stack;
+        *p_calls = ai.p_sub[idx].calls;
+        cycles = ai.p_sub[idx].cycles;
+        free(ai.p_sub);
+    }
+    return cycles;
+}
+
+void nb_output_code_analysis(void *pv_vm) {
+    ana_inst_t ai = {.vm = pv_vm};
+    char name[k_MAX_SYM_LEN + 8];
+
+    nb_print("#### Code analysis ####\n");
+    if(ai.vm->code_size <= 1) {
+        return;
+    }
+    analyze_sub(&ai, 1);
+    if(ai.p_sub == NULL) {
+        nb_print("Error: out of memory\n");
+        return;
+    }
+    nb_print("Stack size: %u values\n", cfg_STACK_SIZE);
+    // The subroutines are added in the order of their first call
+    for(uint16_t i = 0; i < ai.num_sub; i++) {
+        sub_t *p_sub = &ai.p_sub[i];
+        if(i == 0) {
+            strcpy(name, "(programm)");
+        } else {
+            sub_name(ai.vm, p_sub->addr, name, sizeof(name));
+        }
+        nb_print("%16s: stack ", name);
+        if(p_sub->stack == UNBOUNDED8) {
+            nb_print("unbounded");
+        } else {
+            nb_print("%u", p_sub->stack);
+        }
+        nb_print(", calls ");
+        if(p_sub->calls == UNBOUNDED8) {
+            nb_print("unbounded");
+        } else {
+            nb_print("%u", p_sub->calls);
+        }
+        if(p_sub->cycles == NB_UNBOUNDED) {
+            uint16_t line1 = line_of(ai.vm, p_sub->from);
+            uint16_t line2 = line_of(ai.vm, p_sub->to);
+            if(line1 == 0) {
+                nb_print(", cycles unbounded (address %u..%u)\n", p_sub->from, p_sub->to);
+            } else if(line1 == line2) {
+                nb_print(", cycles unbounded (line %u)\n", line1);
+            } else {
+                nb_print(", cycles unbounded (line %u..%u)\n", line1, line2);
+            }
+        } else {
+            nb_print(", cycles %u\n", p_sub->cycles);
+        }
+    }
+    free(ai.p_sub);
+}
+
+/***************************************************************************************************
+**    static functions
+***************************************************************************************************/
+/*
+** Analyze the code starting at 'addr' (programm start or GOSUB target)
+** and all called subroutines. Return the index of the result in 'p_sub'.
+*/
+static uint16_t analyze_sub(ana_inst_t *pAi, nb_addr_t addr) {
+    t_VM *vm = pAi->vm;
+    nb_addr_t size = vm->code_size;
+    nb_addr_t *a_addr = pAi->a_succ; // valid until the next call of 'successors()'
+    int8_t *a_delta = pAi->a_delta;
+    nb_addr_t sp = 0;
+    uint16_t idx, num;
+
+    for(idx = 0; idx < pAi->num_sub; idx++) {
+        if(pAi->p_sub[idx].addr == addr) {
+            return idx;
+        }
+    }
+    if(pAi->num_sub >= pAi->max_sub) {
+        uint16_t max = pAi->max_sub > 0 ? pAi->max_sub * 2 : 16;
+        sub_t *p_sub = realloc(pAi->p_sub, max * sizeof(sub_t));
+        if(p_sub == NULL) {
+            free(pAi->p_sub);
+            pAi->p_sub = NULL;
+            pAi->num_sub = pAi->max_sub = 0;
+            return 0;
+        }
+        pAi->p_sub = p_sub;
+        pAi->max_sub = max;
+    }
+    idx = pAi->num_sub++;
+    memset(&pAi->p_sub[idx], 0, sizeof(sub_t));
+    pAi->p_sub[idx].addr = addr;
+#define SUB (&pAi->p_sub[idx]) // the table is reallocated by recursive calls
+
+    // Stack depth + 1 at each reached instruction, 0 = not reached
+    uint8_t *p_depth = calloc(size, sizeof(uint8_t));
+    nb_addr_t *p_work = malloc(size * sizeof(nb_addr_t));
+    uint32_t *p_mult = malloc(size * sizeof(uint32_t));
+    uint32_t *p_cost = malloc(size * sizeof(uint32_t));
+    if(p_depth == NULL || p_work == NULL || p_mult == NULL || p_cost == NULL || addr == 0 || addr >= size) {
+        free(p_depth);
+        free(p_work);
+        free(p_mult);
+        free(p_cost);
+        unbounded(SUB, addr, addr);
+        SUB->stack = UNBOUNDED8;
+        SUB->calls = UNBOUNDED8;
+        SUB->done = true;
+        return idx;
+    }
+
+    // Pass 1: reached instructions, stack depth and called subroutines
+    memset(p_mult, 0, size * sizeof(uint32_t));
+    p_depth[addr] = 1;
+    p_work[sp++] = addr;
+    while(sp > 0) {
+        nb_addr_t pc = p_work[--sp];
+        p_mult[pc] = 0;
+        uint8_t instr = CODE_SEG(vm, pc)[pc];
+        uint8_t depth = p_depth[pc] - 1;
+        uint8_t peak = depth;
+
+        if(instr == k_GOSUB_N3 || instr == k_ON_GOSUB_N2) {
+            uint8_t cnt = instr == k_GOSUB_N3 ? 1 : CODE_SEG(vm, pc)[pc + 1];
+            for(uint8_t i = 0; i < cnt; i++) {
+                nb_addr_t target = instr == k_GOSUB_N3 ? ACS_ADDR(CODE_SEG(vm, pc)[pc + 1]) : ACS_ADDR(CODE_SEG(vm, pc)[pc + 3 + i * k_JUMP_LEN]);
+                uint16_t callee = analyze_sub(pAi, target);
+                if(pAi->p_sub == NULL) {
+                    free(p_depth);
+                    free(p_work);
+                    free(p_mult);
+                    free(p_cost);
+                    return 0;
+                }
+                sub_t *p_callee = &pAi->p_sub[callee];
+                if(!p_callee->done || p_callee->cycles == NB_UNBOUNDED) {
+                    unbounded(SUB, pc, pc);
+                }
+                if(!p_callee->done || p_callee->stack == UNBOUNDED8) {
+                    unbounded(SUB, pc, pc);
+                    SUB->stack = UNBOUNDED8;
+                    SUB->calls = UNBOUNDED8;
+                } else {
+                    // the ON...GOSUB value is replaced by the return address
+                    peak = MAX(peak, depth + 1 + p_callee->stack - (instr == k_ON_GOSUB_N2));
+                    if(SUB->calls != UNBOUNDED8) {
+                        SUB->calls = MAX(SUB->calls, p_callee->calls == UNBOUNDED8 ? UNBOUNDED8 : p_callee->calls + 1);
+                    }
+                    for(uint16_t j = 0; j < sizeof(SUB->written); j++) {
+                        SUB->written[j] |= p_callee->written[j];
+                    }
+                }
+            }
+        } else if(written_var(vm, pc) >= 0) {
+            uint8_t var = written_var(vm, pc);
+            SUB->written[var / 8] |= 1 << (var % 8);
+        } else if(instr == k_LAZY_LINE_N3) {
+            // Not compiled yet
+            unbounded(SUB, pc, pc);
+            SUB->stack = UNBOUNDED8;
+        }
+
+        num = successors(vm, pc, a_addr, a_delta);
+        for(uint16_t i = 0; i < num; i++) {
+            int16_t val = depth + a_delta[i];
+            if(val < 0) {
+                val = 0;
+            }
+            peak = MAX(peak, val);
+            if(a_addr[i] >= size || val > cfg_STACK_SIZE) {
+                unbounded(SUB, pc, pc);
+                SUB->stack = UNBOUNDED8;
+            } else if(p_depth[a_addr[i]] < val + 1) {
+                // Not reached or reached with a lower stack depth
+                p_depth[a_addr[i]] = val + 1;
+                if(!p_mult[a_addr[i]]) {
+                    p_mult[a_addr[i]] = 1; // queued
+                    p_work[sp++] = a_addr[i];
+                }
+            }
+        }
+        if(SUB->stack != UNBOUNDED8) {
+            SUB->stack = MAX(SUB->stack, peak);
+            if(SUB->stack > cfg_STACK_SIZE) {
+                unbounded(SUB, pc, pc);
+                SUB->stack = UNBOUNDED8;
+            }
+        }
+    }
+
+    // Pass 2: the body of a bounded FOR loop is executed 'p_mult' times, any other loop is unbounded
+    if(SUB->cycles != NB_UNBOUNDED) {
+        for(nb_addr_t pc = 0; pc < size; pc++) {
+            p_mult[pc] = 1;
+        }
+        for(nb_addr_t pc = 1; pc < size; pc++) {
+            if(p_depth[pc] == 0) {
+                continue;
+            }
+            if((CODE_SEG(vm, pc)[pc] == k_NEXT_N4 || CODE_SEG(vm, pc)[pc] == k_NEXT_R3) && jump_addr(vm, pc) <= pc) {
+                if(!loop_bound(pAi, idx, p_depth, p_mult, jump_addr(vm, pc), pc)) {
+                    unbounded(SUB, jump_addr(vm, pc), pc);
+                }
+                continue;
+            }
+            num = successors(vm, pc, a_addr, a_delta);
+            for(uint16_t i = 0; i < num; i++) {
+                if(a_addr[i] <= pc) {
+                    unbounded(SUB, a_addr[i], pc);
+                }
+            }
+        }
+    }
+
+    // Pass 3: longest path, all remaining jumps are forward jumps
+    if(SUB->cycles != NB_UNBOUNDED) {
+        for(nb_addr_t pc = size - 1; pc > 0; pc--) {
+            if(p_depth[pc] == 0) {
+                continue;
+            }
+            uint8_t instr = CODE_SEG(vm, pc)[pc];
+            uint32_t cost = 1;
+            uint32_t max = 0;
+            if(instr == k_GOSUB_N3) {
+                cost = sat_add(1, pAi->p_sub[analyze_sub(pAi, ACS_ADDR(CODE_SEG(vm, pc)[pc + 1]))].cycles);
+            } else if(instr == k_ON_GOSUB_N2) {
+                // ON...GOSUB and the selected GOTO
+                for(uint8_t i = 0; i < CODE_SEG(vm, pc)[pc + 1]; i++) {
+                    max = MAX(max, pAi->p_sub[analyze_sub(pAi, ACS_ADDR(CODE_SEG(vm, pc)[pc + 3 + i * k_JUMP_LEN]))].cycles);
+                }
+                cost = sat_add(2, max);
+                max = 0;
+            }
+            cost = sat_mul(p_mult[pc], cost);
+            num = successors(vm, pc, a_addr, a_delta);
+            for(uint16_t i = 0; i < num; i++) {
+                if(a_addr[i] > pc) {
+                    max = MAX(max, p_cost[a_addr[i]]);
+                }
+            }
+            p_cost[pc] = sat_add(cost, max);
+        }
+        SUB->cycles = p_cost[addr];
+        if(SUB->cycles == NB_UNBOUNDED) {
+            // Too many cycles
+            SUB->from = SUB->to = addr;
+        }
+    }
+#undef SUB
+    pAi->p_sub[idx].done = true;
+    free(p_depth);
+    free(p_work);
+    free(p_mult);
+    free(p_cost);
+    return idx;
+}
+
+/*
+** Check the FOR loop 'start'..'next' (NEXT instruction) for a constant
+** number of iterations and multiply the cycles of the body by it.
+*/
+static bool loop_bound(ana_inst_t *pAi, uint16_t idx, uint8_t *p_depth, uint32_t *p_mult, nb_addr_t start, nb_addr_t next) {
+    t_VM *vm = pAi->vm;
+    uint8_t var = written_var(vm, next);
+    nb_addr_t pc;
+    uint32_t count;
+
+    // FOR instruction in front of the body (loop invariant code could be in between)
+    for(pc = start - 1; pc > 0; pc--) {
+        if(p_depth[pc] > 0 && CODE_SEG(vm, pc)[pc] == k_FOR_N1) {
+            break;
+        }
+    }
+    if(pc == 0) {
+        return false;
+    }
+    count = for_loop_count(vm, pc, var);
+    if(count == 0) {
+        return false;
+    }
+    for(pc = start; pc < next; pc++) {
+        if(p_depth[pc] > 0 && writes_var(pAi, idx, pc, var)) {
+            return false;
+        }
+    }
+    // Jumps into the loop body
+    for(pc = 1; pc < vm->code_size; pc++) {
+        if(p_depth[pc] > 0 && (pc < start || pc > next)) {
+            uint16_t num = successors(vm, pc, pAi->a_succ, pAi->a_delta);
+            for(uint16_t i = 0; i < num; i++) {
+                if(pAi->a_succ[i] > start && pAi->a_succ[i] <= next) {
+                    return false;
+                }
+            }
+        }
+    }
+    for(pc = start; pc <= next; pc++) {
+        p_mult[pc] = sat_mul(p_mult[pc], count);
+    }
+    return true;
+}
+
+// Instruction (or called subroutine) writes the variable
+static bool writes_var(ana_inst_t *pAi, uint16_t idx, nb_addr_t pc, uint8_t var) {
+    t_VM *vm = pAi->vm;
+    uint8_t instr = CODE_SEG(vm, pc)[pc];
+
+    if(written_var(vm, pc) >= 0) {
+        return written_var(vm, pc) == var;
+    }
+    if(instr == k_GOSUB_N3 || instr == k_ON_GOSUB_N2) {
+        uint8_t cnt = instr == k_GOSUB_N3 ? 1 : CODE_SEG(vm, pc)[pc + 1];
+        for(uint8_t i = 0; i < cnt; i++) {
+            nb_addr_t target = instr == k_GOSUB_N3 ? ACS_ADDR(CODE_SEG(vm, pc)[pc + 1]) : ACS_ADDR(CODE_SEG(vm, pc)[pc + 3 + i * k_JUMP_LEN]);
+            sub_t *p_callee = &pAi->p_sub[analyze_sub(pAi, target)];
+            if(p_callee->written[var / 8] & (1 << (var % 8))) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+** Store the possible next instructions and the stack depth change
+** for each of them, return the number of successors
+*/
+static uint16_t successors(t_VM *vm, nb_addr_t pc, nb_addr_t *p_addr, int8_t *p_delta) {
+    uint8_t instr = CODE_SEG(vm, pc)[pc];
+    uint8_t num;
+
+    switch(instr) {
+    case k_END:
+    case k_RETURN_N1:
+    case k_RETI_N1:
+    case k_LAZY_LINE_N3:
+        return 0;
+    case k_GOTO_N3:
+    case k_GOTO_R2:
+        p_addr[0] = jump_addr(vm, pc);
+        p_delta[0] = 0;
+        return 1;
+    case k_GOSUB_N3:
+        p_addr[0] = pc + k_JUMP_LEN;
+        p_delta[0] = 0;
+        return 1;
+    case k_IF_N3:
+    case k_IF_TRUE_N3:
+    case k_IF_R2:
+    case k_IF_TRUE_R2:
+        p_addr[0] = jump_addr(vm, pc);
+        p_addr[1] = pc + nb_instr_len(&CODE_SEG(vm, pc)[pc]);
+        p_delta[0] = p_delta[1] = -1;
+        return 2;
+    case k_NEXT_N4:
+    case k_NEXT_R3:
+        // Loop or remove the step and end value
+        p_addr[0] = jump_addr(vm, pc);
+        p_addr[1] = pc + nb_instr_len(&CODE_SEG(vm, pc)[pc]);
+        p_delta[0] = 0;
+        p_delta[1] = -2;
+        return 2;
+    case k_ON_GOTO_N2:
+        // The list of GOTO instructions or behind the list
+        num = CODE_SEG(vm, pc)[pc + 1];
+        for(uint16_t i = 0; i <= num; i++) {
+            p_addr[i] = pc + 2 + i * k_JUMP_LEN;
+            p_delta[i] = -1;
+        }
+        return num + 1;
+    case k_SELECT_TAB_N6:
+    case k_SELECT_BIN_N2:
+        // The same for the list of a SELECT statement
+        num = instr == k_SELECT_TAB_N6 ? CODE_SEG(vm, pc)[pc + 5] : CODE_SEG(vm, pc)[pc + 1];
+        pc += nb_instr_len(&CODE_SEG(vm, pc)[pc]);
+        for(uint16_t i = 0; i <= num; i++) {
+            p_addr[i] = pc + i * k_JUMP_LEN;
+            p_delta[i] = -1;
+        }
+        return num + 1;
+    case k_ON_GOSUB_N2:
+        p_addr[0] = pc + 2 + CODE_SEG(vm, pc)[pc + 1] * k_JUMP_LEN;
+        p_delta[0] = -1;
+        return 1;
+    case k_PRINT_LIST_N2:
+        p_addr[0] = pc + k_PRINT_LIST_LEN(CODE_SEG(vm, pc)[pc + 1]);
+        p_delta[0] = -CODE_SEG(vm, pc)[pc + 1];
+        return 1;
+    default:
+        p_addr[0] = pc + nb_instr_len(&CODE_SEG(vm, pc)[pc]);
+        p_delta[0] = stack_effect(instr);
+        return 1;
+    }
+}
+
+// Target address of a jump instruction (absolute or relative)
+static nb_addr_t jump_addr(t_VM *vm, nb_addr_t pc) {
+    switch(CODE_SEG(vm, pc)[pc]) {
+    case k_GOTO_R2:
+    case k_IF_R2:
+    case k_IF_TRUE_R2:
+    case k_NEXT_R3:
+        return pc + (int8_t)CODE_SEG(vm, pc)[pc + 1];
+    default:
+        return ACS_ADDR(CODE_SEG(vm, pc)[pc + 1]);
+    }
+}
+
+// Variable written by the instruction, -1 = none
+static int16_t written_var(t_VM *vm, nb_addr_t pc) {
+    uint8_t instr = CODE_SEG(vm, pc)[pc];
+
+    switch(instr) {
+    case k_POP_VAR_N2:
+    case k_STORE_VAR_N2:
+        return CODE_SEG(vm, pc)[pc + 1];
+    case k_NEXT_N4:
+        return CODE_SEG(vm, pc)[pc + k_NEXT_LEN - 1];
+    case k_NEXT_R3:
+        return CODE_SEG(vm, pc)[pc + 2];
+    default:
+        if(instr >= k_POP_VAR0_N1 && instr < k_POP_VAR0_N1 + k_NUM_SHORT) {
+            return instr - k_POP_VAR0_N1;
+        }
+        return -1;
+    }
+}
+
+// Stack depth change of all other instructions
+static int8_t stack_effect(uint8_t instr) {
+    switch(instr) {
+    case k_PUSH_STR_N3:
+    case k_PUSH_NUM_N5:
+    case k_PUSH_NUM_N2:
+    case k_PUSH_VAR_N2:
+    case k_READ_NUM_N1:
+    case k_READ_STR_N1:
+    case k_PARAM_N1:
+    case k_PARAMS_N1:
+        return 1;
+    case k_POP_VAR_N2:
+    case k_POP_STR_N2:
+    case k_DIM_ARR_N2:
+    case k_ADD_N1:
+    case k_SUB_N1:
+    case k_MUL_N1:
+    case k_DIV_N1:
+    case k_MOD_N1:
+    case k_AND_N1:
+    case k_OR_N1:
+    case k_EQUAL_N1:
+    case k_NOT_EQUAL_N1:
+    case k_LESS_N1:
+    case k_LESS_EQU_N1:
+    case k_GREATER_N1:
+    case k_GREATER_EQU_N1:
+    case k_RESTORE_N1:
+    case k_PUSH_PARAM_N1:
+    case k_ADD_STR_N1:
+    case k_STR_EQUAL_N1:
+    case k_STR_NOT_EQU_N1:
+    case k_STR_LESS_N1:
+    case k_STR_LESS_EQU_N1:
+    case k_STR_GREATER_N1:
+    case k_STR_GREATER_EQU_N1:
+    case k_LEFT_STR_N1:
+    case k_RIGHT_STR_N1:
+    case k_ALLOC_STR_N1:
+        return -1;
+    case k_SET_ARR_ELEM_N2:
+    case k_SET_ARR_1BYTE_N2:
+    case k_SET_ARR_2BYTE_N2:
+    case k_SET_ARR_4BYTE_N2:
+    case k_MID_STR_N1:
+    case k_INSTR_N1:
+        return -2;
+    case k_COPY_N1:
+        return -5;
+    default:
+        if(instr >= k_PUSH_VAR0_N1 && instr < k_PUSH_VAR0_N1 + k_NUM_SHORT) {
+            return 1;
+        }
+        if(instr >= k_POP_VAR0_N1 && instr < k_POP_VAR0_N1 + k_NUM_SHORT) {
+            return -1;
+        }
+        if(instr >= k_PUSH_NUM0_N1 && instr < k_PUSH_NUM0_N1 + k_NUM_SHORT) {
+            return 1;
+        }
+        return 0;
+    }
+}
+
+/*
+** Number of iterations of the FOR loop at 'addr' with constant start, end,
+** and step values (the body is executed at least once), 0 = unknown
+*/
+static uint32_t for_loop_count(t_VM *vm, nb_addr_t addr, uint8_t var) {
+    int32_t start, end, step;
+    nb_addr_t pc = addr + 1;
+
+    // (start value popped into the loop variable)
+    if(!const_value(vm, &pc, &start) || written_var(vm, pc) != var || stack_effect(CODE_SEG(vm, pc)[pc]) != -1) {
+        return 0;
+    }
+    pc += nb_instr_len(&CODE_SEG(vm, pc)[pc]);
+    if(!const_value(vm, &pc, &end) || !const_value(vm, &pc, &step) || step == 0) {
+        return 0;
+    }
+    // The loop variable must not overflow
+    if(step > 0) {
+        if((int64_t)end + step > INT32_MAX) {
+            return 0;
+        }
+        return end > start ? ((int64_t)end - start) / step + 1 : 1;
+    }
+    if((int64_t)end + step < INT32_MIN) {
+        return 0;
+    }
+    return start > end ? ((int64_t)start - end) / -(int64_t)step + 1 : 1;
+}
+
+static bool const_value(t_VM *vm, nb_addr_t *p_pc, int32_t *p_value) {
+    uint8_t instr = CODE_SEG(vm, *p_pc)[*p_pc];
+
+    if(instr >= k_PUSH_NUM0_N1 && instr < k_PUSH_NUM0_N1 + k_NUM_SHORT) {
+        *p_value = instr - k_PUSH_NUM0_N1;
+        *p_pc += 1;
+        return true;
+    }
+    if(CODE_SEG(vm, *p_pc)[*p_pc] == k_PUSH_NUM_N2) {
+        *p_value = CODE_SEG(vm, *p_pc)[*p_pc + 1];
+        *p_pc += 2;
+        return true;
+    }
+    if(CODE_SEG(vm, *p_pc)[*p_pc] == k_PUSH_NUM_N5) {
+        *p_value = (int32_t)ACS32(CODE_SEG(vm, *p_pc)[*p_pc + 1]);
+        *p_pc += 5;
+        return true;
+    }
+    return false;
+}
+
+static uint32_t sat_add(uint32_t a, uint32_t b) {
+    uint64_t res = (uint64_t)a + b;
+    return res >= NB_UNBOUNDED ? NB_UNBOUNDED : res;
+}
+
+static uint32_t sat_mul(uint32_t a, uint32_t b) {
+    uint64_t res = (uint64_t)a * b;
+    return res >= NB_UNBOUNDED ? NB_UNBOUNDED : res;
+}
+
+static void unbounded(sub_t *p_sub, nb_addr_t from, nb_addr_t to) {
+    if(p_sub->cycles != NB_UNBOUNDED) {
+        p_sub->cycles = NB_UNBOUNDED;
+        p_sub->from = from;
+        p_sub->to = to;
+    }
+}
+
+// Line number of the code address, 0 = unknown
+static uint16_t line_of(t_VM *vm, nb_addr_t addr) {
+#ifdef cfg_TRACE_SUPPORT
+    while(addr > 0 && vm->trace[addr] == 0) {
+        addr--;
+    }
+    return vm->trace[addr];
+#elif defined(cfg_LINE_NUMBERS)
+    uint16_t linenum = 0;
+    nb_addr_t pc = 0;
+    for(uint16_t i = 0; i < vm->num_lines; i++) {
+        if(vm->p_line_map[i].pc <= addr && vm->p_line_map[i].pc >= pc) {
+            pc = vm->p_line_map[i].pc;
+            linenum = vm->p_line_map[i].linenum;
+        }
+    }
+    return linenum;
+#else
+    return 0;
+#endif
+}
+
+// Label or line number of the subroutine
+static void sub_name(t_VM *vm, nb_addr_t addr, char *p_name, uint16_t size) {
+#ifdef cfg_LINE_NUMBERS
+    for(uint16_t i = 0; i < vm->num_lines; i++) {
+        if(vm->p_line_map[i].pc == addr) {
+            snprintf(p_name, size, "%u", vm->p_line_map[i].linenum);
+            return;
+        }
+    }
+#else
+    for(uint16_t i = 0; i < vm->num_symbols; i++) {
+        if(vm->p_symbol[i].type == LABEL && vm->p_symbol[i].value == addr) {
+            snprintf(p_name, size, "%s", vm->p_symbol[i].name);
+            return;
+        }
+    }
+#endif
+    snprintf(p_name, size, "(%u)", addr);
+}
@@ -23,20 +23,29 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 #define cfg_STRING_SUPPORT     // enable string support
 //#define cfg_DATA_ACCESS        // enable byte access to arrays
 #define cfg_TRACE_SUPPORT      // enable trace support
+//#define cfg_WIDE_ADDRESSES     // 32 bit code addresses and heap references (for programs > 16 KB)
+//#define cfg_COMPACT_CODE       // denser code with short instructions and relative jumps
+//#define cfg_PROFILE            // profile-guided compilation (see 'nb_get_profile()')
 
 #define cfg_MAX_FOR_LOOPS       (4)   // nested FOR loops (2 values per FOR loop on the stack)
 #define cfg_STACK_SIZE          (32)  // value for stack size (expression, call stack)
 #define cfg_PARAMSTACK_SIZE     (8)   // value for parameter stack size
 #define cfg_NUM_VARS            (256) // in the range 8..256
 #define cfg_MAX_NUM_DATA        (200) // (list of constants)
-#define cfg_MAX_CODE_SIZE       (1024 * 16) // in 1k steps
 #define cfg_MEM_HEAP_SIZE       (1024 * 8) // in 1k steps
 #define cfg_MAX_MEM_BLOCK_SIZE  (512) // in 8 byte steps
 #define cfg_MAX_NUM_XFUNC       (32)  // number of external function definitions
 #define cfg_MAX_FW_DECL         (32)  // number of forward declarations (goto/gosub label)
+#define cfg_MAX_NUM_MODULES     (8)   // number of module definitions (IMPORT)
+
+#ifdef cfg_WIDE_ADDRESSES
+    #define cfg_MAX_CODE_SIZE   (1024 * 256) // in 1k steps
+#else
+    #define cfg_MAX_CODE_SIZE   (1024 * 16) // in 1k steps (max. 32 KB - 16)
+#endif
 
 #ifdef cfg_LINE_NUMBERS
-    #define cfg_MAX_NUM_SYM     (16000) // For keywords, variables, and line numbers
+    #define cfg_MAX_NUM_SYM     (512) // For keywords and variables (line numbers are stored separately)
 #else
     #define cfg_MAX_NUM_SYM     (256) // For keywords, variables, and labels
 #endif
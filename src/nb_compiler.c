@@ -28,10 +28,35 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 #include <setjmp.h>
 #include "nb.h"
 #include "nb_int.h"
+#include "nb_keywords.h"
 
 #define MAX_XFUNC_PARAMS    8
 #define MAX_CODE_PER_LINE   50 // aprox. max. 50 bytes per line
-#define BLOCKEND(tok)       (tok == ELSE || tok == ELSEIF || tok == NEXT || tok == ENDIF || tok == LOOP) 
+#define MAX_HOIST_EXPR      8  // max. number of hoisted expressions per loop
+#define MAX_CODE_EDITS      32 // max. number of code edits per optimized code block
+#define MAX_EXPRESSIONS     64 // max. number of analyzed expressions per code block
+#define NO_EXPR             0xFF
+#define EDIT_SIZE(p_edit)   ((p_edit)->num + ((p_edit)->instr != k_END ? 2 : 0)) // inserted bytes
+#define MAX_TEMP_VARS       16 // max. number of hidden temporary variables
+#define POOL_GROW_SIZE      256 // allocation steps of the string literal pool
+#define MAX_INLINE_SIZE     16 // max. code size of an inlined subroutine (without RETURN)
+#define MAX_HOT_INLINE_SIZE 48 // max. code size of a subroutine inlined at a hot call site (cfg_PROFILE)
+#define HOT_CALLS           100 // min. number of calls of a hot call site (cfg_PROFILE)
+#define NO_PROFILE          0xFFFFFFFF // execution count of a site without profile
+#define MAX_PROFILE_SITES   0xFFFF // max. number of profile sites
+#define PROFILE_HDR_SIZE    10 // "NP", version, reserved, 32 bit source hash, 16 bit number of sites
+#define PROFILE_VERSION     1
+#define MAX_PRINT_ITEMS     8  // max. number of items of a PRINT_LIST instruction
+#define MAX_CASE_VALUES     255 // max. number of constants of a SELECT CASE statement
+#define MAX_CONST_VALUES    1024 // max. number of values of a constant array
+#define LEX_ERROR           0xFF // token type of scanner errors, reported by the parser
+#define LINE_FIRST          0x01 // first source line of a top-level statement
+#define LINE_DECL           0x02 // source line with DIM or CONST
+#define LINE_DATA           0x04 // source line with DATA
+#define LINE_INLINED        0x08 // source line with code of an inlined subroutine
+#define MODE_PROGRAM        0 // compile the complete program
+#define MODE_LAZY           1 // compile the main program, the lines behind on first use
+#define MODE_MODULE         2 // compile a module for IMPORT
 
 // Expression result types
 typedef enum type_t {
@@ -41,6 +66,7 @@ typedef enum type_t {
     e_REF = NB_REF,
     e_ANY = NB_ANY,
     e_CNST,
+    e_CARR, // constant array
 } type_t;
 
 // Define external function
@@ -51,176 +77,346 @@ typedef struct {
 } xfunc_t;
 
 typedef struct {
-    uint8_t idx;
-    uint16_t pos;
+    uint16_t idx;       // symbol index or line number (cfg_LINE_NUMBERS)
+    nb_addr_t pos;
 } fwdecl_t;
 
+// Precompiled module, shared by the programs which import it
+typedef struct {
+    char     name[k_MAX_SYM_LEN];
+    uint8_t *p_code;    // code segment of the module: [0][jump over the module][module code]
+    nb_addr_t code_size; // size of the code segment, start address of the importing programs
+    uint32_t hash;      // hash value (FNV-1a) of the code segment
+    sym_t   *p_symbol;  // external functions, variables, and labels of the module
+    uint16_t num_symbols;
+    line_t  *p_line_map; // (cfg_LINE_NUMBERS)
+    uint16_t num_lines;
+    char    *p_pool;    // string literals of the module code
+    uint16_t pool_size;
+} module_t;
+
+// Token of the pre-scanned source code
+typedef struct {
+    uint32_t value;     // number or symbol index
+    uint32_t text;      // offset of the token text in the text buffer
+    uint8_t  tok;       // token type, 0 = end of line
+    bool     colon;     // directly followed by ':'
+} token_t;
+
+// Code edit of the optimizer: Replace 'len' bytes at 'pos' (or insert with 'len' = 0)
+// by 'num' bytes copied from 'src', followed by a two byte variable instruction
+// (without for 'instr' = k_END)
+typedef struct {
+    nb_addr_t pos;
+    uint16_t len;
+    nb_addr_t src;
+    uint16_t num;
+    uint8_t  instr;
+    uint8_t  var;
+} edit_t;
+
+// Numeric expression without side effects (code optimizer)
+typedef struct {
+    nb_addr_t pos;      // code position of the first instruction
+    uint16_t len;       // expression size in bytes
+    uint16_t block;     // number of the basic block
+    bool     invariant; // expression does not change within the loop
+    bool     maximal;   // invariant and not part of a larger invariant expression
+} expr_t;
+
+// Value on the simulated data stack (code optimizer)
+typedef struct {
+    nb_addr_t start;    // code position of the first instruction
+    nb_addr_t end;      // code position behind the last instruction
+    bool     pure;      // value is computed without side effects
+    bool     invariant; // value does not change within the loop
+    bool     simple;    // value is pushed by a single instruction
+    uint8_t  idx;       // index in the expression list or NO_EXPR
+} value_t;
+
+// CASE constant of a SELECT statement and the code address of its branch
+typedef struct {
+    int32_t  value;
+    nb_addr_t addr;
+} case_t;
+
+// Compiler context, one per compilation
 typedef struct {
     void    *file_ptr;
+    nb_get_code_line_t get_line; // line reader of 'nb_compile()'
+    const char *p_src;  // source code buffer or NULL (read via 'get_line()')
+    size_t   src_len;
+    size_t   src_pos;   // start of the next line in the source code buffer
+    sym_t   *p_symbol;  // external functions (copy), variables, and labels
+    uint16_t *p_sym_hash; // hash index of the symbol table (symbol index + 1, 0 = free)
+    uint16_t hash_mask;
+    uint16_t num_sym;   // number of used symbol table entries
+    line_t  *p_line_map;
+    uint16_t num_line_map; // number of line number map entries
+    uint16_t max_line_map; // allocated line number map entries
+    src_line_t *p_src_lines; // source line info (cfg_LINE_NUMBERS)
+    uint16_t num_src_lines;
+    uint16_t max_src_lines;
+    uint16_t src_idx;   // index of the next line in 'p_src_lines' for 'get_line()'
+    nb_addr_t stmt_pc;  // code address of the current top-level statement
+    bool     stmt_first; // the next line starts a new top-level statement
+    bool     incremental; // source lines are scanned on demand by 'get_line()'
+    nb_addr_t data_pc;  // code address of the first DATA statement, 0 = none
+    lazy_line_t *p_lazy; // lines compiled on first use (cfg_LINE_NUMBERS)
+    uint16_t num_lazy;
+    bool     lazy;      // compile only the main program (cfg_LINE_NUMBERS)
+    bool     module;    // compile a module (without IMPORT and DATA)
+    uint8_t  last_tok;  // keyword of the last compiled statement
+    nb_addr_t gosub_end; // code address behind the last GOSUB of the line (tail call)
+    src_line_t *p_old_lines; // unchanged source lines in front (incremental compilation)
+    uint16_t num_old_lines;
+    uint8_t  curr_var_idx;
     fwdecl_t a_forward_decl[cfg_MAX_FW_DECL];
     uint8_t  num_fw_decls;
     uint8_t *p_code;
     uint16_t *p_trace;
-    uint16_t pc;
+    const module_t *p_import; // imported module
+    const uint8_t *p_mod_code; // shared code of the imported module (addresses below 'mod_end')
+    nb_addr_t mod_end;  // start of the program code behind the module, 0 = no module
+    nb_addr_t pc;
     uint16_t linenum;
+    uint16_t mod_linenum; // last line number of the imported module (cfg_LINE_NUMBERS)
     uint16_t err_count;
     uint16_t sym_idx;
     char     a_line[k_MAX_LINE_LEN];
-    char     a_buff[k_MAX_LINE_LEN];
+    token_t *p_token;   // token array of the complete source code
+    uint32_t num_tokens;
+    uint32_t max_tokens;
+    char    *p_text;    // token texts
+    uint32_t text_size;
+    uint32_t max_text;
+    uint32_t tok_pos;   // index of the current token
+    uint32_t tok_next;  // index of the next token, equal to 'tok_pos' if not yet read
+    char    *p_buff;    // text of the current token
     uint32_t a_data[cfg_MAX_NUM_DATA];
     uint8_t  data_idx;
-    char    *p_pos;
-    char    *p_next;
+    char    *p_pool;    // string literal pool, placed behind the data section
+    uint32_t pool_size;
+    uint32_t max_pool;
     uint32_t value;
     uint8_t  next_tok;
     bool     first_data_declaration;
+    bool     label_defined;
+    edit_t   a_edit[MAX_CODE_EDITS];
+    uint8_t  num_edits;
+    nb_addr_t edit_start;
+    nb_addr_t edit_end;
+    uint16_t num_lines;
+    uint8_t  a_temp[MAX_TEMP_VARS];
+    uint8_t  num_temps;
+    uint32_t num_sites; // number of profile sites (IF branches, WHILE loops, GOSUB calls)
+#ifdef cfg_PROFILE
+    uint32_t src_hash;  // hash value (FNV-1a) of the complete source code
+    bool     prof_collect; // emit a profile counter per site
+    uint16_t *p_profile; // execution counts of the sites of the previous runs
+    uint16_t num_profile;
+#endif
     jmp_buf  jmp_buf;
 } comp_inst_t;
 
-static xfunc_t a_XFuncs[cfg_MAX_NUM_XFUNC] = {0};
-static uint8_t NumXFuncs = 0;
-static sym_t a_Symbol[cfg_MAX_NUM_SYM] = {0};
-static uint8_t CurrVarIdx = 0;
-static uint16_t StartOfVars = 0;
-static comp_inst_t *pCi = NULL;
-
-static bool get_line(void);
-static uint8_t next_token(void);
-static uint8_t lookahead(void);
-static bool end_of_line(void);
-static uint8_t next(void);
-static void match(uint8_t expected);
+#ifdef cfg_LINE_NUMBERS
+// Code moved by the incremental compilation
+typedef struct {
+    line_t  *p_old_map;  // line number map of the previous compilation
+    uint16_t num_old_map;
+    nb_addr_t start;     // code address of the recompiled statements
+    nb_addr_t end;       // previous code address behind the recompiled statements
+    int32_t  delta;      // move distance of the code behind
+} relink_t;
+#endif
+
+// Set-up state shared by all compilations: It is written by 'nb_define_external_function()'
+// and 'nb_define_module()', and frozen by the first 'nb_create()'. The compilers only read it.
+typedef struct {
+    xfunc_t  a_xfuncs[cfg_MAX_NUM_XFUNC];
+    uint8_t  num_xfuncs;
+    sym_t    a_keyword[cfg_MAX_NUM_XFUNC]; // names of the external functions
+    uint16_t start_of_vars;
+    module_t a_modules[cfg_MAX_NUM_MODULES];
+    uint8_t  num_modules;
+    bool     frozen;
+} setup_t;
+
+static setup_t Setup = {0};
+
+static t_VM *vm_create(void);
+static uint16_t compile(t_VM *vm, void *fp, nb_get_code_line_t get_line, const char *p_src, size_t len, uint8_t mode);
+#ifdef cfg_LINE_NUMBERS
+static uint16_t recompile(t_VM *vm, const char *p_src, size_t len);
+static comp_inst_t *comp_inst_resume(t_VM *vm, uint16_t num_map);
+static void comp_inst_free(comp_inst_t *pCi);
+static bool unit_end(comp_inst_t *pCi);
+static bool lazy_index(comp_inst_t *pCi);
+static lazy_line_t *lazy_get(lazy_line_t *p_lazy, uint16_t num, uint16_t linenum);
+static nb_addr_t lazy_stub(comp_inst_t *pCi, uint16_t linenum);
+static bool relink_code(comp_inst_t *pCi, relink_t *p_rl, nb_addr_t start, nb_addr_t end);
+static nb_addr_t relink_addr(comp_inst_t *pCi, relink_t *p_rl, nb_addr_t addr);
+#endif
+static void tokenize(comp_inst_t *pCi);
+static void token_init(comp_inst_t *pCi);
+static bool tokenize_line(comp_inst_t *pCi);
+static char *read_line(comp_inst_t *pCi, uint16_t *p_len);
+#ifdef cfg_LINE_NUMBERS
+static uint32_t line_hash(const char *p_line, uint16_t len);
+static src_line_t *src_line_add(comp_inst_t *pCi, const char *p_line, uint16_t len);
+#endif
+static uint8_t scan_token(char *p_buff, uint16_t len, uint32_t *p_value);
+static void reserve_text(comp_inst_t *pCi);
+static void add_token(comp_inst_t *pCi, uint8_t tok, uint16_t len, uint32_t value, bool colon);
+static void skip_line(comp_inst_t *pCi);
+static bool get_line(comp_inst_t *pCi);
+static bool get_stmt(comp_inst_t *pCi);
+static uint8_t next_token(comp_inst_t *pCi);
+static uint8_t lookahead(comp_inst_t *pCi);
+static bool end_of_line(comp_inst_t *pCi);
+static uint8_t next(comp_inst_t *pCi);
+static void match(comp_inst_t *pCi, uint8_t expected);
 #ifndef cfg_LINE_NUMBERS
-static void label(void);
-#endif
-static void compile_block(void);
-static void compile_line(void);
-static void compile_stmts(void);
-static void compile_stmt(void);
-static void compile_for(void);
-static void compile_if_V2(uint16_t pos1);
-static void compile_if(void);
-static void compile_goto(void);
-static void compile_gosub(void);
-static void compile_return(void);
-static void compile_var(uint8_t type);
-static void compile_dim(void);
-static void remark(void);
-static void compile_print(void);
-static void compile_string(void);
-static void compile_end(void);
-static type_t compile_xfunc(uint8_t type);
-static void compile_break(void);
+static void label(comp_inst_t *pCi);
+#endif
+static bool block_end(comp_inst_t *pCi, uint8_t tok);
+static void compile_block(comp_inst_t *pCi);
+static void compile_line(comp_inst_t *pCi);
+static void compile_stmts(comp_inst_t *pCi);
+static void compile_stmt(comp_inst_t *pCi);
+static void compile_for(comp_inst_t *pCi);
+static void compile_if_V2(comp_inst_t *pCi, nb_addr_t pos1, int8_t cond);
+static void compile_if(comp_inst_t *pCi);
+static nb_addr_t compile_condition(comp_inst_t *pCi, int8_t *p_cond);
+static void emit_jump(comp_inst_t *pCi, uint8_t instr, nb_addr_t *p_chain);
+static void emit_addr(comp_inst_t *pCi, nb_addr_t addr);
+static void patch_jumps(comp_inst_t *pCi, nb_addr_t pos, nb_addr_t addr);
+static bool dead_branch_begin(comp_inst_t *pCi);
+static bool dead_branch_end(comp_inst_t *pCi, nb_addr_t pos, bool label, bool dead);
+static void compile_goto(comp_inst_t *pCi);
+static void compile_gosub(comp_inst_t *pCi);
+static void compile_return(comp_inst_t *pCi);
+static bool inline_subroutine(comp_inst_t *pCi, nb_addr_t addr, uint16_t max_size);
+static uint32_t profile_site(comp_inst_t *pCi);
+static uint32_t profile_count(comp_inst_t *pCi, uint32_t site);
+static bool swap_branches(comp_inst_t *pCi, nb_addr_t start, nb_addr_t pos1, nb_addr_t pos2);
+static void relocate_jumps(comp_inst_t *pCi, nb_addr_t start, nb_addr_t end, nb_addr_t last, nb_addr_t offs);
+static bool rotate_loop(comp_inst_t *pCi, nb_addr_t pos1, nb_addr_t pos2);
+#ifdef cfg_LINE_NUMBERS
+static void mark_inlined_lines(src_line_t *p_lines, uint16_t num, nb_addr_t addr, nb_addr_t end);
+#endif
+static void compile_var(comp_inst_t *pCi, uint8_t type);
+static void compile_dim(comp_inst_t *pCi);
+static void remark(comp_inst_t *pCi);
+static void compile_print(comp_inst_t *pCi);
+static void print_list(comp_inst_t *pCi, nb_addr_t pos, uint8_t *p_format, uint8_t num);
+static bool may_fail(comp_inst_t *pCi, nb_addr_t start, nb_addr_t end);
+static void compile_string(comp_inst_t *pCi);
+static void compile_end(comp_inst_t *pCi);
+static type_t compile_xfunc(comp_inst_t *pCi, uint8_t type);
+static void compile_break(comp_inst_t *pCi);
 #ifdef cfg_DATA_ACCESS
-static void compile_set1(void);
-static void compile_set2(void);
-static void compile_set4(void);
-static void compile_copy(void);
-static void compile_set(uint8_t instr);
-static void compile_get(uint8_t tok, uint8_t instr);
-static void compile_reti(void);
-#endif
-static void compile_erase(void);
-static void compile_on(void);
-static uint8_t list_of_numbers(void);
-static void compile_data(void);
-static void compile_read(void);
-static void compile_restore(void);
-static void compile_const(void);
-static void compile_while(void);
-static void compile_tron(void);
-static void compile_troff(void);
-static void compile_free(void);
-static uint16_t sym_add(char *id, uint32_t val, uint8_t type);
-static uint16_t sym_get(char *id);
-static void trace_print(void);
-static void remove_trace(void);
-static void error(char *err, char *id);
-static uint8_t get_num_vars(void);
-static void add_default_params(uint8_t num);
-static void forward_declaration(uint16_t idx, uint16_t pos);
-static void resolve_forward_declarations(void);
-static void append_data_to_code(t_VM *vm);
-static type_t compile_expression(type_t type);
-static type_t compile_and_expr(void);
-static type_t compile_not_expr(void);
-static type_t compile_comp_expr(void);
-static type_t compile_add_expr(void);
-static type_t compile_term(void);
-static type_t compile_neg_factor(void);
-static type_t compile_factor(void);
+static void compile_set1(comp_inst_t *pCi);
+static void compile_set2(comp_inst_t *pCi);
+static void compile_set4(comp_inst_t *pCi);
+static void compile_copy(comp_inst_t *pCi);
+static void compile_set(comp_inst_t *pCi, uint8_t instr);
+static void compile_get(comp_inst_t *pCi, uint8_t tok, uint8_t instr);
+static void compile_reti(comp_inst_t *pCi);
+#endif
+static void compile_erase(comp_inst_t *pCi);
+static void compile_on(comp_inst_t *pCi);
+static uint8_t list_of_numbers(comp_inst_t *pCi);
+static void compile_data(comp_inst_t *pCi);
+static void compile_read(comp_inst_t *pCi);
+static void compile_restore(comp_inst_t *pCi);
+static void compile_const(comp_inst_t *pCi);
+static void compile_const_array(comp_inst_t *pCi, uint16_t idx);
+static void compile_while(comp_inst_t *pCi);
+static void compile_select(comp_inst_t *pCi);
+static int32_t const_value(comp_inst_t *pCi);
+static void emit_select(comp_inst_t *pCi, case_t *p_case, uint16_t num, nb_addr_t other);
+static void compile_tron(comp_inst_t *pCi);
+static void compile_troff(comp_inst_t *pCi);
+static void compile_free(comp_inst_t *pCi);
+static void compile_import(comp_inst_t *pCi);
+static void module_import(comp_inst_t *pCi, char *p_name);
+static uint16_t sym_add(comp_inst_t *pCi, char *id, uint32_t val, uint8_t type);
+static uint16_t sym_insert(comp_inst_t *pCi, char *sym, uint32_t hash, uint32_t val, uint8_t type);
+static uint16_t sym_get(comp_inst_t *pCi, char *id);
+static void keyword_add(char *name, uint32_t val, uint8_t type);
+static uint8_t keyword_get(char *sym, uint32_t hash);
+static bool sym_hash_init(comp_inst_t *pCi, uint16_t num);
+static void sym_resume(comp_inst_t *pCi);
+static uint32_t sym_name(char *id, char *sym);
+static uint16_t *sym_slot(comp_inst_t *pCi, char *sym, uint32_t hash);
+#ifdef cfg_LINE_NUMBERS
+static void line_add(comp_inst_t *pCi, uint16_t linenum, nb_addr_t pc);
+static nb_addr_t line_get(line_t *p_map, uint16_t num, uint16_t linenum);
+static uint16_t line_after(comp_inst_t *pCi, nb_addr_t addr);
+#endif
+static void trace_print(comp_inst_t *pCi);
+static void remove_trace(comp_inst_t *pCi);
+static void error(comp_inst_t *pCi, char *err, char *id);
+static uint8_t get_num_vars(comp_inst_t *pCi);
+static void add_default_params(comp_inst_t *pCi, uint8_t num);
+static void forward_declaration(comp_inst_t *pCi, uint16_t idx, nb_addr_t pos);
+static void resolve_forward_declarations(comp_inst_t *pCi);
+static void append_data_to_code(comp_inst_t *pCi, t_VM *vm);
+static bool pool_init(comp_inst_t *pCi, const char *p_pool, uint32_t size);
+static uint16_t pool_add(comp_inst_t *pCi, const void *p_data, uint32_t len);
+static uint16_t pool_string(comp_inst_t *pCi, const char *p_str);
+static void append_pool_to_code(comp_inst_t *pCi, t_VM *vm);
+#ifdef cfg_COMPACT_CODE
+static void compact_code(comp_inst_t *pCi);
+static bool is_jump(comp_inst_t *pCi, nb_addr_t pos);
+#endif
+static uint16_t instr_len(const uint8_t *p_code);
+static void hoist_loop_invariants(comp_inst_t *pCi, nb_addr_t start, uint8_t loop_var, bool while_loop);
+static void eliminate_common_subexpr(comp_inst_t *pCi, nb_addr_t start);
+static void add_common_subexpr(comp_inst_t *pCi, expr_t *p_expr, uint8_t *p_chain, uint8_t num, bool *p_used);
+static bool mark_block(comp_inst_t *pCi, nb_addr_t start, nb_addr_t end, uint8_t *p_target, bool *p_written, bool *p_used);
+static bool mark_labels(comp_inst_t *pCi, nb_addr_t start, nb_addr_t end, uint8_t *p_target);
+static uint8_t scan_expressions(comp_inst_t *pCi, nb_addr_t start, nb_addr_t end, uint8_t *p_target, bool *p_written, expr_t *p_expr);
+static void finish_values(value_t *p_val, uint8_t num, expr_t *p_expr);
+static bool same_expr(comp_inst_t *pCi, expr_t *p_expr1, expr_t *p_expr2);
+static bool is_modified(comp_inst_t *pCi, expr_t *p_expr, nb_addr_t from, nb_addr_t to);
+static bool is_replaced(comp_inst_t *pCi, nb_addr_t pos, uint16_t len);
+static void add_code_edit(comp_inst_t *pCi, nb_addr_t pos, uint16_t len, nb_addr_t src, uint16_t num, uint8_t instr, uint8_t var);
+static bool apply_code_edits(comp_inst_t *pCi, nb_addr_t start);
+static nb_addr_t map_code_addr(comp_inst_t *pCi, nb_addr_t addr);
+static bool get_temp_var(comp_inst_t *pCi, bool *p_used, uint8_t *p_var);
+static type_t compile_expression(comp_inst_t *pCi, type_t type);
+static type_t compile_and_expr(comp_inst_t *pCi);
+static type_t compile_not_expr(comp_inst_t *pCi);
+static type_t compile_comp_expr(comp_inst_t *pCi);
+static type_t compile_add_expr(comp_inst_t *pCi);
+static type_t compile_term(comp_inst_t *pCi);
+static bool get_const_value(comp_inst_t *pCi, nb_addr_t pos, nb_addr_t end, uint32_t *p_value);
+static bool get_string_literal(comp_inst_t *pCi, nb_addr_t pos, nb_addr_t end, uint16_t *p_offs);
+#ifdef cfg_STRING_SUPPORT
+static bool literal_operand(comp_inst_t *pCi, nb_addr_t pos1, nb_addr_t pos2, uint16_t *p_offs);
+#endif
+static bool fold_constants(comp_inst_t *pCi, nb_addr_t pos1, nb_addr_t pos2, uint8_t instr);
+static void emit_const(comp_inst_t *pCi, uint32_t value);
+static bool reduce_strength(comp_inst_t *pCi, uint8_t op, nb_addr_t pos, uint32_t value);
+static void magic_number(uint32_t div, int32_t *p_mul, uint8_t *p_shift);
+static type_t compile_neg_factor(comp_inst_t *pCi);
+static type_t compile_factor(comp_inst_t *pCi);
 
 /*************************************************************************************************
 ** API functions
 *************************************************************************************************/
 void nb_init(void) {
-    // Add keywords
-    sym_add("let", 0, LET);
-    sym_add("dim", 0, DIM);
-    sym_add("for", 0, FOR);
-    sym_add("to", 0, TO);
-    sym_add("step", 0, STEP);
-    sym_add("next", 0, NEXT);
-    sym_add("if", 0, IF);
-    sym_add("then", 0, THEN);
-    sym_add("else", 0, ELSE);
-    sym_add("elseif", 0, ELSEIF);
-    sym_add("end", 0, END);
-    sym_add("while", 0, WHILE);
-    sym_add("loop", 0, LOOP);
-    sym_add("endif", 0, ENDIF);
-    sym_add("print", 0, PRINT);
-    sym_add("goto", 0, GOTO);
-    sym_add("gosub", 0, GOSUB);
-    sym_add("return", 0, RETURN);
-    sym_add("end", 0, END);
-    sym_add("rem", 0, REM);
-    sym_add("and", 0, AND);
-    sym_add("or", 0, OR);
-    sym_add("not", 0, NOT);
-    sym_add("mod", 0, MOD);
-    sym_add("break", 0, BREAK);
-    sym_add("data", 0, DATA);
-    sym_add("read", 0, READ);
-    sym_add("restore", 0, RESTORE);
-    sym_add("param$", 0, PARAMS);
-    sym_add("param", 0, PARAM);
-#ifdef cfg_DATA_ACCESS
-    sym_add("set1", 0, SET1);
-    sym_add("set2", 0, SET2);
-    sym_add("set4", 0, SET4);
-    sym_add("get1", 0, GET1);
-    sym_add("get2", 0, GET2);
-    sym_add("get4", 0, GET4);
-    sym_add("copy", 0, COPY);
-    sym_add("ref", 0, REF);
-    sym_add("reti", 0, RETI);
-#endif
-#ifdef cfg_STRING_SUPPORT    
-    sym_add("left$", 0, LEFTS);
-    sym_add("right$", 0, RIGHTS);
-    sym_add("mid$", 0, MIDS);
-    sym_add("len", 0, LEN);
-    sym_add("val", 0, VAL);
-    sym_add("str$", 0, STRS);
-    sym_add("spc", 0, SPC);
-    sym_add("hex$", 0, HEXS);
-    sym_add("nil", 0, NIL);
-    sym_add("string$", 0, STRINGS);
-#endif
-    sym_add("const", 0, CONST);
-    sym_add("erase", 0, ERASE);
-    sym_add("instr", 0, INSTR);
-    sym_add("on", 0, ON);
-    sym_add("tron", 0, TRON);
-    sym_add("troff", 0, TROFF);
-    sym_add("free", 0, FREE);
-    sym_add("rnd", 0, RND);
-    StartOfVars = CurrVarIdx;
+    // Nothing to do, the keywords are part of the generated table 'nb_keywords.h'
 }
 
 uint8_t nb_define_external_function(char *name, uint8_t num_params, uint8_t *types, uint8_t return_type) {
-    if(NumXFuncs >= cfg_MAX_NUM_XFUNC) {
+    if(Setup.frozen) {
+        nb_print("Error: external functions have to be defined before 'nb_create()'\n");
+        return 0;
+    }
+    if(Setup.num_xfuncs >= cfg_MAX_NUM_XFUNC) {
         nb_print("Error: too many external functions\n");
         return 0;
     }
@@ -228,84 +424,233 @@ uint8_t nb_define_external_function(char *name, uint8_t num_params, uint8_t *typ
         nb_print("Error: too many parameters\n");
         return 0;
     }
-    sym_add(name, NumXFuncs, XFUNC);
-    a_XFuncs[NumXFuncs].num_params = num_params;
-    a_XFuncs[NumXFuncs].return_type = return_type;
+    keyword_add(name, Setup.num_xfuncs, XFUNC);
+    Setup.a_xfuncs[Setup.num_xfuncs].num_params = num_params;
+    Setup.a_xfuncs[Setup.num_xfuncs].return_type = return_type;
     for(uint8_t i = 0; i < num_params; i++) {
-        a_XFuncs[NumXFuncs].type[i] = types[i];
+        Setup.a_xfuncs[Setup.num_xfuncs].type[i] = types[i];
     }
-    StartOfVars = CurrVarIdx;
-    return NB_XFUNC + NumXFuncs++;
+    return NB_XFUNC + Setup.num_xfuncs++;
 }
 
-void *nb_create(void) {
-    t_VM *vm = malloc(sizeof(t_VM));
-    if(vm != NULL) {
-        memset(vm, 0, sizeof(t_VM));
-        nb_mem_init(vm);
-        vm->pc = 1;
-        //srand(time(NULL));
+uint16_t nb_define_module(char *name, const char *p_src, size_t len) {
+    module_t *p_mod = NULL;
+    char sym[k_MAX_SYM_LEN];
+    uint16_t err_count;
+
+    if(Setup.frozen) {
+        nb_print("Error: modules have to be defined before 'nb_create()'\n");
+        return 1;
     }
-    return vm;
+    sym_name(name, sym);
+    for(uint8_t i = 0; i < Setup.num_modules; i++) {
+        if(strcmp(Setup.a_modules[i].name, sym) == 0) {
+            p_mod = &Setup.a_modules[i]; // Redefinition
+        }
+    }
+    if(p_mod == NULL && Setup.num_modules >= cfg_MAX_NUM_MODULES) {
+        nb_print("Error: too many modules\n");
+        return 1;
+    }
+    t_VM *vm = vm_create();
+    if(vm == NULL) {
+        nb_print("Error: out of memory\n");
+        return 1;
+    }
+    err_count = compile(vm, NULL, NULL, p_src, len, MODE_MODULE);
+    if(err_count == 0) {
+        // The module code ends in front of the END instruction
+        nb_addr_t size = vm->data_start_addr - 2;
+        uint16_t pool_size = vm->code_size - vm->str_pool_addr;
+        uint8_t *p_code = malloc(size + k_JUMP_LEN);
+        sym_t *p_symbol = malloc(vm->num_symbols * sizeof(sym_t));
+        line_t *p_line_map = malloc((vm->num_lines > 0 ? vm->num_lines : 1) * sizeof(line_t));
+        char *p_pool = malloc(pool_size > 0 ? pool_size : 1);
+        if(p_code == NULL || p_symbol == NULL || p_line_map == NULL || p_pool == NULL) {
+            nb_print("Error: out of memory\n");
+            free(p_code);
+            free(p_symbol);
+            free(p_line_map);
+            free(p_pool);
+            nb_destroy(vm);
+            return 1;
+        }
+        memcpy(p_code, vm->code, size);
+        ACS_ADDR(p_code[2]) = size; // The programs start behind the module
+        // The code falling through the module end continues with the program
+        p_code[size] = k_GOTO_N3;
+        ACS_ADDR(p_code[size + 1]) = size;
+        memcpy(p_symbol, vm->p_symbol, vm->num_symbols * sizeof(sym_t));
+        if(vm->num_lines > 0) {
+            memcpy(p_line_map, vm->p_line_map, vm->num_lines * sizeof(line_t));
+        }
+        memcpy(p_pool, &vm->code[vm->str_pool_addr], pool_size);
+        // The entry is complete before it is added or replaces the previous one
+        module_t mod;
+        strcpy(mod.name, sym);
+        mod.p_code = p_code;
+        mod.code_size = size;
+        mod.hash = 2166136261u;
+        for(nb_addr_t i = 0; i < size; i++) {
+            mod.hash = (mod.hash ^ p_code[i]) * 16777619u;
+        }
+        mod.p_symbol = p_symbol;
+        mod.num_symbols = vm->num_symbols;
+        mod.p_line_map = p_line_map;
+        mod.num_lines = vm->num_lines;
+        mod.p_pool = p_pool;
+        mod.pool_size = pool_size;
+        if(p_mod == NULL) {
+            Setup.a_modules[Setup.num_modules] = mod;
+            Setup.num_modules++;
+        } else {
+            module_t old = *p_mod;
+            *p_mod = mod;
+            free(old.p_code);
+            free(old.p_symbol);
+            free(old.p_line_map);
+            free(old.p_pool);
+        }
+    }
+    nb_destroy(vm);
+    return err_count;
 }
 
-uint16_t nb_compile(void *pv_vm, void *fp) {
-    t_VM *vm = pv_vm;
-    uint16_t err_count = 0;
+void *nb_create(void) {
+    // From now on, the compilers can run in parallel
+    Setup.frozen = true;
+    return vm_create();
+}
 
-    pCi = malloc(sizeof(comp_inst_t));
-    if(pCi == NULL) {
-        printf("Error: out of memory\n");
-        return 1;
+bool nb_link_module(void *pv_vm) {
+    t_VM *vm = pv_vm;
+    if(vm->mod_end == 0) {
+        return true; // No module imported
     }
-    memset(pCi, 0, sizeof(comp_inst_t));
-    for(int i = StartOfVars; i < cfg_MAX_NUM_SYM; i++) {
-        a_Symbol[i].name[0] = '\0';
-        a_Symbol[i].type = 0;
-        a_Symbol[i].value = 0;
+    vm->p_mod_code = NULL;
+    for(uint8_t i = 0; i < Setup.num_modules; i++) {
+        module_t *p_mod = &Setup.a_modules[i];
+        if(strcmp(p_mod->name, vm->mod_name) == 0) {
+            if(p_mod->code_size != vm->mod_end || p_mod->hash != vm->mod_hash) {
+                return false; // Module changed
+            }
+            vm->p_mod_code = p_mod->p_code;
+            return true;
+        }
     }
+    return false;
+}
 
-    pCi->p_code = vm->code;
-#ifdef cfg_TRACE_SUPPORT
-    pCi->p_trace = vm->trace;
+uint16_t nb_compile(void *pv_vm, void *fp, nb_get_code_line_t get_line) {
+    return compile(pv_vm, fp, get_line, NULL, 0, MODE_PROGRAM);
+}
+
+uint16_t nb_compile_buffer(void *pv_vm, const char *p_src, size_t len) {
+    return compile(pv_vm, NULL, NULL, p_src, len, MODE_PROGRAM);
+}
+
+uint16_t nb_recompile_buffer(void *pv_vm, const char *p_src, size_t len) {
+#ifdef cfg_LINE_NUMBERS
+    return recompile(pv_vm, p_src, len);
+#else
+    return compile(pv_vm, NULL, NULL, p_src, len, MODE_PROGRAM);
 #endif
-    CurrVarIdx = 0;
-    pCi->pc = 0;
-    pCi->file_ptr = fp;
-    pCi->linenum = 0;
-    pCi->err_count = 0;
-    pCi->first_data_declaration = true;
-    pCi->p_code[pCi->pc++] = 0; // The first byte is reserved (invalid label address)
+}
 
-    setjmp(pCi->jmp_buf);
-    while(get_line()) {
-        compile_line();
-    }
+uint16_t nb_compile_lazy(void *pv_vm, const char *p_src, size_t len) {
+#ifdef cfg_LINE_NUMBERS
+    return compile(pv_vm, NULL, NULL, p_src, len, MODE_LAZY);
+#else
+    return compile(pv_vm, NULL, NULL, p_src, len, MODE_PROGRAM);
+#endif
+}
 
-    if(pCi->err_count > 0) {
-        vm->code_size = 0;
-        free(pCi);
-        err_count = pCi->err_count;
-        pCi = NULL;
-        return err_count;
+#ifdef cfg_PROFILE
+void nb_collect_profile(void *pv_vm, bool on) {
+    t_VM *vm = pv_vm;
+    vm->prof_collect = on;
+}
+
+/*
+** The profile is a byte stream: "NP", version, reserved, 32 bit source code hash,
+** 16 bit number of sites, and a 16 bit execution count per site (little endian).
+** Large counts are scaled down, the ratios are kept.
+*/
+uint16_t nb_get_profile(void *pv_vm, uint8_t *p_buf, uint16_t size) {
+    t_VM *vm = pv_vm;
+    uint32_t len = PROFILE_HDR_SIZE + vm->num_prof_cnt * 2;
+    uint32_t max = 0;
+    uint8_t shift = 0;
+
+    if(vm->p_prof_cnt == NULL || vm->code_size == 0 || len > size) {
+        return 0;
+    }
+    for(uint16_t i = 0; i < vm->num_prof_cnt; i++) {
+        if(vm->p_prof_cnt[i] > max) {
+            max = vm->p_prof_cnt[i];
+        }
+    }
+    while((max >> shift) > 0xFFFF) {
+        shift++;
     }
+    p_buf[0] = 'N';
+    p_buf[1] = 'P';
+    p_buf[2] = PROFILE_VERSION;
+    p_buf[3] = 0;
+    for(uint8_t i = 0; i < 4; i++) {
+        p_buf[4 + i] = (uint8_t)(vm->prof_hash >> (i * 8));
+    }
+    p_buf[8] = (uint8_t)vm->num_prof_cnt;
+    p_buf[9] = (uint8_t)(vm->num_prof_cnt >> 8);
+    for(uint16_t i = 0; i < vm->num_prof_cnt; i++) {
+        uint32_t count = vm->p_prof_cnt[i] >> shift;
+        p_buf[PROFILE_HDR_SIZE + i * 2] = (uint8_t)count;
+        p_buf[PROFILE_HDR_SIZE + i * 2 + 1] = (uint8_t)(count >> 8);
+    }
+    return len;
+}
 
-    compile_end();
-    append_data_to_code(vm);
-    resolve_forward_declarations();
+bool nb_set_profile(void *pv_vm, const uint8_t *p_prof, uint16_t size) {
+    t_VM *vm = pv_vm;
+    uint16_t num;
 
-    vm->code_size = pCi->pc;
-    vm->num_vars = get_num_vars();
-    err_count = pCi->err_count;
-    free(pCi);
-    pCi = NULL;
-    return err_count;
+    free(vm->p_profile);
+    vm->p_profile = NULL;
+    vm->num_profile = 0;
+    if(p_prof == NULL) {
+        return true;
+    }
+    if(size < PROFILE_HDR_SIZE || p_prof[0] != 'N' || p_prof[1] != 'P' || p_prof[2] != PROFILE_VERSION) {
+        nb_print("Error: invalid profile\n");
+        return false;
+    }
+    num = p_prof[8] | (p_prof[9] << 8);
+    if(PROFILE_HDR_SIZE + num * 2 > size) {
+        nb_print("Error: invalid profile\n");
+        return false;
+    }
+    // (at least one entry, like the symbol table)
+    vm->p_profile = malloc((num > 0 ? num : 1) * sizeof(uint16_t));
+    if(vm->p_profile == NULL) {
+        nb_print("Error: out of memory\n");
+        return false;
+    }
+    for(uint16_t i = 0; i < num; i++) {
+        vm->p_profile[i] = p_prof[PROFILE_HDR_SIZE + i * 2] | (p_prof[PROFILE_HDR_SIZE + i * 2 + 1] << 8);
+    }
+    vm->num_profile = num;
+    vm->profile_hash = 0;
+    for(uint8_t i = 0; i < 4; i++) {
+        vm->profile_hash |= (uint32_t)p_prof[4 + i] << (i * 8);
+    }
+    return true;
 }
+#endif
 
 void nb_dump_code(void *pv_vm) {
     t_VM *vm = pv_vm;
     for(uint16_t i = 0; i < vm->code_size; i++) {
-        printf("%02X ", vm->code[i]);
+        printf("%02X ", CODE_SEG(vm, i)[i]);
         if((i % 32) == 31) {
             printf("\n");
         } 
@@ -314,34 +659,55 @@ void nb_dump_code(void *pv_vm) {
 }
 
 void nb_output_symbol_table(void *pv_vm) {
-    (void)pv_vm;
+    t_VM *vm = pv_vm;
     uint8_t idx = 0;
+    uint8_t temps = 0;
 
     nb_print("#### Symbol table ####\n");
     nb_print("Variables:\n");
-    for(uint16_t i = StartOfVars; i < cfg_MAX_NUM_SYM; i++) {
-        if(a_Symbol[i].name[0] != '\0' && a_Symbol[i].type != LABEL)
+    for(uint16_t i = Setup.start_of_vars; i < vm->num_symbols; i++) {
+        if(vm->p_symbol[i].name[0] == '#') { // hidden temporary variable
+            idx++;
+            temps++;
+        } else if(vm->p_symbol[i].name[0] != '\0' && vm->p_symbol[i].type != LABEL)
         {
             nb_print("%2u: %-8s  %s\n", idx++, 
-                (a_Symbol[i].type == ID) ? "(number)" : (a_Symbol[i].type == SID) ? "(string)" : 
-                        (a_Symbol[i].type == e_CNST) ? "(const)": "(array)",
-                a_Symbol[i].name);
+                (vm->p_symbol[i].type == ID) ? "(number)" : (vm->p_symbol[i].type == SID) ? "(string)" : 
+                        (vm->p_symbol[i].type == e_CNST || vm->p_symbol[i].type == e_CARR) ? "(const)": "(array)",
+                vm->p_symbol[i].name);
         }
     }
+    if(temps > 0) {
+        nb_print("Temporaries: %u (hidden, used by the code optimizer)\n", temps);
+    }
 #ifndef cfg_LINE_NUMBERS    
     nb_print("Labels:\n");
-    for(uint16_t i = StartOfVars; i < cfg_MAX_NUM_SYM; i++) {
-        if(a_Symbol[i].name[0] != '\0' && a_Symbol[i].type == LABEL)
+    for(uint16_t i = Setup.start_of_vars; i < vm->num_symbols; i++) {
+        if(vm->p_symbol[i].name[0] != '\0' && vm->p_symbol[i].type == LABEL)
         {
-            nb_print("%16s: %u\n", a_Symbol[i].name, a_Symbol[i].value);
+            nb_print("%16s: %u\n", vm->p_symbol[i].name, vm->p_symbol[i].value);
         }
     }
 #endif
 }
 
+uint16_t nb_instr_len(const uint8_t *p_code) {
+    return instr_len(p_code);
+}
+
 // return 0 if not found
-uint16_t nb_get_label_address(void *pv_vm, char *name) {
-    (void)pv_vm;
+nb_addr_t nb_get_label_address(void *pv_vm, char *name) {
+    t_VM *vm = pv_vm;
+#ifdef cfg_LINE_NUMBERS
+    uint32_t linenum = atoi(name);
+    if(linenum == 0 || linenum > 65535) {
+        return 0;
+    }
+    if(lazy_get(vm->p_lazy, vm->num_lazy, linenum) != NULL) {
+        return nb_compile_lazy_line(vm, linenum);
+    }
+    return line_get(vm->p_line_map, vm->num_lines, linenum);
+#else
     char str[k_MAX_SYM_LEN];
     // Convert to lower case
     for(uint16_t i = 0; i < k_MAX_SYM_LEN; i++) {
@@ -351,1353 +717,4485 @@ uint16_t nb_get_label_address(void *pv_vm, char *name) {
         }
     }
 
-    for(uint16_t i = StartOfVars; i < cfg_MAX_NUM_SYM; i++) {
-        if(a_Symbol[i].name[0] != '\0' && a_Symbol[i].type == LABEL && strcmp(a_Symbol[i].name, str) == 0)
+    for(uint16_t i = Setup.start_of_vars; i < vm->num_symbols; i++) {
+        if(vm->p_symbol[i].name[0] != '\0' && vm->p_symbol[i].type == LABEL && strcmp(vm->p_symbol[i].name, str) == 0)
         {
-            return a_Symbol[i].value;
+            return vm->p_symbol[i].value;
         }
     }
     return 0;
-}
-
-sym_t *nb_get_symbol_table(uint16_t *p_start_idx) {
-    *p_start_idx = StartOfVars;
-    return a_Symbol;
-}
-
-/*************************************************************************************************
-** Static functions
-*************************************************************************************************/
-static bool get_line(void) {
-    if(nb_get_code_line(pCi->file_ptr, pCi->a_line, k_MAX_LINE_LEN) != NULL) {
-        if(strlen(pCi->a_line) > (k_MAX_LINE_LEN - 2)) {
-            error("line too long", NULL);
-        }
-        pCi->p_pos = pCi->p_next = pCi->a_line;
-        pCi->next_tok = next_token();
-        while(pCi->next_tok == ':') {
-            pCi->p_pos = pCi->p_next;
-            pCi->next_tok = next_token();
-        }
-
-#ifndef cfg_LINE_NUMBERS        
-        pCi->linenum++;
-#else
-        uint8_t tok = lookahead();
-        if(tok == NUM) {
-            match(NUM);
-            if(pCi->value > 0 && pCi->value < 65536) {
-                if(pCi->value > pCi->linenum) {
-                    pCi->linenum = pCi->value;
-                    pCi->sym_idx = sym_add(pCi->a_buff, pCi->pc, LABEL);
-                } else {
-                    error("line number out of order", NULL);
-                }
-            } else {
-                error("line number out of range", NULL);
-            }
-        }
 #endif
-        trace_print();
-        return true;
-    }
-    return false;
 }
 
-static uint8_t next_token(void) {
-    if(pCi->p_pos == NULL || *pCi->p_pos == '\0') {
-        return 0; // End of line
+/*
+** Compile the line 'linenum' of the lazy compilation with the lines behind,
+** up to the next unconditional jump/end or an already compiled line.
+** The new code replaces the end tag of the code, the stubs of the compiled
+** lines become jumps. Return the code address of the line or 0 on error.
+*/
+nb_addr_t nb_compile_lazy_line(t_VM *vm, uint16_t linenum) {
+#ifdef cfg_LINE_NUMBERS
+    lazy_line_t *p_line = lazy_get(vm->p_lazy, vm->num_lazy, linenum);
+    nb_addr_t addr = line_get(vm->p_line_map, vm->num_lines, linenum);
+    nb_addr_t start = vm->data_start_addr - 1; // position of the end tag
+    uint16_t num_pre = 0;
+    uint16_t next, i;
+
+    if(addr != 0) {
+        return addr;
     }
-    pCi->p_next = nb_scanner(pCi->p_pos, pCi->a_buff);
-    if(pCi->a_buff[0] == '\0') {
-       return 0; // End of line
+    if(p_line == NULL || vm->p_lazy_src == NULL || vm->code_size == 0) {
+        nb_print("Error: line %u is not available\n", linenum);
+        return 0;
     }
-    if(pCi->a_buff[0] == '\"') {
-        return STR;
+    // Line numbers in front stay valid
+    while(num_pre < vm->num_lines && vm->p_line_map[num_pre].linenum < linenum) {
+        num_pre++;
     }
-    if(isdigit((int8_t)pCi->a_buff[0])) {
-        pCi->value = atoi(pCi->a_buff);
-       return NUM;
+    comp_inst_t *pCi = comp_inst_resume(vm, num_pre);
+    if(pCi == NULL) {
+        nb_print("Error: out of memory\n");
+        return 0;
     }
-    if(isalpha((int8_t)pCi->a_buff[0]) || pCi->a_buff[0] == '_') {
-        uint16_t len = strlen(pCi->a_buff);
-        uint8_t type = pCi->a_buff[len - 1] == '$' ? SID : ID;
+    pCi->pc = start;
+    pCi->p_src = vm->p_lazy_src;
+    pCi->src_len = vm->lazy_src_len;
+    pCi->src_pos = p_line->src_pos;
+    pCi->p_lazy = vm->p_lazy;
+    pCi->num_lazy = vm->num_lazy;
+    next = p_line - vm->p_lazy;
 
-        pCi->sym_idx = sym_add(pCi->a_buff, CurrVarIdx, type);
-        return a_Symbol[pCi->sym_idx].type;
-    }
-    if(pCi->a_buff[0] == '=') {
-        return EQ;
-    }
-    if(pCi->a_buff[0] == '<') {
-        // parse '<=', '<>', and '<'
-        if (pCi->a_buff[1] == '=') {
-            return LQ;
+    if(setjmp(pCi->jmp_buf) == 0) {
+        token_init(pCi);
+        while(1) {
+            // Continue with the code of a line compiled before
+            while(next < vm->num_lazy && vm->p_lazy[next].src_pos < pCi->src_pos) {
+                next++;
+            }
+            if(next < vm->num_lazy && vm->p_lazy[next].src_pos == pCi->src_pos) {
+                addr = line_get(vm->p_line_map, vm->num_lines, vm->p_lazy[next].linenum);
+                if(addr != 0) {
+                    pCi->p_code[pCi->pc++] = k_GOTO_N3;
+                    emit_addr(pCi, addr);
+                    break;
+                }
+            }
+            if(!get_stmt(pCi)) {
+                compile_end(pCi);
+                break;
+            }
+            compile_line(pCi);
+            if(unit_end(pCi)) {
+                break;
+            }
         }
-        if (pCi->a_buff[1] == '>') {
-            return NQ;
+        // A block of the compiled lines must not contain a line compiled before
+        if(num_pre < vm->num_lines && pCi->linenum >= vm->p_line_map[num_pre].linenum) {
+            char a_num[8];
+            sprintf(a_num, "%u", vm->p_line_map[num_pre].linenum);
+            error(pCi, "jump into a block", a_num);
         }
-        return LE;
-    }
-    if(pCi->a_buff[0] == '>') {
-        // parse '>=' or '>'
-        if (pCi->a_buff[0] == '=') {
-            return GQ;
+        for(i = num_pre; i < vm->num_lines; i++) {
+            line_add(pCi, vm->p_line_map[i].linenum, vm->p_line_map[i].pc);
         }
-        return GR;
-    }
-    if(strlen(pCi->a_buff) == 1) {
-        return pCi->a_buff[0]; // Single character
+        resolve_forward_declarations(pCi);
+        pCi->p_code[pCi->pc++] = 0xFF;  // End tag before the (empty) data section
+        append_pool_to_code(pCi, vm);
     }
-    error("unknown character", pCi->a_buff);
-    return 0;
-}
 
-static uint8_t lookahead(void) {
-    if(pCi->p_pos == pCi->p_next) {
-        pCi->next_tok = next_token();
+    if(pCi->err_count > 0) {
+        // Remove the stubs and trace entries of the failed compilation
+        for(i = 0; i < vm->num_lazy; i++) {
+            if(vm->p_lazy[i].stub >= start) {
+                vm->p_lazy[i].stub = 0;
+            }
+        }
+#ifdef cfg_TRACE_SUPPORT
+        memset(&vm->trace[start], 0, (pCi->pc - start) * sizeof(uint16_t));
+#endif
+        // (the string literals behind are restored)
+        vm->code[start] = 0xFF;
+        memcpy(&vm->code[vm->str_pool_addr], pCi->p_pool, vm->code_size - vm->str_pool_addr);
+        comp_inst_free(pCi);
+        return 0;
     }
-    //nb_print("lookahead: %s\n", pCi->a_buff);
-    return pCi->next_tok;
-}
 
-#ifndef cfg_LINE_NUMBERS
-static uint8_t lookfurther(void) {
-    return pCi->p_next[0];
-}
+    // The stubs of the compiled lines become jumps
+    for(i = 0; i < vm->num_lazy; i++) {
+        nb_addr_t stub = vm->p_lazy[i].stub;
+        if(stub != 0 && vm->code[stub] == k_LAZY_LINE_N3) {
+            addr = line_get(pCi->p_line_map, pCi->num_line_map, vm->p_lazy[i].linenum);
+            if(addr != 0) {
+                vm->code[stub] = k_GOTO_N3;
+                ACS_ADDR(vm->code[stub + 1]) = addr;
+            }
+        }
+    }
+    vm->data_start_addr = vm->str_pool_addr;
+    vm->code_size = pCi->pc;
+    free(vm->p_line_map);
+    vm->p_line_map = pCi->p_line_map;
+    vm->num_lines = pCi->num_line_map;
+    pCi->p_line_map = NULL;
+    vm->num_vars = get_num_vars(pCi);
+    free(vm->p_symbol);
+    vm->p_symbol = realloc(pCi->p_symbol, (pCi->num_sym > 0 ? pCi->num_sym : 1) * sizeof(sym_t));
+    if(vm->p_symbol == NULL) {
+        vm->p_symbol = pCi->p_symbol;
+    }
+    vm->num_symbols = pCi->num_sym;
+    pCi->p_symbol = NULL;
+    comp_inst_free(pCi);
+    return line_get(vm->p_line_map, vm->num_lines, linenum);
+#else
+    (void)vm;
+    (void)linenum;
+    return 0;
 #endif
-
-static bool end_of_line(void) {
-    return lookahead() == 0;
 }
 
-static uint8_t next(void) {
-    if(pCi->p_pos == pCi->p_next) {
-       pCi->next_tok = next_token();
-    }
-    pCi->p_pos = pCi->p_next;
-    return pCi->next_tok;
+sym_t *nb_get_symbol_table(void *pv_vm, uint16_t *p_start_idx, uint16_t *p_num_sym) {
+    t_VM *vm = pv_vm;
+    *p_start_idx = Setup.start_of_vars;
+    *p_num_sym = vm->num_symbols;
+    return vm->p_symbol;
 }
 
-static void match(uint8_t expected) {
-    uint8_t tok = next();
-    if (tok == expected) {
-    } else {
-        error("syntax error", pCi->a_buff);
+/*************************************************************************************************
+** Static functions
+*************************************************************************************************/
+static t_VM *vm_create(void) {
+    t_VM *vm = malloc(sizeof(t_VM));
+    if(vm != NULL) {
+        memset(vm, 0, sizeof(t_VM));
+        nb_mem_init(vm);
+        vm->pc = 1;
+        //srand(time(NULL));
     }
+    return vm;
 }
 
-#ifndef cfg_LINE_NUMBERS
-static void label(void) {
-  uint8_t tok = lookahead();
-  if(tok == ID) { // Token recognized as variable?
-    // Convert to label
-    a_Symbol[pCi->sym_idx].type = LABEL;
-    pCi->next_tok = LABEL;
-    CurrVarIdx--;
-  } else if(tok == LABEL) {
-    // Already a label
-  } else {
-    error("label expected", pCi->a_buff);
-  }
-  match(LABEL);
-}
+/*
+** Compile the source code, read either from the buffer 'p_src' (in place)
+** or line by line via 'get_line(fp, ...)'. With MODE_LAZY, only the
+** main program is compiled, the lines behind are compiled on first use.
+*/
+static uint16_t compile(t_VM *vm, void *fp, nb_get_code_line_t get_line, const char *p_src, size_t len, uint8_t mode) {
+    uint16_t err_count = 0;
+    comp_inst_t *pCi;
+
+    free(vm->p_symbol);
+    vm->p_symbol = NULL;
+    vm->num_symbols = 0;
+    free(vm->p_line_map);
+    vm->p_line_map = NULL;
+    vm->num_lines = 0;
+    free(vm->p_src_lines);
+    vm->p_src_lines = NULL;
+    vm->num_src_lines = 0;
+    vm->data_code_addr = 0;
+    free(vm->p_lazy);
+    vm->p_lazy = NULL;
+    vm->num_lazy = 0;
+    vm->p_lazy_src = NULL;
+    vm->lazy_src_len = 0;
+    vm->p_mod_code = NULL;
+    vm->mod_end = 0;
+#ifdef cfg_PROFILE
+    free(vm->p_prof_cnt);
+    vm->p_prof_cnt = NULL;
+    vm->num_prof_cnt = 0;
 #endif
 
-static void compile_block(void) {
-    compile_stmts();
-    if(BLOCKEND(lookahead())) {
-        return;
+    pCi = malloc(sizeof(comp_inst_t));
+    if(pCi == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
     }
-    while(get_line()) {
-        if(BLOCKEND(lookahead())) {
-            return;
-        }
-        compile_line();
+    memset(pCi, 0, sizeof(comp_inst_t));
+    pCi->p_symbol = calloc(cfg_MAX_NUM_SYM, sizeof(sym_t));
+    if(pCi->p_symbol == NULL) {
+        printf("Error: out of memory\n");
+        free(pCi);
+        return 1;
+    }
+    memcpy(pCi->p_symbol, Setup.a_keyword, Setup.start_of_vars * sizeof(sym_t));
+    if(!sym_hash_init(pCi, Setup.start_of_vars)) {
+        printf("Error: out of memory\n");
+        free(pCi->p_symbol);
+        free(pCi);
+        return 1;
     }
-}
 
-static void compile_line(void) {
-#ifndef cfg_LINE_NUMBERS    
-    uint8_t tok = lookahead();
+    pCi->p_code = vm->code;
+#ifdef cfg_TRACE_SUPPORT
+    pCi->p_trace = vm->trace;
+    // (entries of a previous compilation would be moved with the code, see 'compact_code()')
+    memset(vm->trace, 0, sizeof(vm->trace));
+#endif
+    pCi->curr_var_idx = 0;
+    pCi->pc = 0;
+    pCi->file_ptr = fp;
+    pCi->get_line = get_line;
+    pCi->p_src = p_src;
+    pCi->src_len = len;
+    pCi->src_pos = 0;
+    pCi->linenum = 0;
+    pCi->err_count = 0;
+    pCi->first_data_declaration = true;
+    pCi->lazy = mode == MODE_LAZY;
+    pCi->module = mode == MODE_MODULE;
+    pCi->p_code[pCi->pc++] = 0; // The first byte is reserved (invalid label address)
+    if(pCi->module) {
+        // Jump over the module to the importing program (see 'module_import()')
+        pCi->p_code[pCi->pc++] = k_GOTO_N3;
+        emit_addr(pCi, 0);
+    }
+
+    if(setjmp(pCi->jmp_buf) == 0) {
+        if(pCi->lazy) {
+            // The lines are scanned on demand, up to the end of the main program
+            token_init(pCi);
+            pCi->incremental = true;
+        } else {
+#ifdef cfg_PROFILE
+            pCi->src_hash = 2166136261u;
+#endif
+            tokenize(pCi);
+#ifdef cfg_PROFILE
+            // (the site numbers require the complete compilation in source code order)
+            pCi->prof_collect = vm->prof_collect && !pCi->module;
+            if(vm->p_profile != NULL && vm->profile_hash == pCi->src_hash && !pCi->module) {
+                pCi->p_profile = vm->p_profile;
+                pCi->num_profile = vm->num_profile;
+            }
+#endif
+        }
+    }
+    if(pCi->err_count == 0) {
+        setjmp(pCi->jmp_buf);
+        while(get_stmt(pCi)) {
+            compile_line(pCi);
+#ifdef cfg_LINE_NUMBERS
+            if(pCi->lazy && unit_end(pCi)) {
+                pCi->lazy = false;
+                if(lazy_index(pCi)) {
+                    break;
+                }
+            }
+#endif
+        }
+    }
+
+    if(pCi->err_count > 0) {
+        vm->code_size = 0;
+        err_count = pCi->err_count;
+        free(pCi->p_token);
+        free(pCi->p_text);
+        free(pCi->p_line_map);
+        free(pCi->p_src_lines);
+        free(pCi->p_lazy);
+        free(pCi->p_pool);
+        free(pCi->p_sym_hash);
+        free(pCi->p_symbol);
+        free(pCi);
+        return err_count;
+    }
+
+    compile_end(pCi);
+    // (the stubs of the lazy compilation are placed in front of the data section)
+    resolve_forward_declarations(pCi);
+#ifdef cfg_COMPACT_CODE
+    if(pCi->p_lazy == NULL && pCi->err_count == 0) {
+        compact_code(pCi);
+    }
+#endif
+    append_data_to_code(pCi, vm);
+    append_pool_to_code(pCi, vm);
+
+    vm->code_size = pCi->pc;
+    vm->num_vars = get_num_vars(pCi);
+    vm->num_symbols = pCi->num_sym;
+    // (at least one entry, realloc() with size 0 frees the memory)
+    vm->p_symbol = realloc(pCi->p_symbol, (vm->num_symbols > 0 ? vm->num_symbols : 1) * sizeof(sym_t));
+    if(vm->p_symbol == NULL) {
+        free(pCi->p_symbol);
+        vm->num_symbols = 0;
+    }
+    vm->p_line_map = pCi->p_line_map;
+    vm->num_lines = pCi->num_line_map;
+    vm->p_src_lines = pCi->p_src_lines;
+    vm->num_src_lines = pCi->num_src_lines;
+    vm->data_code_addr = pCi->data_pc;
+    if(pCi->p_import != NULL) {
+        vm->p_mod_code = pCi->p_mod_code;
+        vm->mod_end = pCi->mod_end;
+        strcpy(vm->mod_name, pCi->p_import->name);
+        vm->mod_hash = pCi->p_import->hash;
+    }
+#ifdef cfg_PROFILE
+    if(pCi->prof_collect) {
+        vm->num_prof_cnt = pCi->num_sites < MAX_PROFILE_SITES ? pCi->num_sites : MAX_PROFILE_SITES;
+        vm->p_prof_cnt = calloc(vm->num_prof_cnt > 0 ? vm->num_prof_cnt : 1, sizeof(uint32_t));
+        if(vm->p_prof_cnt == NULL) {
+            vm->num_prof_cnt = 0;
+        }
+        vm->prof_hash = pCi->src_hash;
+    }
+#endif
+    if(pCi->p_lazy != NULL) {
+        // Not all lines are compiled, the incremental compilation is not possible
+        free(vm->p_src_lines);
+        vm->p_src_lines = NULL;
+        vm->num_src_lines = 0;
+        vm->p_lazy = pCi->p_lazy;
+        vm->num_lazy = pCi->num_lazy;
+        vm->p_lazy_src = p_src;
+        vm->lazy_src_len = len;
+    }
+    err_count = pCi->err_count;
+    free(pCi->p_token);
+    free(pCi->p_text);
+    free(pCi->p_pool);
+    free(pCi->p_sym_hash);
+    free(pCi);
+    return err_count;
+}
+
+#ifdef cfg_LINE_NUMBERS
+/*
+** Incremental compilation of a line-numbered program. Only the top-level
+** statements with changed source lines are compiled again into the gap of the
+** previous code. The code in front of them is kept, the code behind them is
+** moved, and the jump addresses are relinked via the line number maps.
+** Changes of declarations or DATA fall back to the complete compilation.
+*/
+static uint16_t recompile(t_VM *vm, const char *p_src, size_t len) {
+    src_line_t *p_old = vm->p_src_lines;
+    uint16_t num_old = vm->num_src_lines;
+    uint32_t num_new = 0;
+    uint32_t pre, suf, i;
+    uint16_t u0, e, err_count;
+    size_t pos;
+
+    if(p_old == NULL || vm->code_size == 0 || vm->p_symbol == NULL || vm->num_symbols < Setup.start_of_vars ||
+       memcmp(vm->p_symbol, Setup.a_keyword, Setup.start_of_vars * sizeof(sym_t)) != 0) {
+        return compile(vm, NULL, NULL, p_src, len, MODE_PROGRAM);
+    }
+#ifdef cfg_PROFILE
+    // The profile sites are numbered by the complete compilation
+    if(vm->prof_collect || vm->p_profile != NULL) {
+        return compile(vm, NULL, NULL, p_src, len, MODE_PROGRAM);
+    }
+#endif
+
+    // Hash values of the new source lines, compared with the previous ones
+    for(pos = 0; pos < len; num_new++) {
+        const char *p_end = memchr(&p_src[pos], '\n', len - pos);
+        pos = p_end != NULL ? (size_t)(p_end - p_src) + 1 : len;
+    }
+    if(num_new > 65535) {
+        return compile(vm, NULL, NULL, p_src, len, MODE_PROGRAM);
+    }
+    size_t *p_pos = malloc((num_new + 1) * sizeof(size_t));
+    uint32_t *p_hash = malloc((num_new + 1) * sizeof(uint32_t));
+    if(p_pos == NULL || p_hash == NULL) {
+        free(p_pos);
+        free(p_hash);
+        return compile(vm, NULL, NULL, p_src, len, MODE_PROGRAM);
+    }
+    pos = 0;
+    for(i = 0; i < num_new; i++) {
+        const char *p_end = memchr(&p_src[pos], '\n', len - pos);
+        size_t next = p_end != NULL ? (size_t)(p_end - p_src) + 1 : len;
+        p_pos[i] = pos;
+        p_hash[i] = line_hash(&p_src[pos], next - pos < 0xFFFF ? next - pos : 0xFFFF);
+        pos = next;
+    }
+    p_pos[num_new] = len;
+
+    for(pre = 0; pre < num_old && pre < num_new && p_old[pre].hash == p_hash[pre]; pre++) {
+    }
+    for(suf = 0; suf < num_old - pre && suf < num_new - pre &&
+                 p_old[num_old - 1 - suf].hash == p_hash[num_new - 1 - suf]; suf++) {
+    }
+    free(p_hash);
+    if(pre == num_old && pre == num_new) {
+        free(p_pos);
+        return 0; // Nothing changed
+    }
+
+    // Start with the statement of the first changed line. If the change starts
+    // with a statement, take the statement in front of it, so that the jumps
+    // to the start of the recompiled code stay unambiguous.
+    for(u0 = pre; u0 > 0 && u0 < num_old && !(p_old[u0].flags & LINE_FIRST); u0--) {
+    }
+    if(u0 == pre && u0 > 0) {
+        for(u0--; u0 > 0 && !(p_old[u0].flags & LINE_FIRST); u0--) {
+        }
+    }
+    // DATA statements have to be at the end of the program
+    for(i = 0; i < u0; i++) {
+        if(p_old[i].flags & LINE_DATA) {
+            free(p_pos);
+            return compile(vm, NULL, NULL, p_src, len, MODE_PROGRAM);
+        }
+    }
+
+    nb_addr_t end_pc = vm->data_start_addr - 2; // position of the END instruction
+    nb_addr_t pc_u0 = u0 < num_old ? p_old[u0].pc : end_pc;
+    uint16_t map_u0 = u0 < num_old ? p_old[u0].map_idx : vm->num_lines;
+    nb_addr_t old_size = vm->code_size;
+
+    // Symbols and line numbers of the unchanged code in front
+    comp_inst_t *pCi = comp_inst_resume(vm, map_u0);
+    uint8_t *p_save = malloc(old_size - pc_u0);
+#ifdef cfg_TRACE_SUPPORT
+    uint16_t *p_save_trace = malloc((old_size - pc_u0) * sizeof(uint16_t));
+    bool ok = pCi != NULL && p_save != NULL && p_save_trace != NULL;
+#else
+    uint16_t *p_save_trace = NULL;
+    bool ok = pCi != NULL && p_save != NULL;
+#endif
+    if(!ok) {
+        if(pCi != NULL) {
+            comp_inst_free(pCi);
+        }
+        free(p_save);
+        free(p_save_trace);
+        free(p_pos);
+        return compile(vm, NULL, NULL, p_src, len, MODE_PROGRAM);
+    }
+
+    memcpy(p_save, &vm->code[pc_u0], old_size - pc_u0);
+#ifdef cfg_TRACE_SUPPORT
+    memcpy(p_save_trace, &vm->trace[pc_u0], (old_size - pc_u0) * sizeof(uint16_t));
+    memset(&vm->trace[pc_u0], 0, (old_size - pc_u0) * sizeof(uint16_t));
+#endif
+    pCi->pc = pc_u0;
+    pCi->p_old_lines = p_old;
+    pCi->num_old_lines = u0;
+    pCi->p_src = p_src;
+    pCi->src_len = len;
+    pCi->src_pos = p_pos[u0];
+    free(p_pos);
+
+    // Compile the statements until the unchanged lines behind are reached
+    if(setjmp(pCi->jmp_buf) == 0) {
+        token_init(pCi);
+    }
+    if(pCi->err_count == 0) {
+        setjmp(pCi->jmp_buf);
+        while(1) {
+            uint32_t j = u0 + pCi->src_idx;
+            if(j >= num_new - suf) {
+                uint32_t k = j - num_new + num_old; // same line of the previous compilation
+                if(k >= num_old || (p_old[k].flags & LINE_FIRST)) {
+                    break;
+                }
+            }
+            if(!get_stmt(pCi)) {
+                break;
+            }
+            compile_line(pCi);
+        }
+    }
+    nb_addr_t pc_e = end_pc;
+    uint16_t map_e = vm->num_lines;
+    int32_t delta = 0;
+    int32_t pool_delta = 0;
+    bool full = false;
+
+    if(pCi->err_count == 0) {
+        e = u0 + pCi->src_idx + num_old - num_new;
+        if(e < num_old) {
+            pc_e = p_old[e].pc;
+            map_e = p_old[e].map_idx;
+        }
+        delta = (int32_t)pCi->pc - pc_e;
+        for(i = 0; i < pCi->src_idx; i++) {
+            full |= (pCi->p_src_lines[i].flags & (LINE_DECL | LINE_DATA)) != 0;
+        }
+        for(i = u0; i < e; i++) {
+            full |= (p_old[i].flags & (LINE_DECL | LINE_DATA | LINE_INLINED)) != 0;
+        }
+        full |= map_e < vm->num_lines && pCi->linenum >= vm->p_line_map[map_e].linenum;
+        // (new string literals are appended to the pool)
+        pool_delta = pCi->pool_size - (old_size - vm->str_pool_addr);
+        full |= old_size + delta + pool_delta >= cfg_MAX_CODE_SIZE - MAX_CODE_PER_LINE;
+        full |= pCi->num_src_lines != pCi->src_idx;
+    }
+
+    if(pCi->err_count == 0 && !full) {
+        relink_t rl = {vm->p_line_map, vm->num_lines, pc_u0, pc_e, delta};
+        int32_t map_shift = (int32_t)pCi->num_line_map - map_e;
+
+        if(setjmp(pCi->jmp_buf) == 0) {
+            for(i = map_e; i < vm->num_lines; i++) {
+                line_add(pCi, vm->p_line_map[i].linenum, vm->p_line_map[i].pc + delta);
+            }
+            // Move the code behind and relink all jump addresses
+            memcpy(&vm->code[pCi->pc], &p_save[pc_e - pc_u0], old_size - pc_e);
+#ifdef cfg_TRACE_SUPPORT
+            // (the trace entry of the END instruction belongs to the last recompiled lines)
+            uint16_t skip = e < num_old ? 0 : 1;
+            memcpy(&vm->trace[pCi->pc + skip], &p_save_trace[pc_e - pc_u0 + skip], (old_size - pc_e - skip) * sizeof(uint16_t));
+            if(delta < 0) {
+                memset(&vm->trace[old_size + delta], 0, -delta * sizeof(uint16_t));
+            }
+#endif
+            nb_addr_t instr_end = (vm->data_code_addr != 0 ? vm->data_code_addr : end_pc) + delta;
+            // (the module code in front of the program is never moved)
+            nb_addr_t start = vm->mod_end > 0 ? vm->mod_end : 1;
+            full = !relink_code(pCi, &rl, start, pc_u0) || !relink_code(pCi, &rl, pCi->pc, instr_end);
+            if(!full) {
+                resolve_forward_declarations(pCi);
+            }
+        }
+        if(pCi->err_count == 0 && !full) {
+            // DATA strings behind are moved, too
+            vm->data_start_addr += delta;
+            if(vm->data_code_addr != 0) {
+                vm->data_code_addr += delta;
+            }
+            vm->str_pool_addr += delta;
+            for(pos = vm->data_start_addr; pos + 4 <= vm->str_pool_addr; pos += 4) {
+                uint32_t val = ACS32(vm->code[pos]);
+                if((val & k_DATA_STR_TAG) && (val & ~k_DATA_STR_TAG) >= pc_e) {
+                    ACS32(vm->code[pos]) = val + delta;
+                }
+            }
+            memcpy(&vm->code[vm->str_pool_addr], pCi->p_pool, pCi->pool_size);
+            // Source line info: unchanged lines in front, recompiled lines, moved lines behind
+            src_line_t *p_lines = malloc((num_new > 0 ? num_new : 1) * sizeof(src_line_t));
+            if(p_lines != NULL) {
+                memcpy(p_lines, p_old, u0 * sizeof(src_line_t));
+                if(pCi->src_idx > 0) {
+                    memcpy(&p_lines[u0], pCi->p_src_lines, pCi->src_idx * sizeof(src_line_t));
+                }
+                for(i = e; i < num_old; i++) {
+                    src_line_t *p_line = &p_lines[i - e + u0 + pCi->src_idx];
+                    *p_line = p_old[i];
+                    p_line->pc += delta;
+                    p_line->map_idx += map_shift;
+                }
+            }
+            free(vm->p_src_lines);
+            vm->p_src_lines = p_lines;
+            vm->num_src_lines = p_lines != NULL ? num_new : 0;
+            free(vm->p_line_map);
+            vm->p_line_map = pCi->p_line_map;
+            vm->num_lines = pCi->num_line_map;
+            pCi->p_line_map = NULL;
+            vm->num_vars = get_num_vars(pCi);
+            free(vm->p_symbol);
+            vm->p_symbol = realloc(pCi->p_symbol, (pCi->num_sym > 0 ? pCi->num_sym : 1) * sizeof(sym_t));
+            if(vm->p_symbol == NULL) {
+                vm->p_symbol = pCi->p_symbol;
+            }
+            vm->num_symbols = pCi->num_sym;
+            pCi->p_symbol = NULL;
+            vm->code_size = old_size + delta + pool_delta;
+            vm->data_read_offs = 0;
+        }
+    }
+
+    err_count = pCi->err_count;
+    if(err_count > 0) {
+        // Error messages are output, the previous code is invalid
+        vm->code_size = 0;
+        free(vm->p_src_lines);
+        vm->p_src_lines = NULL;
+        vm->num_src_lines = 0;
+    }
+    comp_inst_free(pCi);
+    free(p_save);
+    free(p_save_trace);
+    if(err_count == 0 && full) {
+        return compile(vm, NULL, NULL, p_src, len, MODE_PROGRAM);
+    }
+    return err_count;
+}
+
+/*
+** Create the compiler context to continue the previous compilation of the VM
+** with its symbol table and the first 'num_map' entries of the line number map.
+** The source lines are scanned on demand.
+*/
+static comp_inst_t *comp_inst_resume(t_VM *vm, uint16_t num_map) {
+    comp_inst_t *pCi = malloc(sizeof(comp_inst_t));
+
+    if(pCi == NULL) {
+        return NULL;
+    }
+    memset(pCi, 0, sizeof(comp_inst_t));
+    pCi->p_symbol = calloc(cfg_MAX_NUM_SYM, sizeof(sym_t));
+    if(num_map > 0) {
+        pCi->p_line_map = malloc(num_map * sizeof(line_t));
+        pCi->max_line_map = num_map;
+    }
+    if(pCi->p_symbol == NULL || (num_map > 0 && pCi->p_line_map == NULL)) {
+        comp_inst_free(pCi);
+        return NULL;
+    }
+    memcpy(pCi->p_symbol, vm->p_symbol, vm->num_symbols * sizeof(sym_t));
+    if(!sym_hash_init(pCi, vm->num_symbols) ||
+       !pool_init(pCi, (char*)&vm->code[vm->str_pool_addr], vm->code_size - vm->str_pool_addr)) {
+        comp_inst_free(pCi);
+        return NULL;
+    }
+    sym_resume(pCi);
+    if(num_map > 0) {
+        memcpy(pCi->p_line_map, vm->p_line_map, num_map * sizeof(line_t));
+    }
+    pCi->num_line_map = num_map;
+    pCi->linenum = num_map > 0 ? vm->p_line_map[num_map - 1].linenum : 0;
+    pCi->p_code = vm->code;
+    pCi->p_mod_code = vm->p_mod_code;
+    pCi->mod_end = vm->mod_end;
+#ifdef cfg_TRACE_SUPPORT
+    pCi->p_trace = vm->trace;
+#endif
+    pCi->incremental = true;
+    pCi->first_data_declaration = true;
+    return pCi;
+}
+
+// Free the compiler context and all its buffers
+static void comp_inst_free(comp_inst_t *pCi) {
+    free(pCi->p_token);
+    free(pCi->p_text);
+    free(pCi->p_line_map);
+    free(pCi->p_src_lines);
+    free(pCi->p_pool);
+    free(pCi->p_sym_hash);
+    free(pCi->p_symbol);
+    free(pCi);
+}
+
+// The last top-level statement ends the program flow (lazy compilation)
+static bool unit_end(comp_inst_t *pCi) {
+    return pCi->last_tok == END || pCi->last_tok == GOTO || pCi->last_tok == RETURN;
+}
+
+/*
+** Index the numbered lines behind the main program, they are compiled on
+** first use. Return false if they contain declarations or DATA, which have
+** to be compiled with the main program.
+*/
+static bool lazy_index(comp_inst_t *pCi) {
+    size_t start = pCi->src_pos;
+    lazy_line_t *p_lazy = NULL;
+    uint32_t num = 0;
+    uint32_t max = 0;
+    uint16_t linenum = pCi->linenum;
+    char a_buff[k_MAX_LINE_LEN];
+    uint32_t value;
+    uint16_t len;
+    char *p_pos;
+    bool ok = pCi->p_src != NULL && pCi->src_len < 0xFFFFFFFF;
+
+    while(ok) {
+        size_t line_pos = pCi->src_pos;
+        if((p_pos = read_line(pCi, &len)) == NULL) {
+            break;
+        }
+        // Too long lines are reported by the complete compilation
+        ok = len <= (k_MAX_LINE_LEN - 2);
+        for(bool first = true; ok && p_pos != NULL && *p_pos != '\0'; first = false) {
+            p_pos = nb_scanner(p_pos, a_buff);
+            if(a_buff[0] == '\0') {
+                break;
+            }
+            uint8_t tok = scan_token(a_buff, strlen(a_buff), &value);
+            if(first && tok == NUM) {
+                ok = value > linenum && value <= 65535;
+                if(ok && num >= max) {
+                    max = max == 0 ? 64 : max * 2;
+                    lazy_line_t *p_new = realloc(p_lazy, max * sizeof(lazy_line_t));
+                    ok = p_new != NULL;
+                    p_lazy = ok ? p_new : p_lazy;
+                }
+                if(ok) {
+                    linenum = value;
+                    p_lazy[num].linenum = linenum;
+                    p_lazy[num].stub = 0;
+                    p_lazy[num].src_pos = line_pos;
+                    num++;
+                }
+            } else if(tok == ID) {
+                char sym[k_MAX_SYM_LEN];
+                tok = keyword_get(sym, sym_name(a_buff, sym));
+                if(tok == REM) {
+                    break;
+                }
+                ok = tok != DIM && tok != CONST && tok != DATA;
+            }
+        }
+    }
+    if(!ok) {
+        free(p_lazy);
+        pCi->src_pos = start;
+        return false;
+    }
+    pCi->p_lazy = p_lazy;
+    pCi->num_lazy = num;
+    return true;
+}
+
+// Binary search, return the line of the lazy compilation or NULL if not found
+static lazy_line_t *lazy_get(lazy_line_t *p_lazy, uint16_t num, uint16_t linenum) {
+    uint16_t lo = 0;
+    uint16_t hi = num;
+
+    while(lo < hi) {
+        uint16_t mid = (lo + hi) / 2;
+        if(p_lazy[mid].linenum < linenum) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if(lo < num && p_lazy[lo].linenum == linenum) {
+        return &p_lazy[lo];
+    }
+    return NULL;
+}
+
+/*
+** Return the address of the stub instruction, which compiles the line on first
+** use, or 0 if the line does not exist. The stub is placed behind the code.
+*/
+static nb_addr_t lazy_stub(comp_inst_t *pCi, uint16_t linenum) {
+    lazy_line_t *p_line = lazy_get(pCi->p_lazy, pCi->num_lazy, linenum);
+
+    if(p_line == NULL) {
+        return 0;
+    }
+    if(p_line->stub == 0) {
+        if(pCi->pc + k_JUMP_LEN + 1 >= cfg_MAX_CODE_SIZE) {
+            error(pCi, "code size exceeded", NULL);
+        }
+        // The stub is patched to a jump, so it has the size of a jump
+        p_line->stub = pCi->pc;
+        memset(&pCi->p_code[pCi->pc], 0, k_JUMP_LEN);
+        pCi->p_code[pCi->pc] = k_LAZY_LINE_N3;
+        ACS16(pCi->p_code[pCi->pc + 1]) = linenum;
+        pCi->pc += k_JUMP_LEN;
+    }
+    return p_line->stub;
+}
+
+/*
+** Relink the jump addresses of the moved/kept code in the range [start, end)
+** (see 'recompile()'), return false if a jump target is ambiguous
+*/
+static bool relink_code(comp_inst_t *pCi, relink_t *p_rl, nb_addr_t start, nb_addr_t end) {
+    uint8_t *p_code = pCi->p_code;
+
+    for(nb_addr_t pos = start; pos < end; pos += instr_len(&p_code[pos])) {
+        switch(p_code[pos]) {
+        case k_GOTO_N3:
+        case k_GOSUB_N3:
+        case k_IF_N3:
+        case k_IF_TRUE_N3:
+        case k_NEXT_N4: {
+            nb_addr_t addr = relink_addr(pCi, p_rl, ACS_ADDR(p_code[pos + 1]));
+            if(addr == 0) {
+                return false;
+            }
+            ACS_ADDR(p_code[pos + 1]) = addr;
+            break;
+        }
+        case k_GOTO_R2:
+        case k_IF_R2:
+        case k_IF_TRUE_R2:
+        case k_NEXT_R3: {
+            // (the previous address of the code behind is 'pos - delta')
+            nb_addr_t from = pos < p_rl->start ? pos : pos - p_rl->delta;
+            nb_addr_t addr = relink_addr(pCi, p_rl, from + (int8_t)p_code[pos + 1]);
+            int32_t offs = (int32_t)addr - (int32_t)pos;
+            if(addr == 0 || offs < INT8_MIN || offs > INT8_MAX) {
+                return false;
+            }
+            p_code[pos + 1] = (uint8_t)offs;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+/*
+** Return the new code address for the jump address 'addr' of the previous
+** compilation, or 0 if the target is removed or ambiguous. Targets within
+** the recompiled code can only be line numbers.
+*/
+static nb_addr_t relink_addr(comp_inst_t *pCi, relink_t *p_rl, nb_addr_t addr) {
+    uint16_t lo = 0;
+    uint16_t hi = p_rl->num_old_map;
+    nb_addr_t new_addr = 0;
+
+    if(addr < p_rl->start) {
+        return addr;
+    }
+    if(addr > p_rl->end) {
+        return addr + p_rl->delta;
+    }
+    // Binary search for the first line at 'addr'
+    while(lo < hi) {
+        uint16_t mid = (lo + hi) / 2;
+        if(p_rl->p_old_map[mid].pc < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for(; lo < p_rl->num_old_map && p_rl->p_old_map[lo].pc == addr; lo++) {
+        nb_addr_t a = line_get(pCi->p_line_map, pCi->num_line_map, p_rl->p_old_map[lo].linenum);
+        if(a == 0 || (new_addr != 0 && a != new_addr)) {
+            return 0;
+        }
+        new_addr = a;
+    }
+    // Jumps behind a statement in front, or to a statement behind
+    if(addr == p_rl->start) {
+        if(new_addr != 0 && new_addr != addr) {
+            return 0;
+        }
+        new_addr = addr;
+    }
+    if(addr == p_rl->end) {
+        if(new_addr != 0 && new_addr != addr + p_rl->delta) {
+            return 0;
+        }
+        new_addr = addr + p_rl->delta;
+    }
+    return new_addr;
+}
+#endif
+
+/*
+** Scan the complete source code once into the token array. Numbers are
+** converted, keywords are classified, and identifiers are entered into
+** the symbol table here, so that the parser only has to step through the array.
+** Each line is terminated by an end of line token.
+*/
+static void tokenize(comp_inst_t *pCi) {
+    token_init(pCi);
+    pCi->linenum = 1;
+    while(tokenize_line(pCi)) {
+        pCi->linenum++;
+    }
+    // (the line numbers of an imported module are in front)
+    pCi->linenum = pCi->num_line_map > 0 ? pCi->p_line_map[pCi->num_line_map - 1].linenum : 0;
+}
+
+// Initialize the token array and the text buffer
+static void token_init(comp_inst_t *pCi) {
+    reserve_text(pCi);
+    pCi->p_text[0] = '\0'; // The empty text at offset 0 is used for end of line tokens
+    pCi->text_size = 1;
+    add_token(pCi, 0, 0, 0, false); // The end of the (virtual) line 0
+}
+
+// Scan the next source line into the token array, return false at the end of the source code
+static bool tokenize_line(comp_inst_t *pCi) {
+    char *p_pos, *p_next, *p_buff;
+    uint32_t value;
+    uint16_t len;
+    uint8_t tok;
+    uint8_t prev_tok = 0;
+#ifndef cfg_LINE_NUMBERS
+    bool first, label_list;
+#endif
+
+    if((p_pos = read_line(pCi, &len)) == NULL) {
+        return false;
+    }
+#ifdef cfg_LINE_NUMBERS
+    src_line_t *p_line = src_line_add(pCi, p_pos, len);
+#endif
+#ifdef cfg_PROFILE
+    for(uint16_t i = 0; i < len && p_pos[i] != '\0'; i++) {
+        pCi->src_hash = (pCi->src_hash ^ (uint8_t)p_pos[i]) * 16777619u;
+    }
+#endif
+    if(len > (k_MAX_LINE_LEN - 2)) {
+        add_token(pCi, LEX_ERROR, 0, 1, false);
+        add_token(pCi, 0, 0, 0, false);
+        return true;
+    }
+#ifndef cfg_LINE_NUMBERS
+    first = true;
+    label_list = false;
+#endif
+    reserve_text(pCi);
+    while(p_pos != NULL && *p_pos != '\0') {
+        // The scanner writes the token text directly into the text buffer
+        p_buff = &pCi->p_text[pCi->text_size];
+        p_next = nb_scanner(p_pos, p_buff);
+        if(p_buff[0] == '\0') {
+            break;
+        }
+        len = strlen(p_buff);
+        tok = scan_token(p_buff, len, &value);
+        if(tok == ID) {
+            char sym[k_MAX_SYM_LEN];
+            uint32_t hash = sym_name(p_buff, sym);
+            // Keywords are not part of the symbol table
+            uint8_t type = keyword_get(sym, hash);
+            if(type != 0) {
+                tok = type;
+            } else {
+                type = p_buff[len - 1] == '$' ? SID : ID;
+#ifndef cfg_LINE_NUMBERS
+                // Label definition or GOTO/GOSUB target
+                if(label_list || (first && p_next != NULL && *p_next == ':')) {
+                    type = LABEL;
+                }
+#endif
+                value = sym_insert(pCi, sym, hash, pCi->curr_var_idx, type);
+            }
+        }
+        add_token(pCi, tok, len + 1, value, p_next != NULL && *p_next == ':');
+        if(tok == REM) {
+            break; // Skip the comment
+        }
+        // The module is imported in front of all symbols and the code
+        if(tok == STR && prev_tok == IMPORT) {
+            module_import(pCi, p_buff);
+        }
+        prev_tok = tok;
+#ifdef cfg_LINE_NUMBERS
+        if(tok == DIM || tok == CONST || tok == IMPORT) {
+            p_line->flags |= LINE_DECL;
+        } else if(tok == DATA) {
+            p_line->flags |= LINE_DATA;
+        }
+#else
+        if(tok != ':') {
+            first = false;
+        }
+        if(tok != ',') {
+            label_list = tok == GOTO || tok == GOSUB;
+        }
+#endif
+        p_pos = p_next;
+    }
+    add_token(pCi, 0, 0, 0, false);
+    return true;
+}
+
+/*
+** Return the next source line and its length (incl. the line end).
+** Lines of the source code buffer are scanned in place, only the last
+** line is copied if it is not terminated by '\n' (the buffer needs no '\0').
+*/
+static char *read_line(comp_inst_t *pCi, uint16_t *p_len) {
+    if(pCi->p_src == NULL) {
+        if(pCi->get_line(pCi->file_ptr, pCi->a_line, k_MAX_LINE_LEN) == NULL) {
+            return NULL;
+        }
+        *p_len = strlen(pCi->a_line);
+        return pCi->a_line;
+    }
+    if(pCi->src_pos >= pCi->src_len) {
+        return NULL;
+    }
+    // The scanner stops at the line end and does not modify the source code
+    char *p_line = (char *)&pCi->p_src[pCi->src_pos];
+    size_t rest = pCi->src_len - pCi->src_pos;
+    char *p_end = memchr(p_line, '\n', rest);
+    if(p_end == NULL) {
+        size_t len = rest < k_MAX_LINE_LEN - 1 ? rest : k_MAX_LINE_LEN - 1;
+        memcpy(pCi->a_line, p_line, len);
+        pCi->a_line[len] = '\0';
+        pCi->src_pos = pCi->src_len;
+        *p_len = rest < 0xFFFF ? rest : 0xFFFF;
+        return pCi->a_line;
+    }
+    rest = p_end - p_line + 1;
+    pCi->src_pos += rest;
+    *p_len = rest < 0xFFFF ? rest : 0xFFFF;
+    return p_line;
+}
+
+#ifdef cfg_LINE_NUMBERS
+// Hash value (FNV-1a) of the source line text incl. the line end
+static uint32_t line_hash(const char *p_line, uint16_t len) {
+    uint32_t hash = 2166136261u;
+
+    for(uint16_t i = 0; i < len && p_line[i] != '\0'; i++) {
+        hash = (hash ^ (uint8_t)p_line[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Add the source line info of the scanned line (pc and map index are set by 'get_line()')
+static src_line_t *src_line_add(comp_inst_t *pCi, const char *p_line, uint16_t len) {
+    if(pCi->num_src_lines >= pCi->max_src_lines) {
+        uint32_t max = pCi->max_src_lines == 0 ? 256 : pCi->max_src_lines * 2;
+        if(max > 65535) {
+            max = 65535;
+        }
+        if(pCi->num_src_lines >= max) {
+            error(pCi, "too many lines", NULL);
+        }
+        src_line_t *p_lines = realloc(pCi->p_src_lines, max * sizeof(src_line_t));
+        if(p_lines == NULL) {
+            error(pCi, "out of memory", NULL);
+        }
+        pCi->p_src_lines = p_lines;
+        pCi->max_src_lines = max;
+    }
+    src_line_t *p_src_line = &pCi->p_src_lines[pCi->num_src_lines++];
+    p_src_line->hash = line_hash(p_line, len);
+    p_src_line->pc = 0;
+    p_src_line->map_idx = 0;
+    p_src_line->flags = 0;
+    return p_src_line;
+}
+#endif
+
+// Classify the scanned token text, return the token type (ID for all identifiers)
+static uint8_t scan_token(char *p_buff, uint16_t len, uint32_t *p_value) {
+    *p_value = 0;
+    if(p_buff[0] == '\"') {
+        if(len < 2 || p_buff[len - 1] != '\"') {
+            *p_value = 2;
+            return LEX_ERROR; // missing closing quote
+        }
+        return STR;
+    }
+    if(isdigit((int8_t)p_buff[0])) {
+        *p_value = atoi(p_buff);
+       return NUM;
+    }
+    if(isalpha((int8_t)p_buff[0]) || p_buff[0] == '_') {
+        return ID;
+    }
+    if(p_buff[0] == '=') {
+        return EQ;
+    }
+    if(p_buff[0] == '<') {
+        // parse '<=', '<>', and '<'
+        if (p_buff[1] == '=') {
+            return LQ;
+        }
+        if (p_buff[1] == '>') {
+            return NQ;
+        }
+        return LE;
+    }
+    if(p_buff[0] == '>') {
+        // parse '>=' or '>'
+        if (p_buff[0] == '=') {
+            return GQ;
+        }
+        return GR;
+    }
+    if(len == 1) {
+        return p_buff[0]; // Single character
+    }
+    return LEX_ERROR; // unknown character
+}
+
+// Make sure that the text buffer can take the token texts of one more line
+static void reserve_text(comp_inst_t *pCi) {
+    if(pCi->text_size + 2 * k_MAX_LINE_LEN > pCi->max_text) {
+        uint32_t max = pCi->max_text == 0 ? 4096 : pCi->max_text * 2;
+        char *p_mem = realloc(pCi->p_text, max);
+        if(p_mem == NULL) {
+            error(pCi, "out of memory", NULL);
+        }
+        pCi->p_text = p_mem;
+        pCi->max_text = max;
+    }
+}
+
+/*
+** Append a token. The token text with 'len' bytes (incl. '\0') was already
+** written to the end of the text buffer, 'len' = 0 for no text.
+*/
+static void add_token(comp_inst_t *pCi, uint8_t tok, uint16_t len, uint32_t value, bool colon) {
+    token_t *p_tok;
+
+    if(pCi->num_tokens >= pCi->max_tokens) {
+        uint32_t max = pCi->max_tokens == 0 ? 1024 : pCi->max_tokens * 2;
+        p_tok = realloc(pCi->p_token, max * sizeof(token_t));
+        if(p_tok == NULL) {
+            error(pCi, "out of memory", NULL);
+        }
+        pCi->p_token = p_tok;
+        pCi->max_tokens = max;
+    }
+    p_tok = &pCi->p_token[pCi->num_tokens++];
+    p_tok->tok = tok;
+    p_tok->value = value;
+    p_tok->colon = colon;
+    p_tok->text = len > 0 ? pCi->text_size : 0;
+    pCi->text_size += len;
+}
+
+// Skip the remaining tokens of the line
+static void skip_line(comp_inst_t *pCi) {
+    while(pCi->p_token[pCi->tok_pos].tok != 0) {
+        pCi->tok_pos++;
+    }
+    pCi->tok_next = pCi->tok_pos;
+}
+
+static bool get_line(comp_inst_t *pCi) {
+    skip_line(pCi);
+    // All tokens are used, scan the next line (incremental compilation)
+    if(pCi->tok_pos + 1 >= pCi->num_tokens && pCi->incremental) {
+        tokenize_line(pCi);
+    }
+    if(pCi->tok_pos + 1 < pCi->num_tokens) {
+        pCi->num_lines++;
+        pCi->gosub_end = 0;
+#ifndef cfg_LINE_NUMBERS        
+        pCi->linenum++;
+#endif
+        pCi->tok_pos = pCi->tok_next = pCi->tok_pos + 1;
+        pCi->next_tok = next_token(pCi);
+        while(pCi->next_tok == ':') {
+            pCi->tok_pos = pCi->tok_next;
+            pCi->next_tok = next_token(pCi);
+        }
+
+#ifdef cfg_LINE_NUMBERS
+        src_line_t *p_line = &pCi->p_src_lines[pCi->src_idx++];
+        p_line->pc = pCi->stmt_pc;
+        p_line->map_idx = pCi->num_line_map;
+        if(pCi->stmt_first) {
+            p_line->flags |= LINE_FIRST;
+            pCi->stmt_first = false;
+        }
+        uint8_t tok = lookahead(pCi);
+        if(tok == NUM) {
+            match(pCi, NUM);
+            if(pCi->value > 0 && pCi->value < 65536) {
+                if(pCi->value > pCi->linenum) {
+                    pCi->linenum = pCi->value;
+                    line_add(pCi, pCi->linenum, pCi->pc);
+                    pCi->label_defined = true;
+                } else if(pCi->mod_linenum > 0 && pCi->linenum == pCi->mod_linenum) {
+                    // First program line (the following lines are checked against this one)
+                    pCi->linenum = pCi->value;
+                    error(pCi, "line number has to follow the module lines", NULL);
+                } else {
+                    error(pCi, "line number out of order", NULL);
+                }
+            } else {
+                error(pCi, "line number out of range", NULL);
+            }
+        }
+#endif
+        trace_print(pCi);
+        return true;
+    }
+    return false;
+}
+
+// Read the first line of the next top-level statement
+static bool get_stmt(comp_inst_t *pCi) {
+    pCi->stmt_pc = pCi->pc;
+    pCi->stmt_first = true;
+    return get_line(pCi);
+}
+
+static uint8_t next_token(comp_inst_t *pCi) {
+    token_t *p_tok = &pCi->p_token[pCi->tok_pos];
+
+    pCi->p_buff = &pCi->p_text[p_tok->text];
+    if(p_tok->tok == 0) {
+        pCi->tok_next = pCi->tok_pos;
+        return 0; // End of line
+    }
+    pCi->tok_next = pCi->tok_pos + 1;
+    switch(p_tok->tok) {
+    case NUM:
+        pCi->value = p_tok->value;
+        return NUM;
+    case ID:
+        pCi->sym_idx = p_tok->value;
+        return pCi->p_symbol[pCi->sym_idx].type;
+    case LEX_ERROR:
+        if(p_tok->value == 1) {
+            error(pCi, "line too long", NULL);
+        }
+        if(p_tok->value == 2) {
+            error(pCi, "missing closing quote", pCi->p_buff);
+        }
+        error(pCi, "unknown character", pCi->p_buff);
+        return 0;
+    default:
+        return p_tok->tok;
+    }
+}
+
+static uint8_t lookahead(comp_inst_t *pCi) {
+    if(pCi->tok_pos == pCi->tok_next) {
+        pCi->next_tok = next_token(pCi);
+    }
+    //nb_print("lookahead: %s\n", pCi->p_buff);
+    return pCi->next_tok;
+}
+
+#ifndef cfg_LINE_NUMBERS
+static uint8_t lookfurther(comp_inst_t *pCi) {
+    return pCi->p_token[pCi->tok_pos].colon ? ':' : 0;
+}
+#endif
+
+static bool end_of_line(comp_inst_t *pCi) {
+    return lookahead(pCi) == 0;
+}
+
+static uint8_t next(comp_inst_t *pCi) {
+    if(pCi->tok_pos == pCi->tok_next) {
+       pCi->next_tok = next_token(pCi);
+    }
+    pCi->tok_pos = pCi->tok_next;
+    return pCi->next_tok;
+}
+
+static void match(comp_inst_t *pCi, uint8_t expected) {
+    uint8_t tok = next(pCi);
+    if (tok == expected) {
+    } else {
+        error(pCi, "syntax error", pCi->p_buff);
+    }
+}
+
+#ifndef cfg_LINE_NUMBERS
+static void label(comp_inst_t *pCi) {
+  uint8_t tok = lookahead(pCi);
+  if(tok == ID) { // Token recognized as variable?
+    // Convert to label (the variable index is not reused)
+    pCi->p_symbol[pCi->sym_idx].type = LABEL;
+    pCi->next_tok = LABEL;
+  } else if(tok == LABEL) {
+    // Already a label
+  } else {
+    error(pCi, "label expected", pCi->p_buff);
+  }
+  match(pCi, LABEL);
+}
+#endif
+
+// Token, which ends a block of statements (END SELECT: SELECT is the next token)
+static bool block_end(comp_inst_t *pCi, uint8_t tok) {
+    return tok == ELSE || tok == ELSEIF || tok == NEXT || tok == ENDIF || tok == LOOP || tok == CASE ||
+           (tok == END && pCi->p_token[pCi->tok_next].tok == SELECT);
+}
+
+static void compile_block(comp_inst_t *pCi) {
+    compile_stmts(pCi);
+    if(block_end(pCi, lookahead(pCi))) {
+        return;
+    }
+    while(get_line(pCi)) {
+        if(block_end(pCi, lookahead(pCi))) {
+            return;
+        }
+        compile_line(pCi);
+    }
+}
+
+static void compile_line(comp_inst_t *pCi) {
+#ifndef cfg_LINE_NUMBERS    
+    uint8_t tok = lookahead(pCi);
     if(tok == ID || tok == LABEL) {
         uint16_t idx = pCi->sym_idx;
-        if(lookfurther() == ':') {
-            label();
-            match(':');
-            a_Symbol[idx].value = pCi->pc;
+        if(lookfurther(pCi) == ':') {
+            label(pCi);
+            match(pCi, ':');
+            pCi->p_symbol[idx].value = pCi->pc;
+            pCi->p_symbol[idx].flags |= SYM_DEFINED;
+            pCi->label_defined = true;
+        }
+    }
+#endif
+    compile_stmts(pCi);
+}
+
+static void compile_stmts(comp_inst_t *pCi) {
+    nb_addr_t start = pCi->pc;
+    uint16_t num_lines = pCi->num_lines;
+    uint8_t tok = lookahead(pCi);
+    while(tok && !block_end(pCi, tok)) {
+        compile_stmt(pCi);
+        tok = lookahead(pCi);
+        if(pCi->pc >= cfg_MAX_CODE_SIZE - MAX_CODE_PER_LINE) {
+            error(pCi, "code size exceeded", NULL);
+            break;
+        }
+    }
+    // Statements of one line only
+    if(num_lines == pCi->num_lines) {
+        eliminate_common_subexpr(pCi, start);
+    }
+}
+
+static void compile_stmt(comp_inst_t *pCi) {
+    uint8_t tok = next(pCi);
+    if(pCi->first_data_declaration == false && tok != DATA) {
+        error(pCi, "data statement expected", NULL);
+    }
+    switch(tok) {
+    case FOR: compile_for(pCi); break;
+    case IF: compile_if(pCi); break;
+    case LET: tok = next(pCi); compile_var(pCi, tok); break;
+    case ID: compile_var(pCi, tok); break;
+    case SID: compile_var(pCi, tok); break;
+    case ARR: compile_var(pCi, tok); break;
+    case DIM: compile_dim(pCi); break;
+    case REM: remark(pCi); break;
+    case GOTO: compile_goto(pCi); break;
+    case GOSUB: compile_gosub(pCi); break;
+    case RETURN: compile_return(pCi); break;
+    case PRINT: compile_print(pCi); break;
+    case READ: compile_read(pCi); break;
+    case DATA: compile_data(pCi); break;
+    case RESTORE: compile_restore(pCi); break;
+    case CONST: compile_const(pCi); break;
+    case WHILE: compile_while(pCi); break;
+    case SELECT: compile_select(pCi); break;
+    case END: compile_end(pCi); break;
+    case XFUNC: compile_xfunc(pCi, e_NONE); break;
+    case BREAK: compile_break(pCi); break;
+#ifdef cfg_DATA_ACCESS    
+    case SET1: compile_set1(pCi); break;
+    case SET2: compile_set2(pCi); break;
+    case SET4: compile_set4(pCi); break;
+    case COPY: compile_copy(pCi); break;
+    case RETI: compile_reti(pCi); break;
+#endif
+    case ERASE: compile_erase(pCi); break;
+    case ON: compile_on(pCi); break;
+    case TRON: compile_tron(pCi); break;
+    case TROFF: compile_troff(pCi); break;
+    case FREE: compile_free(pCi); break;
+    case IMPORT: compile_import(pCi); break;
+    case ':': break;
+    default: error(pCi, "syntax error", pCi->p_buff); break;
+    }
+    pCi->last_tok = tok;
+}
+
+/* FOR ID '=' <Expression1> TO <Expression2> [STEP <Expression3>]
+**   <Statement>...
+** NEXT [ID]
+**
+** <Expression2>  and <Expression3> are pushed on the data stack
+*/
+static void compile_for(comp_inst_t *pCi) {
+    nb_addr_t pc;
+    uint8_t tok;
+    uint16_t idx;
+
+    pCi->p_code[pCi->pc++] = k_FOR_N1;
+    // FOR ID
+    match(pCi, ID);
+    idx = pCi->sym_idx;
+    match(pCi, EQ);
+    compile_expression(pCi, e_NUM);
+    pCi->p_code[pCi->pc++] = k_POP_VAR_N2;
+    pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+    match(pCi, TO);
+    compile_expression(pCi, e_NUM);
+    tok = lookahead(pCi);
+    if(tok == STEP) {
+        match(pCi, STEP);
+        compile_expression(pCi, e_NUM);
+    } else {
+        pCi->p_code[pCi->pc++] = k_PUSH_NUM_N2;
+        pCi->p_code[pCi->pc++] = 1;
+    }
+
+    pc = pCi->pc;
+    compile_block(pCi);
+
+    // NEXT [ID]
+    match(pCi, NEXT);
+    tok = lookahead(pCi);
+    if(tok == ID) {
+        match(pCi, ID);
+        if(idx != pCi->sym_idx) {
+            error(pCi, "mismatched 'for' and 'next'", NULL);
+        }
+    }
+    hoist_loop_invariants(pCi, pc, pCi->p_symbol[idx].value, false);
+    pc = map_code_addr(pCi, pc);
+    pCi->p_code[pCi->pc++] = k_NEXT_N4;
+    emit_addr(pCi, pc);
+    pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+}
+
+/*
+** WHILE <Expression>
+**    <Statement>...
+** LOOP
+*/
+static void compile_while(comp_inst_t *pCi) {
+    nb_addr_t pos1, pos2;
+    uint32_t iterations, exits;
+    int8_t cond;
+
+    pos1 = pCi->pc; // start of loop
+    pos2 = compile_condition(pCi, &cond); // end of loop
+    iterations = profile_site(pCi);
+    compile_block(pCi);
+    match(pCi, LOOP);
+    hoist_loop_invariants(pCi, pos1, 0, true);
+    pos1 = map_code_addr(pCi, pos1);
+    pos2 = map_code_addr(pCi, pos2);
+    // Hot loop (more iterations than exits): The condition is repeated at the end instead of the jump back
+    exits = profile_count(pCi, pCi->num_sites);
+    if(cond != -1 || iterations == NO_PROFILE || exits == NO_PROFILE || iterations <= exits ||
+       !rotate_loop(pCi, pos1, pos2)) {
+        pCi->p_code[pCi->pc++] = k_GOTO_N3;
+        emit_addr(pCi, pos1);
+    }
+    patch_jumps(pCi, pos2, pCi->pc);
+    profile_site(pCi); // loop exits
+}
+
+/*
+** Loop rotation (cfg_PROFILE): The condition 'pos1'..'pos2' is copied to the end of
+** the loop with a k_IF_TRUE_N3 back to the loop body. This saves the GOTO per
+** iteration. Only a condition with a single jump (without AND/OR) is copied.
+*/
+static bool rotate_loop(comp_inst_t *pCi, nb_addr_t pos1, nb_addr_t pos2) {
+    nb_addr_t pos, size;
+
+    if(pos2 <= pos1 || pCi->p_code[pos2 - 1] != k_IF_N3 || ACS_ADDR(pCi->p_code[pos2]) != 0) {
+        return false;
+    }
+    for(pos = pos1; pos < pos2 - 1; pos += instr_len(&pCi->p_code[pos])) {
+        uint8_t instr = pCi->p_code[pos];
+        if(instr == k_GOTO_N3 || instr == k_IF_N3 || instr == k_IF_TRUE_N3) {
+            return false;
+        }
+    }
+    size = pos2 - 1 - pos1;
+    if(pos != pos2 - 1 || pCi->pc + size + k_JUMP_LEN >= cfg_MAX_CODE_SIZE - MAX_CODE_PER_LINE) {
+        return false;
+    }
+    memcpy(&pCi->p_code[pCi->pc], &pCi->p_code[pos1], size);
+    pCi->pc += size;
+    pCi->p_code[pCi->pc++] = k_IF_TRUE_N3;
+    emit_addr(pCi, pos2 + k_ADDR_LEN);
+    return true;
+}
+
+/*
+** SELECT CASE <Expression>
+** CASE <Constant> [, <Constant>]...
+**    <Statement>...
+** [CASE ELSE
+**    <Statement>...]
+** END SELECT
+**
+** The branches are compiled first, all but the last one followed by a GOTO behind
+** the statement. Then the dispatch code is inserted in front of the branches: A jump table for
+** dense constants or a binary search, followed by a list of GOTO instructions
+** (like ON...GOTO).
+*/
+static void compile_select(comp_inst_t *pCi) {
+    case_t a_case[MAX_CASE_VALUES];
+    uint16_t num = 0;
+    nb_addr_t pos1;        // start of the branches
+    nb_addr_t pos2 = 0;    // chain of jumps behind the statement
+    nb_addr_t other = 0;   // CASE ELSE branch
+    nb_addr_t src;
+
+    match(pCi, CASE);
+    compile_expression(pCi, e_NUM);
+    pos1 = pCi->pc;
+    compile_block(pCi);
+    if(pCi->pc != pos1) {
+        error(pCi, "CASE expected", NULL); // statements in front of the first CASE
+    }
+    while(lookahead(pCi) == CASE) {
+        match(pCi, CASE);
+        if(other != 0) {
+            error(pCi, "CASE behind CASE ELSE", NULL);
+        }
+        if(pCi->pc != pos1) {
+            remove_trace(pCi);
+            emit_jump(pCi, k_GOTO_N3, &pos2);
+            trace_print(pCi);
+        }
+        if(lookahead(pCi) == ELSE) {
+            match(pCi, ELSE);
+            other = pCi->pc;
+        } else {
+            while(1) {
+                if(num >= MAX_CASE_VALUES) {
+                    error(pCi, "too many CASE values", NULL);
+                }
+                a_case[num++] = (case_t){const_value(pCi), pCi->pc};
+                if(lookahead(pCi) != ',') {
+                    break;
+                }
+                match(pCi, ',');
+            }
+        }
+        compile_block(pCi);
+    }
+    if(lookahead(pCi) != END) {
+        error(pCi, "END SELECT expected", NULL);
+    }
+    match(pCi, END);
+    match(pCi, SELECT);
+    patch_jumps(pCi, pos2, pCi->pc);
+    // The dispatch code is compiled behind the branches and moved in front of them
+    src = pCi->pc;
+    emit_select(pCi, a_case, num, other);
+    pCi->num_edits = 0;
+    add_code_edit(pCi, pos1, 0, src, pCi->pc - src, k_END, 0);
+    pCi->pc = src;
+    if(!apply_code_edits(pCi, pos1)) {
+        error(pCi, "code size exceeded", NULL);
+    }
+}
+
+// CASE or CONST array value: number or CONST variable
+static int32_t const_value(comp_inst_t *pCi) {
+    uint32_t factor = 1;
+    uint8_t tok = lookahead(pCi);
+
+    if(tok == '-') {
+        match(pCi, '-');
+        factor = -1;
+        tok = lookahead(pCi);
+    }
+    if(tok == NUM) {
+        match(pCi, NUM);
+        return (int32_t)(pCi->value * factor);
+    }
+    if(tok == e_CNST) {
+        match(pCi, e_CNST);
+        return (int32_t)(pCi->p_symbol[pCi->sym_idx].value * factor);
+    }
+    error(pCi, "constant expected", pCi->p_buff);
+    return 0;
+}
+
+/*
+** Emit the dispatch code: SELECT_TAB for constants which fill at least half of
+** their range, SELECT_BIN with the sorted constants otherwise. The list of GOTO
+** instructions follows, values not found continue with the GOTO behind the list
+** to the CASE ELSE branch ('other') or behind the statement (the current 'pc').
+*/
+static void emit_select(comp_inst_t *pCi, case_t *p_case, uint16_t num, nb_addr_t other) {
+    uint32_t range = 0;
+    uint16_t size, i, j;
+
+    // Sort the constants (insertion sort, the list is mostly sorted)
+    for(i = 1; i < num; i++) {
+        case_t tmp = p_case[i];
+        for(j = i; j > 0 && p_case[j - 1].value > tmp.value; j--) {
+            p_case[j] = p_case[j - 1];
+        }
+        p_case[j] = tmp;
+    }
+    for(i = 1; i < num; i++) {
+        if(p_case[i].value == p_case[i - 1].value) {
+            error(pCi, "duplicate CASE value", NULL);
+        }
+    }
+    if(num > 0) {
+        range = (uint32_t)p_case[num - 1].value - (uint32_t)p_case[0].value + 1;
+    }
+    if(num > 0 && range <= MAX_CASE_VALUES && range <= num * 2u) {
+        size = 6 + range * k_JUMP_LEN;
+    } else {
+        range = 0;
+        size = k_SELECT_BIN_LEN(num) + num * k_JUMP_LEN;
+    }
+    if(pCi->pc + size + k_JUMP_LEN >= cfg_MAX_CODE_SIZE - MAX_CODE_PER_LINE) {
+        error(pCi, "code size exceeded", NULL);
+    }
+    if(other == 0) {
+        other = pCi->pc;
+    }
+    if(range > 0) {
+        pCi->p_code[pCi->pc++] = k_SELECT_TAB_N6;
+        ACS32(pCi->p_code[pCi->pc]) = p_case[0].value;
+        pCi->p_code[pCi->pc + 4] = (uint8_t)range;
+        pCi->pc += 5;
+        for(i = 0, j = 0; i < range; i++) {
+            pCi->p_code[pCi->pc++] = k_GOTO_N3;
+            if(p_case[j].value == p_case[0].value + (int32_t)i) {
+                emit_addr(pCi, p_case[j++].addr);
+            } else {
+                emit_addr(pCi, other);
+            }
+        }
+    } else {
+        pCi->p_code[pCi->pc++] = k_SELECT_BIN_N2;
+        pCi->p_code[pCi->pc++] = (uint8_t)num;
+        for(i = 0; i < num; i++) {
+            ACS32(pCi->p_code[pCi->pc]) = p_case[i].value;
+            pCi->pc += 4;
+        }
+        for(i = 0; i < num; i++) {
+            pCi->p_code[pCi->pc++] = k_GOTO_N3;
+            emit_addr(pCi, p_case[i].addr);
+        }
+    }
+    pCi->p_code[pCi->pc++] = k_GOTO_N3;
+    emit_addr(pCi, other);
+}
+
+/*
+** IF <Expression> THEN
+**    <Statement>...
+** [ELSEIF <Expression> THEN
+**    <Statement>...]
+** [ELSE
+**    <Statement>...]
+** ENDIF
+*/
+static void compile_if_V2(comp_inst_t *pCi, nb_addr_t pos1, int8_t cond) {
+    uint8_t tok = 0;
+    nb_addr_t pos2; // endif
+    bool label = dead_branch_begin(pCi);
+ 
+    compile_block(pCi);
+    // Then branch of a constant false condition
+    if(dead_branch_end(pCi, pos1 - 1, label, cond == 0)) {
+        tok = lookahead(pCi);
+        if(tok == ELSEIF) {
+            match(pCi, tok);
+            compile_if(pCi);
+            return;
+        } else if(tok == ELSE) {
+            match(pCi, tok);
+            compile_block(pCi);
+        }
+        match(pCi, ENDIF);
+        return;
+    }
+    tok = lookahead(pCi);
+    if(tok == ELSEIF) {
+        match(pCi, tok);
+        remove_trace(pCi);
+        pCi->p_code[pCi->pc++] = k_GOTO_N3;
+        pos2 = pCi->pc; // end of else
+        pCi->pc += k_ADDR_LEN;
+        patch_jumps(pCi, pos1, pCi->pc);
+        trace_print(pCi);
+        label = dead_branch_begin(pCi);
+        compile_if(pCi);
+        ACS_ADDR(pCi->p_code[pos2]) = pCi->pc;
+        dead_branch_end(pCi, pos2 - 1, label, cond == 1);
+        return;
+    } else if(tok == ELSE) {
+        match(pCi, tok);
+        remove_trace(pCi);
+        pCi->p_code[pCi->pc++] = k_GOTO_N3;
+        pos2 = pCi->pc; // end of else
+        pCi->pc += k_ADDR_LEN;
+        patch_jumps(pCi, pos1, pCi->pc);
+        trace_print(pCi);
+        label = dead_branch_begin(pCi);
+        profile_site(pCi);
+        compile_block(pCi);
+        ACS_ADDR(pCi->p_code[pos2]) = pCi->pc;
+        dead_branch_end(pCi, pos2 - 1, label, cond == 1);
+    } else {
+        patch_jumps(pCi, pos1, pCi->pc);
+    }
+    match(pCi, ENDIF);
+}
+
+/*
+** A constant condition (after constant folding) needs no k_IF_N3: The true branch
+** is compiled without a test, the code of the dead branch is removed after parsing.
+** A dead branch with a label (possible jump target) is kept and skipped by a GOTO.
+*/
+static void compile_if(comp_inst_t *pCi) {
+    uint8_t tok;
+    int8_t cond;
+    nb_addr_t start = pCi->pc;
+    nb_addr_t pos = compile_condition(pCi, &cond); // jumps to the end of if
+    nb_addr_t pos1 = pCi->pc; // then branch
+    uint32_t then_count = profile_site(pCi);
+    uint32_t else_count;
+    bool label, removed;
+
+    tok = lookahead(pCi);
+    label = dead_branch_begin(pCi);
+    if(tok == THEN) {
+        match(pCi, THEN);
+        if(end_of_line(pCi)) {
+            pCi->label_defined = label;
+            compile_if_V2(pCi, pos, cond);
+            return;
+        }
+        compile_stmts(pCi);
+    } else if(tok == GOTO) {
+        match(pCi, GOTO);
+        compile_goto(pCi);
+    } else {
+        error(pCi, "THEN or GOTO expected", pCi->p_buff);
+    }
+    removed = dead_branch_end(pCi, pos - 1, label, cond == 0);
+    tok = lookahead(pCi);
+    if(tok == ELSE) {
+        match(pCi, ELSE);
+        if(removed) {
+            compile_stmts(pCi);
+            return;
+        }
+        pCi->p_code[pCi->pc++] = k_GOTO_N3; // goto END
+        patch_jumps(pCi, pos, pCi->pc + k_ADDR_LEN);
+        pos = pCi->pc; // end of else
+        pCi->pc += k_ADDR_LEN;
+        label = dead_branch_begin(pCi);
+        else_count = profile_site(pCi);
+        compile_stmts(pCi);
+        ACS_ADDR(pCi->p_code[pos]) = pCi->pc;
+        dead_branch_end(pCi, pos - 1, label, cond == 1);
+        // Hot THEN branch: It is placed behind the ELSE branch
+        if(cond == -1 && then_count != NO_PROFILE && else_count != NO_PROFILE && then_count > else_count) {
+            swap_branches(pCi, start, pos1, pos - 1);
+        }
+    } else if(!removed) {
+        patch_jumps(pCi, pos, pCi->pc);
+    }
+}
+
+/*
+** Branch layout of a one-line IF...THEN...ELSE (cfg_PROFILE): The THEN branch
+** 'pos1'..'pos2' (followed by the GOTO behind the ELSE branch) is executed more
+** often than the ELSE branch. The ELSE branch is moved in front and the inverted
+** condition jumps to the THEN branch at the end: The hot branch needs no GOTO.
+** Only a condition with a single jump (without AND/OR) is inverted.
+*/
+static bool swap_branches(comp_inst_t *pCi, nb_addr_t start, nb_addr_t pos1, nb_addr_t pos2) {
+    nb_addr_t pos3 = pos2 + k_JUMP_LEN; // else branch
+    nb_addr_t end = pCi->pc;
+    nb_addr_t size1 = pos2 - pos1;
+    nb_addr_t size2 = end - pos3;
+    nb_addr_t pos;
+
+    for(pos = start; pos < pos1 - k_JUMP_LEN; pos += instr_len(&pCi->p_code[pos])) {
+        uint8_t instr = pCi->p_code[pos];
+        if(instr == k_GOTO_N3 || instr == k_IF_N3 || instr == k_IF_TRUE_N3) {
+            return false;
+        }
+    }
+    if(pos != pos1 - k_JUMP_LEN || pCi->p_code[pos] != k_IF_N3 || pCi->p_code[pos2] != k_GOTO_N3) {
+        return false;
+    }
+    uint16_t *p_buff = malloc((end - pos1) * sizeof(uint16_t)); // (for the code and the trace)
+    uint8_t *p_code = (uint8_t *)p_buff;
+    if(p_buff == NULL) {
+        return false;
+    }
+    // The jumps within the branches move with them (the THEN branch ends at the GOTO)
+    relocate_jumps(pCi, pos1, pos2, pos2, size2 + k_JUMP_LEN);
+    relocate_jumps(pCi, pos3, end, end - 1, pos1 - pos3);
+    for(uint8_t i = 0; i < pCi->num_fw_decls; i++) {
+        if(pCi->a_forward_decl[i].pos >= pos1 && pCi->a_forward_decl[i].pos < pos2) {
+            pCi->a_forward_decl[i].pos += size2 + k_JUMP_LEN;
+        } else if(pCi->a_forward_decl[i].pos >= pos3 && pCi->a_forward_decl[i].pos < end) {
+            pCi->a_forward_decl[i].pos -= pos3 - pos1;
+        }
+    }
+    memcpy(p_code, &pCi->p_code[pos3], size2);
+    p_code[size2] = k_GOTO_N3;
+    ACS_ADDR(p_code[size2 + 1]) = end;
+    memcpy(&p_code[size2 + k_JUMP_LEN], &pCi->p_code[pos1], size1);
+    memcpy(&pCi->p_code[pos1], p_code, end - pos1);
+    pCi->p_code[pos1 - k_JUMP_LEN] = k_IF_TRUE_N3;
+    ACS_ADDR(pCi->p_code[pos1 - k_ADDR_LEN]) = pos1 + size2 + k_JUMP_LEN;
+#ifdef cfg_TRACE_SUPPORT
+    // (trace entries of inlined subroutines)
+    memcpy(p_buff, &pCi->p_trace[pos3], size2 * sizeof(uint16_t));
+    memset(&p_buff[size2], 0, k_JUMP_LEN * sizeof(uint16_t));
+    memcpy(&p_buff[size2 + k_JUMP_LEN], &pCi->p_trace[pos1], size1 * sizeof(uint16_t));
+    memcpy(&pCi->p_trace[pos1], p_buff, (end - pos1) * sizeof(uint16_t));
+#endif
+    free(p_buff);
+    pCi->gosub_end = 0;
+    return true;
+}
+
+// Add 'offs' to the jump addresses in the code 'start'..'end', which point to 'start'..'last'
+static void relocate_jumps(comp_inst_t *pCi, nb_addr_t start, nb_addr_t end, nb_addr_t last, nb_addr_t offs) {
+    for(nb_addr_t pos = start; pos < end; pos += instr_len(&pCi->p_code[pos])) {
+        switch(pCi->p_code[pos]) {
+        case k_GOTO_N3:
+        case k_GOSUB_N3:
+        case k_IF_N3:
+        case k_IF_TRUE_N3:
+        case k_NEXT_N4: {
+            nb_addr_t addr = ACS_ADDR(pCi->p_code[pos + 1]);
+            if(addr >= start && addr <= last) {
+                ACS_ADDR(pCi->p_code[pos + 1]) = addr + offs;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+/*
+** Condition of IF, ELSEIF, and WHILE with short-circuit evaluation of AND and OR:
+** The operands are tested one after the other and the remaining operands
+** are skipped, as soon as the result is known. Returns the chain of jumps
+** to the false branch (see 'patch_jumps(pCi)'). 'p_cond' is set to 0 or 1
+** for a constant condition, otherwise to -1.
+*/
+static nb_addr_t compile_condition(comp_inst_t *pCi, int8_t *p_cond) {
+    nb_addr_t start = pCi->pc;
+    nb_addr_t true_jumps = 0;
+    nb_addr_t false_jumps;
+    uint32_t value;
+    uint8_t tok;
+
+    do {
+        false_jumps = 0; // next OR term
+        do {
+            nb_addr_t pos = pCi->pc;
+            if(compile_not_expr(pCi) != e_NUM) {
+                error(pCi, "type mismatch", pCi->p_buff);
+            }
+            tok = lookahead(pCi);
+            bool is_const = get_const_value(pCi, pos, pCi->pc, &value);
+            if(is_const) {
+                pCi->pc = pos;
+            }
+            if(tok == OR) {
+                // Last operand of the term: The condition is true
+                if(!is_const) {
+                    emit_jump(pCi, k_IF_TRUE_N3, &true_jumps);
+                } else if(value != 0) {
+                    emit_jump(pCi, k_GOTO_N3, &true_jumps);
+                }
+            } else {
+                // The term is false
+                if(!is_const) {
+                    emit_jump(pCi, k_IF_N3, &false_jumps);
+                } else if(value == 0) {
+                    emit_jump(pCi, k_GOTO_N3, &false_jumps);
+                }
+            }
+            if(tok == AND) {
+                match(pCi, AND);
+            }
+        } while(tok == AND);
+        if(tok == OR) {
+            match(pCi, OR);
+            patch_jumps(pCi, false_jumps, pCi->pc);
+        }
+    } while(tok == OR);
+    patch_jumps(pCi, true_jumps, pCi->pc);
+
+    if(pCi->pc == start) {
+        *p_cond = 1;
+    } else if(pCi->pc == start + k_JUMP_LEN && false_jumps == start + 1) {
+        *p_cond = 0;
+    } else {
+        *p_cond = -1;
+    }
+    return false_jumps;
+}
+
+// Emit a jump and add it to the chain of jumps to the same, not yet known address
+static void emit_jump(comp_inst_t *pCi, uint8_t instr, nb_addr_t *p_chain) {
+    pCi->p_code[pCi->pc++] = instr;
+    ACS_ADDR(pCi->p_code[pCi->pc]) = *p_chain;
+    *p_chain = pCi->pc;
+    pCi->pc += k_ADDR_LEN;
+}
+
+// Emit the address operand of a jump
+static void emit_addr(comp_inst_t *pCi, nb_addr_t addr) {
+    ACS_ADDR(pCi->p_code[pCi->pc]) = addr;
+    pCi->pc += k_ADDR_LEN;
+}
+
+// Set the address of all jumps of the chain, linked by their address operands
+static void patch_jumps(comp_inst_t *pCi, nb_addr_t pos, nb_addr_t addr) {
+    while(pos != 0) {
+        nb_addr_t next = ACS_ADDR(pCi->p_code[pos]);
+        ACS_ADDR(pCi->p_code[pos]) = addr;
+        pos = next;
+    }
+}
+
+// Start of a branch, which could be removed: Track labels within the branch
+static bool dead_branch_begin(comp_inst_t *pCi) {
+    bool label = pCi->label_defined;
+    pCi->label_defined = false;
+    return label;
+}
+
+/*
+** End of a branch starting at 'pos': The code of a dead branch is removed,
+** unless it contains labels. Returns true, if the code was removed.
+*/
+static bool dead_branch_end(comp_inst_t *pCi, nb_addr_t pos, bool label, bool dead) {
+    bool removed = dead && !pCi->label_defined;
+    uint8_t num = 0;
+
+    if(removed) {
+        pCi->gosub_end = 0;
+        for(uint8_t i = 0; i < pCi->num_fw_decls; i++) {
+            if(pCi->a_forward_decl[i].pos < pos) {
+                pCi->a_forward_decl[num++] = pCi->a_forward_decl[i];
+            }
+        }
+        pCi->num_fw_decls = num;
+#ifdef cfg_TRACE_SUPPORT
+        // Keep the trace info of the next line
+        if(pCi->p_trace[pos] == 0) {
+            pCi->p_trace[pos] = pCi->p_trace[pCi->pc];
+        }
+        for(nb_addr_t i = pos + 1; i <= pCi->pc; i++) {
+            pCi->p_trace[i] = 0;
+        }
+#endif
+        pCi->pc = pos;
+    }
+    pCi->label_defined |= label;
+    return removed;
+}
+
+/*
+** Site of the profile (IF branch, WHILE loop, GOSUB call), numbered in source code
+** order: Emit the counter for the profile collection and return the execution count
+** of the profile in use (NO_PROFILE = unknown).
+*/
+static uint32_t profile_site(comp_inst_t *pCi) {
+#ifdef cfg_PROFILE
+    uint32_t site = pCi->num_sites++;
+
+    if(pCi->prof_collect && site < MAX_PROFILE_SITES) {
+        pCi->p_code[pCi->pc++] = k_PROFILE_N3;
+        ACS16(pCi->p_code[pCi->pc]) = site;
+        pCi->pc += 2;
+    }
+    return profile_count(pCi, site);
+#else
+    (void)pCi;
+    return NO_PROFILE;
+#endif
+}
+
+// Execution count of the site of the profile in use (NO_PROFILE = unknown)
+static uint32_t profile_count(comp_inst_t *pCi, uint32_t site) {
+#ifdef cfg_PROFILE
+    if(pCi->p_profile != NULL && site < pCi->num_profile) {
+        return pCi->p_profile[site];
+    }
+#else
+    (void)pCi;
+    (void)site;
+#endif
+    return NO_PROFILE;
+}
+
+static void compile_goto(comp_inst_t *pCi) {
+    nb_addr_t addr;
+#ifdef cfg_LINE_NUMBERS
+    match(pCi, NUM);
+    if(pCi->value == 0 || pCi->value > 65535) {
+        error(pCi, "line number out of range", NULL);
+    }
+    // Backward references are resolved immediately
+    addr = line_get(pCi->p_line_map, pCi->num_line_map, pCi->value);
+    if(addr == 0) {
+        forward_declaration(pCi, pCi->value, pCi->pc + 1);
+    }
+#else
+    label(pCi);
+    addr = pCi->p_symbol[pCi->sym_idx].value;
+    forward_declaration(pCi, pCi->sym_idx, pCi->pc + 1);
+#endif
+    pCi->p_code[pCi->pc++] = k_GOTO_N3;
+    emit_addr(pCi, addr);
+}
+
+static void compile_gosub(comp_inst_t *pCi) {
+    uint32_t calls = profile_site(pCi);
+    uint16_t max_size = MAX_INLINE_SIZE;
+    nb_addr_t addr;
+
+    // Hot call sites inline larger subroutines, never executed ones only empty subroutines
+    if(calls != NO_PROFILE) {
+        max_size = calls == 0 ? 0 : calls >= HOT_CALLS ? MAX_HOT_INLINE_SIZE : MAX_INLINE_SIZE;
+    }
+#ifdef cfg_LINE_NUMBERS
+    match(pCi, NUM);
+    if(pCi->value == 0 || pCi->value > 65535) {
+        error(pCi, "line number out of range", NULL);
+    }
+    // Backward references are resolved immediately
+    addr = line_get(pCi->p_line_map, pCi->num_line_map, pCi->value);
+    if(addr != 0 && inline_subroutine(pCi, addr, max_size)) {
+        return;
+    }
+    if(addr == 0) {
+        forward_declaration(pCi, pCi->value, pCi->pc + 1);
+    }
+#else
+    label(pCi);
+    addr = pCi->p_symbol[pCi->sym_idx].value;
+    if((pCi->p_symbol[pCi->sym_idx].flags & SYM_DEFINED) && inline_subroutine(pCi, addr, max_size)) {
+        return;
+    }
+    forward_declaration(pCi, pCi->sym_idx, pCi->pc + 1);
+#endif
+    pCi->p_code[pCi->pc++] = k_GOSUB_N3;
+    emit_addr(pCi, addr);
+    pCi->gosub_end = pCi->pc;
+}
+
+/*
+** Inline a small subroutine, which is already compiled: Its code up to the RETURN
+** is copied instead of the GOSUB, if it contains no jumps. The subroutine stays
+** in place for other calls and for jumps into it (ON...GOTO, 'nb_set_pc()').
+*/
+static bool inline_subroutine(comp_inst_t *pCi, nb_addr_t addr, uint16_t max_size) {
+    // (a subroutine of the module is part of the module code)
+    const uint8_t *p_code = addr < pCi->mod_end ? pCi->p_mod_code : pCi->p_code;
+    nb_addr_t end = addr < pCi->mod_end ? pCi->mod_end : pCi->pc;
+    nb_addr_t pos;
+    uint16_t size;
+
+    for(pos = addr; pos < end && pos - addr <= max_size; pos += instr_len(&p_code[pos])) {
+        switch(p_code[pos]) {
+        case k_END:
+        case k_FOR_N1:
+        case k_NEXT_N4:
+        case k_GOTO_N3:
+        case k_GOSUB_N3:
+        case k_IF_N3:
+        case k_IF_TRUE_N3:
+        case k_ON_GOTO_N2:
+        case k_ON_GOSUB_N2:
+        case k_SELECT_TAB_N6:
+        case k_SELECT_BIN_N2:
+        case k_RETI_N1:
+        case k_BREAK_INSTR_N3:
+        case k_LAZY_LINE_N3:
+        case k_GOTO_R2:
+        case k_IF_R2:
+        case k_IF_TRUE_R2:
+        case k_NEXT_R3:
+            return false;
+        case k_RETURN_N1:
+            size = pos - addr;
+            memcpy(&pCi->p_code[pCi->pc], &p_code[addr], size);
+#ifdef cfg_TRACE_SUPPORT
+            // The trace shows the lines of the subroutine (behind the line of the GOSUB)
+            for(uint16_t i = 0; i < size; i++) {
+                if(i > 0 || pCi->p_trace[pCi->pc] == 0) {
+                    pCi->p_trace[pCi->pc + i] = pCi->p_trace[addr + i];
+                }
+            }
+#endif
+#ifdef cfg_LINE_NUMBERS
+            mark_inlined_lines(pCi->p_src_lines, pCi->src_idx, addr, pos);
+            mark_inlined_lines(pCi->p_old_lines, pCi->num_old_lines, addr, pos);
+#endif
+            pCi->pc += size;
+            return true;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+#ifdef cfg_LINE_NUMBERS
+/*
+** Mark the source lines of the inlined code 'addr'..'end': A change of them
+** needs the complete compilation (see 'recompile()')
+*/
+static void mark_inlined_lines(src_line_t *p_lines, uint16_t num, nb_addr_t addr, nb_addr_t end) {
+    nb_addr_t first = 0;
+
+    // (the lines are sorted by the code address of their top-level statement)
+    for(uint16_t i = num; i > 0; i--) {
+        src_line_t *p_line = &p_lines[i - 1];
+        if(first != 0 && p_line->pc != first) {
+            break;
+        }
+        if(p_line->pc <= end) {
+            p_line->flags |= LINE_INLINED;
+        }
+        if(p_line->pc <= addr) {
+            first = p_line->pc;
+        }
+    }
+}
+#endif
+
+/*
+** Tail call: A RETURN directly behind a GOSUB of the same line turns the GOSUB
+** into a GOTO. The subroutine returns to the caller, and the RETURN is not
+** needed (it can't be a jump target within the line).
+*/
+static void compile_return(comp_inst_t *pCi) {
+    if(pCi->gosub_end != 0 && pCi->gosub_end == pCi->pc) {
+        pCi->p_code[pCi->pc - k_JUMP_LEN] = k_GOTO_N3;
+        pCi->gosub_end = 0;
+        return;
+    }
+    pCi->p_code[pCi->pc++] = k_RETURN_N1;
+}
+
+static void compile_var(comp_inst_t *pCi, uint8_t tok) {
+    uint16_t idx = pCi->sym_idx;
+    type_t type;
+
+    if(tok == SID) { // let a$ = "string"
+        match(pCi, EQ);
+        nb_addr_t pos = pCi->pc;
+        uint16_t offs;
+        compile_expression(pCi, e_STR);
+        if(get_string_literal(pCi, pos, pCi->pc, &offs)) {
+            // Var[value] = literal (no copy needed)
+            pCi->pc = pos;
+            pCi->p_code[pCi->pc++] = k_SET_STR_LIT_N4;
+            pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+            ACS16(pCi->p_code[pCi->pc]) = offs;
+            pCi->pc += 2;
+        } else {
+            // Var[value] = pop()
+            pCi->p_code[pCi->pc++] = k_POP_STR_N2;
+            pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+        }
+    } else if(tok == ID) { // let a = expression
+        match(pCi, EQ);
+        type = compile_expression(pCi, e_NUM);
+        if(type == e_NUM) {
+            // Var[value] = pop()
+            pCi->p_code[pCi->pc++] = k_POP_VAR_N2;
+            pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+        } else if(type == e_STR) {
+            // Var[value] = pop()
+            pCi->p_code[pCi->pc++] = k_POP_STR_N2;
+            pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+        } else {
+            error(pCi, "type mismatch", pCi->p_buff);
+        }
+    } else if(tok == ARR) { // let rx(0) = 1
+        match(pCi, '(');
+        compile_expression(pCi, e_NUM);
+        match(pCi, ')');
+        match(pCi, EQ);
+        compile_expression(pCi, e_NUM);
+        pCi->p_code[pCi->pc++] = k_SET_ARR_ELEM_N2;
+        pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+    } else {
+        error(pCi, "unknown variable type", pCi->p_buff);
+    }
+}
+
+static void compile_dim(comp_inst_t *pCi) {
+    uint8_t tok = next(pCi);
+    if(tok == ID || tok == ARR) {
+        uint16_t idx = pCi->sym_idx;
+        pCi->p_symbol[idx].type = ARR;
+        match(pCi, '(');
+        compile_expression(pCi, e_NUM);        
+        match(pCi, ')');
+        pCi->p_code[pCi->pc++] = k_DIM_ARR_N2;
+        pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+    } else {
+        error(pCi, "unknown variable type", pCi->p_buff);
+    }
+}
+
+static void remark(comp_inst_t *pCi) {
+    // Skip to end of line
+    skip_line(pCi);
+}
+
+/*
+** The items are pushed onto the stack and output by one PRINT_LIST instruction.
+** Items are output in front of an item, which can output something itself (external
+** function call, error message), and behind a string expression, because its temporary
+** buffer could be overwritten by the next item.
+*/
+static void compile_print(comp_inst_t *pCi) {
+    uint8_t a_format[MAX_PRINT_ITEMS];
+    uint8_t num = 0;
+    nb_addr_t pos;
+    type_t type;
+    bool add_newline = true;
+    bool flush;
+    uint8_t tok = lookahead(pCi);
+    if(tok == 0) {
+        pCi->p_code[pCi->pc++] = k_PRINT_NEWL_N1;
+        return;
+    }
+    while(tok && tok != ELSE && tok != ':') {
+        add_newline = true;
+        flush = false;
+        if(num == MAX_PRINT_ITEMS) {
+            print_list(pCi, pCi->pc, a_format, num);
+            num = 0;
+        }
+        pos = pCi->pc;
+        if(tok == STR) {
+            compile_string(pCi);
+            a_format[num] = k_PRT_STR;
+        } else if(tok == SID) {
+            pCi->p_code[pCi->pc++] = k_PUSH_VAR_N2;
+            pCi->p_code[pCi->pc++] = pCi->p_symbol[pCi->sym_idx].value;
+            a_format[num] = k_PRT_STR;
+            match(pCi, SID);
+        } else if(tok == SPC) { // spc function
+            match(pCi, SPC);
+            match(pCi, '(');
+            compile_expression(pCi, e_NUM);
+            match(pCi, ')');
+            a_format[num] = k_PRT_BLANKS;
+        } else {
+            type = compile_expression(pCi, e_ANY);
+            if(type == e_NUM) {
+                a_format[num] = k_PRT_VAL;
+            } else if(type == e_STR) {
+                a_format[num] = k_PRT_STR;
+                flush = pCi->p_code[pos] != k_PUSH_STR_N3 || pCi->pc != pos + instr_len(&pCi->p_code[pos]);
+            } else {
+                error(pCi, "type mismatch", pCi->p_buff);
+            }
+        }
+        if(num > 0 && may_fail(pCi, pos, pCi->pc)) {
+            print_list(pCi, pos, a_format, num);
+            a_format[0] = a_format[num];
+            num = 0;
+        }
+        num++;
+        tok = lookahead(pCi);
+        if(tok == ',') {
+            match(pCi, ',');
+            a_format[num - 1] |= k_PRT_TAB;
+            add_newline = false;
+            tok = lookahead(pCi);
+        } else if(tok == ';') {
+            match(pCi, ';');
+            tok = lookahead(pCi);
+            add_newline = false;
+        } else if(tok && tok != ELSE) {
+            a_format[num - 1] |= k_PRT_SPACE;
+        }
+        if(flush) {
+            print_list(pCi, pCi->pc, a_format, num);
+            num = 0;
+        }
+    }
+    if(add_newline && num > 0 && (a_format[num - 1] & k_PRT_SEP_MASK) == 0) {
+        a_format[num - 1] |= k_PRT_NEWL;
+        add_newline = false;
+    }
+    if(num > 0) {
+        print_list(pCi, pCi->pc, a_format, num);
+    }
+    if(add_newline) {
+        pCi->p_code[pCi->pc++] = k_PRINT_NEWL_N1;
+    }
+}
+
+// Insert a PRINT_LIST instruction for the pushed items at 'pos'
+static void print_list(comp_inst_t *pCi, nb_addr_t pos, uint8_t *p_format, uint8_t num) {
+    uint16_t len = k_PRINT_LIST_LEN(num);
+
+    memmove(&pCi->p_code[pos + len], &pCi->p_code[pos], pCi->pc - pos);
+    pCi->p_code[pos] = k_PRINT_LIST_N2;
+    pCi->p_code[pos + 1] = num;
+    memset(&pCi->p_code[pos + 2], 0, len - 2);
+    for(uint8_t i = 0; i < num; i++) {
+        pCi->p_code[pos + 2 + i / 2] |= p_format[i] << ((i % 2) * 4);
+    }
+    pCi->pc += len;
+}
+
+// Check if the code calls an external function or can abort with an error message
+static bool may_fail(comp_inst_t *pCi, nb_addr_t start, nb_addr_t end) {
+    for(nb_addr_t pos = start; pos < end; pos += instr_len(&pCi->p_code[pos])) {
+        switch(pCi->p_code[pos]) {
+        case k_XFUNC_N2:
+        case k_GET_ARR_ELEM_N2:
+        case k_GET_CONST_ELEM_N3:
+        case k_DIV_N1:
+        case k_GET_ARR_1BYTE_N2:
+        case k_GET_ARR_2BYTE_N2:
+        case k_GET_ARR_4BYTE_N2:
+            return true;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+static void compile_string(comp_inst_t *pCi) {
+    match(pCi, STR);
+    // push string address (without quotes)
+    uint16_t len = strlen(pCi->p_buff);
+    pCi->p_buff[len - 1] = '\0';
+    uint16_t offs = pool_string(pCi, pCi->p_buff + 1);
+    pCi->p_code[pCi->pc++] = k_PUSH_STR_N3;
+    ACS16(pCi->p_code[pCi->pc]) = offs;
+    pCi->pc += 2;
+}
+
+static void compile_data(comp_inst_t *pCi) {
+    uint8_t tok;
+    if(pCi->module) {
+        error(pCi, "DATA not allowed in modules", NULL);
+    }
+    if(pCi->first_data_declaration) {
+        pCi->first_data_declaration = false;
+        pCi->data_pc = pCi->pc;
+    }
+    
+    while(1) {
+        tok = next(pCi);
+        if(tok == NUM) {
+            pCi->a_data[pCi->data_idx++] = pCi->value & ~k_DATA_STR_TAG;
+        } else if(tok == STR) {
+            // without quotes but with 0
+            uint16_t len = strlen(pCi->p_buff) - 1;
+            pCi->p_buff[len] = '\0';
+            if(pCi->pc + len >= cfg_MAX_CODE_SIZE) {
+                error(pCi, "code size exceeded", NULL);
+            }
+            memcpy(&pCi->p_code[pCi->pc], pCi->p_buff + 1, len);
+            pCi->a_data[pCi->data_idx++] = pCi->pc | k_DATA_STR_TAG;
+            pCi->pc += len;
+        } else {
+            error(pCi, "syntax error", pCi->p_buff);
+        }
+        tok = lookahead(pCi);
+        if(tok == ',') {
+            match(pCi, ',');
+        } else {
+            break;
+        }
+    }
+}
+
+static void compile_read(comp_inst_t *pCi) {
+    uint8_t tok;
+    uint16_t idx;
+
+    while(1) {
+        tok = lookahead(pCi);
+        if(tok == ID) {
+            match(pCi, ID);
+            idx = pCi->sym_idx;
+            pCi->p_code[pCi->pc++] = k_READ_NUM_N1;
+            pCi->p_code[pCi->pc++] = k_POP_VAR_N2;
+            pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+        } else if(tok == SID) {
+            match(pCi, SID);
+            idx = pCi->sym_idx;
+            pCi->p_code[pCi->pc++] = k_READ_STR_N1;
+            pCi->p_code[pCi->pc++] = k_POP_STR_N2;
+            pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+        }
+        tok = lookahead(pCi);
+        if(tok == ',') {
+            match(pCi, ',');
+        } else {
+            break;
+        }
+    }
+}
+
+static void compile_restore(comp_inst_t *pCi) {
+    uint8_t tok = lookahead(pCi);
+    if(tok == NUM) {
+        compile_expression(pCi, e_NUM);
+    } else {
+        pCi->p_code[pCi->pc++] = k_PUSH_NUM_N2;
+        pCi->p_code[pCi->pc++] = 0;
+    }
+    pCi->p_code[pCi->pc++] = k_RESTORE_N1;
+}
+
+static void compile_end(comp_inst_t *pCi) {
+    pCi->p_code[pCi->pc++] = k_END;
+}
+
+static type_t compile_xfunc(comp_inst_t *pCi, uint8_t type) {
+    uint8_t idx = sym_get(pCi, pCi->p_buff);
+    uint8_t tok;
+    if(idx >= Setup.num_xfuncs) {
+        error(pCi, "unknown external function", pCi->p_buff);
+    }
+    if(type != e_ANY && type != Setup.a_xfuncs[idx].return_type) {
+        error(pCi, "syntax error", pCi->p_buff);
+    }
+    match(pCi, '(');
+    for(uint8_t i = 0; i < Setup.a_xfuncs[idx].num_params; i++) {
+        compile_expression(pCi, Setup.a_xfuncs[idx].type[i]);
+        pCi->p_code[pCi->pc++] = k_PUSH_PARAM_N1;
+        tok = lookahead(pCi);
+        if(tok == ',') {
+            match(pCi, ',');
+        } else if(tok == ')') {
+            add_default_params(pCi, Setup.a_xfuncs[idx].num_params - i - 1);
+            break;
+        } else {
+            error(pCi, "syntax error", pCi->p_buff);
         }
     }
+    pCi->p_code[pCi->pc++] = k_XFUNC_N2;
+    pCi->p_code[pCi->pc++] = idx;
+    match(pCi, ')');
+    return Setup.a_xfuncs[idx].return_type;
+}
+
+static void compile_break(comp_inst_t *pCi) {
+    pCi->p_code[pCi->pc++] = k_BREAK_INSTR_N3;
+    ACS16(pCi->p_code[pCi->pc]) = pCi->linenum;
+    pCi->pc += 2;
+}
+
+#ifdef cfg_DATA_ACCESS
+static void compile_set1(comp_inst_t *pCi) {
+    compile_set(pCi, k_SET_ARR_1BYTE_N2);
+}
+
+static void compile_set2(comp_inst_t *pCi) {
+    compile_set(pCi, k_SET_ARR_2BYTE_N2);
+}
+
+static void compile_set4(comp_inst_t *pCi) {
+    compile_set(pCi, k_SET_ARR_4BYTE_N2);
+}
+
+// copy(arr, offs, arr, offs, bytes)
+static void compile_copy(comp_inst_t *pCi) {
+    match(pCi, '(');
+    compile_expression(pCi, e_REF);
+    match(pCi, ',');
+    compile_expression(pCi, e_NUM);
+    match(pCi, ',');
+    compile_expression(pCi, e_REF);
+    match(pCi, ',');
+    compile_expression(pCi, e_NUM);
+    match(pCi, ',');
+    compile_expression(pCi, e_NUM);
+    match(pCi, ')');
+    pCi->p_code[pCi->pc++] = k_COPY_N1;
+}
+
+static void compile_set(comp_inst_t *pCi, uint8_t instr) {
+    uint8_t idx;
+    match(pCi, '(');
+    match(pCi, ARR);
+    idx = pCi->sym_idx;
+    match(pCi, ',');
+    compile_expression(pCi, e_NUM);
+    match(pCi, ',');
+    compile_expression(pCi, e_NUM);
+    match(pCi, ')');
+    pCi->p_code[pCi->pc++] = instr;
+    pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+}
+
+static void compile_get(comp_inst_t *pCi, uint8_t tok, uint8_t instr) {
+    uint8_t idx;
+    match(pCi, tok);
+    match(pCi, '(');
+    match(pCi, ARR);
+    idx = pCi->sym_idx;
+    match(pCi, ',');
+    compile_expression(pCi, e_NUM);
+    match(pCi, ')');
+    pCi->p_code[pCi->pc++] = instr;
+    pCi->p_code[pCi->pc++] = pCi->p_symbol[idx].value;
+}
+
+static void compile_reti(comp_inst_t *pCi) {
+    pCi->p_code[pCi->pc++] = k_RETI_N1;
+}   
 #endif
-    compile_stmts();
+
+static void compile_const(comp_inst_t *pCi) {
+    uint32_t factor = 1;
+    next(pCi);
+    uint16_t idx = pCi->sym_idx;
+    if(lookahead(pCi) == '(') {
+        compile_const_array(pCi, idx);
+        return;
+    }
+    match(pCi, EQ);
+    uint8_t tok = lookahead(pCi);
+    if(tok == '-') {
+        match(pCi, '-');
+        factor = -1;
+    }
+    match(pCi, NUM);
+    pCi->p_symbol[idx].type = e_CNST;
+    pCi->p_symbol[idx].value = pCi->value * factor;
 }
 
-static void compile_stmts(void) {
-    uint8_t tok = lookahead();
-    while(tok && !BLOCKEND(tok)) {
-        compile_stmt();
-        tok = lookahead();
-        if(pCi->pc >= cfg_MAX_CODE_SIZE - MAX_CODE_PER_LINE) {
-            error("code size exceeded", NULL);
+/*
+** Constant array 'CONST name() = value, value, ...', the list continues on the
+** next line behind a trailing ','. The values are stored in the string pool
+** (number of values, followed by the 32 bit values) and read from the code
+** segment, no heap memory and no DIM/READ at runtime are needed.
+*/
+static void compile_const_array(comp_inst_t *pCi, uint16_t idx) {
+    uint32_t a_val[1 + MAX_CONST_VALUES];
+    uint16_t num = 0;
+
+    match(pCi, '(');
+    match(pCi, ')');
+    match(pCi, EQ);
+    while(1) {
+        if(num >= MAX_CONST_VALUES) {
+            error(pCi, "too many values", NULL);
+        }
+        a_val[1 + num++] = const_value(pCi);
+        if(lookahead(pCi) != ',') {
             break;
         }
+        match(pCi, ',');
+        if(end_of_line(pCi) && !get_line(pCi)) {
+            error(pCi, "constant expected", NULL);
+        }
     }
+    a_val[0] = num;
+    pCi->p_symbol[idx].type = e_CARR;
+    pCi->p_symbol[idx].value = pool_add(pCi, a_val, (1 + num) * sizeof(uint32_t));
 }
 
-static void compile_stmt(void) {
-    uint8_t tok = next();
-    if(pCi->first_data_declaration == false && tok != DATA) {
-        error("data statement expected", NULL);
+static void compile_erase(comp_inst_t *pCi) {
+    uint8_t tok = next(pCi);
+    if(tok == SID || tok == ARR) {
+        pCi->p_code[pCi->pc++] = k_ERASE_ARR_N2;
+        pCi->p_code[pCi->pc++] = pCi->p_symbol[pCi->sym_idx].value;
+    } else {
+        error(pCi, "unknown variable type", pCi->p_buff);
     }
-    switch(tok) {
-    case FOR: compile_for(); break;
-    case IF: compile_if(); break;
-    case LET: tok = next(); compile_var(tok); break;
-    case ID: compile_var(tok); break;
-    case SID: compile_var(tok); break;
-    case ARR: compile_var(tok); break;
-    case DIM: compile_dim(); break;
-    case REM: remark(); break;
-    case GOTO: compile_goto(); break;
-    case GOSUB: compile_gosub(); break;
-    case RETURN: compile_return(); break;
-    case PRINT: compile_print(); break;
-    case READ: compile_read(); break;
-    case DATA: compile_data(); break;
-    case RESTORE: compile_restore(); break;
-    case CONST: compile_const(); break;
-    case WHILE: compile_while(); break;
-    case END: compile_end(); break;
-    case XFUNC: compile_xfunc(e_NONE); break;
-    case BREAK: compile_break(); break;
-#ifdef cfg_DATA_ACCESS    
-    case SET1: compile_set1(); break;
-    case SET2: compile_set2(); break;
-    case SET4: compile_set4(); break;
-    case COPY: compile_copy(); break;
-    case RETI: compile_reti(); break;
-#endif
-    case ERASE: compile_erase(); break;
-    case ON: compile_on(); break;
-    case TRON: compile_tron(); break;
-    case TROFF: compile_troff(); break;
-    case FREE: compile_free(); break;
-    case ':': break;
-    default: error("syntax error", pCi->a_buff); break;
+}
+
+static void compile_on(comp_inst_t *pCi) {
+    nb_addr_t pos;
+    uint8_t num;
+
+    compile_expression(pCi, e_NUM);
+    uint8_t tok = lookahead(pCi);
+    if(tok == GOSUB) {
+        match(pCi, GOSUB);
+        pCi->p_code[pCi->pc++] = k_ON_GOSUB_N2;
+    } else if(tok == GOTO) {
+        match(pCi, GOTO);
+        pCi->p_code[pCi->pc++] = k_ON_GOTO_N2;
+    } else {
+        error(pCi, "GOSUB or GOTO expected", pCi->p_buff);
     }
+    pos = pCi->pc;
+    pCi->p_code[pCi->pc++] = 0; // number of elements
+    num = list_of_numbers(pCi);
+    pCi->p_code[pos] = num;
 }
 
-/* FOR ID '=' <Expression1> TO <Expression2> [STEP <Expression3>]
-**   <Statement>...
-** NEXT [ID]
-**
-** <Expression2>  and <Expression3> are pushed on the data stack
+static uint8_t list_of_numbers(comp_inst_t *pCi) {
+    uint8_t num = 0;
+
+    while(1) {
+        compile_goto(pCi); 
+        num++;
+        uint8_t tok = lookahead(pCi);
+        if(tok == ',') {
+            match(pCi, ',');
+        } else {
+            break;
+        }
+    }
+    return num;
+}
+
+static void compile_tron(comp_inst_t *pCi) {
+    pCi->p_code[pCi->pc++] = k_TRON_N1;
+}
+
+static void compile_troff(comp_inst_t *pCi) {
+    pCi->p_code[pCi->pc++] = k_TROFF_N1;
+}
+
+static void compile_free(comp_inst_t *pCi) {
+    pCi->p_code[pCi->pc++] = k_FREE_N1;
+}
+
+// IMPORT "name" (the module is already imported by the scanner)
+static void compile_import(comp_inst_t *pCi) {
+    match(pCi, STR);
+}
+
+/*
+** Place the shared module code in front of the program and copy the symbols and
+** the line numbers of the module. The module labels and variables become part of
+** the program, so that the program can call the module subroutines via GOSUB.
+** The VM executes the module code from the module itself (see 'CODE_SEG()'),
+** the program code starts behind the module addresses.
 */
-static void compile_for(void) {
-    uint16_t pc;
-    uint8_t tok;
+static void module_import(comp_inst_t *pCi, char *p_name) {
+    module_t *p_mod = NULL;
+    char a_name[k_MAX_LINE_LEN];
+    char sym[k_MAX_SYM_LEN];
+
+    // without quotes
+    strcpy(a_name, &p_name[1]);
+    a_name[strlen(a_name) - 1] = '\0';
+    if(pCi->module) {
+        error(pCi, "IMPORT not allowed in modules", NULL);
+    }
+    if(pCi->pc != 1) {
+        return; // Incremental compilation, the module is already part of the code
+    }
+    sym_name(a_name, sym);
+    for(uint8_t i = 0; i < Setup.num_modules; i++) {
+        if(strcmp(Setup.a_modules[i].name, sym) == 0) {
+            p_mod = &Setup.a_modules[i];
+        }
+    }
+    if(p_mod == NULL) {
+        error(pCi, "unknown module", a_name);
+    }
+    if(pCi->num_sym > Setup.start_of_vars || pCi->num_line_map > 0) {
+        error(pCi, "IMPORT has to be the first statement", NULL);
+    }
+    // The module variables keep their indices, the program variables follow
+    if(p_mod->num_symbols < Setup.start_of_vars || memcmp(p_mod->p_symbol, pCi->p_symbol, Setup.start_of_vars * sizeof(sym_t)) != 0) {
+        error(pCi, "module compiled with other external functions", a_name);
+    }
+    memcpy(pCi->p_symbol, p_mod->p_symbol, p_mod->num_symbols * sizeof(sym_t));
+    free(pCi->p_sym_hash);
+    // (the string literals of the module keep their pool offsets)
+    if(!sym_hash_init(pCi, p_mod->num_symbols) || !pool_init(pCi, p_mod->p_pool, p_mod->pool_size)) {
+        error(pCi, "out of memory", NULL);
+    }
+    sym_resume(pCi);
+#ifdef cfg_LINE_NUMBERS
+    for(uint16_t i = 0; i < p_mod->num_lines; i++) {
+        line_add(pCi, p_mod->p_line_map[i].linenum, p_mod->p_line_map[i].pc);
+    }
+    if(p_mod->num_lines > 0) {
+        pCi->linenum = p_mod->p_line_map[p_mod->num_lines - 1].linenum;
+        pCi->mod_linenum = pCi->linenum;
+    }
+#endif
+    pCi->p_import = p_mod;
+    pCi->p_mod_code = p_mod->p_code;
+    pCi->mod_end = p_mod->code_size;
+    pCi->pc = pCi->mod_end;
+}
+
+/**************************************************************************************************
+ * Symbol table and other helper functions
+ *************************************************************************************************/
+
+/*
+** Add symbol to symbol table
+** id = symbol name
+** val = value (in case of variable the index to vm->variables)
+** type = type of symbol (ID, SID, ARR, LABEL)
+*/
+static uint16_t sym_add(comp_inst_t *pCi, char *id, uint32_t val, uint8_t type) {
+    char sym[k_MAX_SYM_LEN];
+    uint32_t hash = sym_name(id, sym);
+
+    return sym_insert(pCi, sym, hash, val, type);
+}
+
+// Same as 'sym_add()', but with the lower case name and its hash value
+static uint16_t sym_insert(comp_inst_t *pCi, char *sym, uint32_t hash, uint32_t val, uint8_t type) {
     uint16_t idx;
 
-    pCi->p_code[pCi->pc++] = k_FOR_N1;
-    // FOR ID
-    match(ID);
-    idx = pCi->sym_idx;
-    match(EQ);
-    compile_expression(e_NUM);
-    pCi->p_code[pCi->pc++] = k_POP_VAR_N2;
-    pCi->p_code[pCi->pc++] = a_Symbol[idx].value;
-    match(TO);
-    compile_expression(e_NUM);
-    tok = lookahead();
-    if(tok == STEP) {
-        match(STEP);
-        compile_expression(e_NUM);
-    } else {
-        pCi->p_code[pCi->pc++] = k_PUSH_NUM_N2;
-        pCi->p_code[pCi->pc++] = 1;
+    // Search for existing symbol
+    uint16_t *p_slot = sym_slot(pCi, sym, hash);
+    if(*p_slot != 0) {
+        idx = *p_slot - 1;
+        if(pCi->p_symbol[idx].value == 0 && pCi->p_symbol[idx].type == LABEL && val > 0) {
+            pCi->p_symbol[idx].value = val;
+        }
+        return idx;
     }
 
-    pc = pCi->pc;
-    compile_block();
+    // Add new symbol
+    if(pCi->num_sym >= cfg_MAX_NUM_SYM) {
+        error(pCi, "symbol table full", NULL);
+    }
+    idx = pCi->num_sym++;
+    strcpy(pCi->p_symbol[idx].name, sym);
+    pCi->p_symbol[idx].value = val;
+    pCi->p_symbol[idx].type = type;
+    pCi->p_symbol[idx].flags = 0;
+    if(type != LABEL) {
+        pCi->curr_var_idx++;
+    }
+    *p_slot = idx + 1;
+    return idx;
+}
 
-    // NEXT [ID]
-    match(NEXT);
-    tok = lookahead();
-    if(tok == ID) {
-        match(ID);
-        if(idx != pCi->sym_idx) {
-            error("mismatched 'for' and 'next'", NULL);
+/*
+** Add external function name to the shared table
+** (called by 'nb_define_external_function()' only)
+*/
+static void keyword_add(char *name, uint32_t val, uint8_t type) {
+    char sym[k_MAX_SYM_LEN];
+
+    sym_name(name, sym);
+    for(uint16_t i = 0; i < Setup.start_of_vars; i++) {
+        if(strcmp(Setup.a_keyword[i].name, sym) == 0) {
+            return;
         }
     }
-    pCi->p_code[pCi->pc++] = k_NEXT_N4;
-    pCi->p_code[pCi->pc++] = pc & 0xFF;
-    pCi->p_code[pCi->pc++] = (pc >> 8) & 0xFF;
-    pCi->p_code[pCi->pc++] = a_Symbol[idx].value;
+    if(Setup.start_of_vars >= cfg_MAX_NUM_XFUNC) {
+        nb_print("Error: keyword table full\n");
+        return;
+    }
+    strcpy(Setup.a_keyword[Setup.start_of_vars].name, sym);
+    Setup.a_keyword[Setup.start_of_vars].value = val;
+    Setup.a_keyword[Setup.start_of_vars].type = type;
+    Setup.start_of_vars++;
+}
+
+// Return the token type of the keyword 'sym' (lower case) or 0
+static uint8_t keyword_get(char *sym, uint32_t hash) {
+    uint8_t idx = a_KeywordHash[KW_HASH_SLOT(hash)];
+
+    if(idx != 0 && strcmp(a_KeywordList[idx - 1].name, sym) == 0) {
+        return a_KeywordList[idx - 1].type;
+    }
+    return 0;
+}
+
+static uint16_t sym_get(comp_inst_t *pCi, char *id) {
+    char sym[k_MAX_SYM_LEN];
+    uint32_t hash = sym_name(id, sym);
+
+    // Search for existing symbol
+    uint16_t *p_slot = sym_slot(pCi, sym, hash);
+    if(*p_slot != 0) {
+        return pCi->p_symbol[*p_slot - 1].value;
+    }
+    error(pCi, "unknown symbol", id);
+    return 0;
 }
 
 /*
-** WHILE <Expression>
-**    <Statement>...
-** LOOP
+** Allocate the hash index (at most half filled) and add the
+** first 'num' symbols (external functions or previous symbol table)
 */
-static void compile_while(void) {
-    uint16_t pos1, pos2;
+static bool sym_hash_init(comp_inst_t *pCi, uint16_t num) {
+    uint32_t size = 1;
 
-    pos1 = pCi->pc; // start of loop
-    compile_expression(e_NUM);
-    pCi->p_code[pCi->pc++] = k_IF_N3;
-    pos2 = pCi->pc; // end of loop
-    pCi->pc += 2;
-    compile_block();
-    match(LOOP);
-    pCi->p_code[pCi->pc++] = k_GOTO_N3;
-    pCi->p_code[pCi->pc++] = pos1 & 0xFF;
-    pCi->p_code[pCi->pc++] = (pos1 >> 8) & 0xFF;
-    ACS16(pCi->p_code[pos2]) = pCi->pc;
+    while(size < 2 * cfg_MAX_NUM_SYM) {
+        size <<= 1;
+    }
+    pCi->p_sym_hash = calloc(size, sizeof(uint16_t));
+    if(pCi->p_sym_hash == NULL) {
+        return false;
+    }
+    pCi->hash_mask = size - 1;
+    for(pCi->num_sym = 0; pCi->num_sym < num; pCi->num_sym++) {
+        char *sym = pCi->p_symbol[pCi->num_sym].name;
+        *sym_slot(pCi, sym, sym_name(sym, sym)) = pCi->num_sym + 1;
+    }
+    return true;
+}
+
+// Continue the variable numbering and the temporary variables of the copied symbol table
+static void sym_resume(comp_inst_t *pCi) {
+    pCi->curr_var_idx = get_num_vars(pCi);
+    for(uint16_t i = Setup.start_of_vars; i < pCi->num_sym; i++) {
+        if(pCi->p_symbol[i].name[0] == '#') {
+            uint8_t tmp = atoi(&pCi->p_symbol[i].name[1]);
+            if(tmp < MAX_TEMP_VARS) {
+                pCi->a_temp[tmp] = pCi->p_symbol[i].value;
+                pCi->num_temps = MAX(pCi->num_temps, tmp + 1);
+            }
+        }
+    }
 }
 
 /*
-** IF <Expression> THEN
-**    <Statement>...
-** [ELSEIF <Expression> THEN
-**    <Statement>...]
-** [ELSE
-**    <Statement>...]
-** ENDIF
+** Convert the symbol name 'id' to lower case (stored in 'sym', truncated
+** to k_MAX_SYM_LEN) and return its hash value (FNV-1a)
 */
-static void compile_if_V2(uint16_t pos1) {
-    uint8_t tok = 0;
-    uint16_t pos2; // endif
- 
-    compile_block();
-    tok = lookahead();
-    if(tok == ELSEIF) {
-        match(tok);
-        remove_trace();
-        pCi->p_code[pCi->pc++] = k_GOTO_N3;
-        pos2 = pCi->pc; // end of else
-        pCi->pc += 2;
-        ACS16(pCi->p_code[pos1]) = pCi->pc;
-        trace_print();
-        compile_if();
-        ACS16(pCi->p_code[pos2]) = pCi->pc;
-        return;
-    } else if(tok == ELSE) {
-        match(tok);
-        remove_trace();
-        pCi->p_code[pCi->pc++] = k_GOTO_N3;
-        pos2 = pCi->pc; // end of else
-        pCi->pc += 2;
-        ACS16(pCi->p_code[pos1]) = pCi->pc;
-        trace_print();
-        compile_block();
-        ACS16(pCi->p_code[pos2]) = pCi->pc;
+static uint32_t sym_name(char *id, char *sym) {
+    uint32_t hash = 2166136261u;
+    uint16_t i;
+
+    for(i = 0; i < k_MAX_SYM_LEN - 1 && id[i] != '\0'; i++) {
+        sym[i] = tolower(id[i]);
+        hash = (hash ^ (uint8_t)sym[i]) * 16777619u;
+    }
+    sym[i] = '\0';
+    return hash;
+}
+
+/*
+** Return the hash index slot of the symbol 'sym' (lower case),
+** which is either the existing entry or the free slot for it
+*/
+static uint16_t *sym_slot(comp_inst_t *pCi, char *sym, uint32_t hash) {
+    uint16_t i = (hash ^ (hash >> 16)) & pCi->hash_mask;
+
+    while(pCi->p_sym_hash[i] != 0 && strcmp(pCi->p_symbol[pCi->p_sym_hash[i] - 1].name, sym) != 0) {
+        i = (i + 1) & pCi->hash_mask;
+    }
+    return &pCi->p_sym_hash[i];
+}
+
+#ifdef cfg_LINE_NUMBERS
+/*
+** Add a line to the line number map. Line numbers are ascending,
+** so the map is sorted by line numbers and by code addresses.
+*/
+static void line_add(comp_inst_t *pCi, uint16_t linenum, nb_addr_t pc) {
+    if(pCi->num_line_map >= pCi->max_line_map) {
+        uint32_t max = pCi->max_line_map == 0 ? 256 : pCi->max_line_map * 2;
+        if(max > 65535) {
+            max = 65535;
+        }
+        line_t *p_map = realloc(pCi->p_line_map, max * sizeof(line_t));
+        if(p_map == NULL) {
+            error(pCi, "out of memory", NULL);
+        }
+        pCi->p_line_map = p_map;
+        pCi->max_line_map = max;
+    }
+    pCi->p_line_map[pCi->num_line_map].linenum = linenum;
+    pCi->p_line_map[pCi->num_line_map].pc = pc;
+    pCi->num_line_map++;
+}
+
+// Binary search, return the code address of the line or 0 if not found
+static nb_addr_t line_get(line_t *p_map, uint16_t num, uint16_t linenum) {
+    uint16_t lo = 0;
+    uint16_t hi = num;
+
+    while(lo < hi) {
+        uint16_t mid = (lo + hi) / 2;
+        if(p_map[mid].linenum < linenum) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if(lo < num && p_map[lo].linenum == linenum) {
+        return p_map[lo].pc;
+    }
+    return 0;
+}
+
+// Binary search, return the index of the first line behind code address 'addr'
+static uint16_t line_after(comp_inst_t *pCi, nb_addr_t addr) {
+    uint16_t lo = 0;
+    uint16_t hi = pCi->num_line_map;
+
+    while(lo < hi) {
+        uint16_t mid = (lo + hi) / 2;
+        if(pCi->p_line_map[mid].pc <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+#endif
+
+static void trace_print(comp_inst_t *pCi) {
+#ifdef cfg_TRACE_SUPPORT
+    pCi->p_trace[pCi->pc] = pCi->linenum;
+#endif
+}
+
+static void remove_trace(comp_inst_t *pCi) {
+#ifdef cfg_TRACE_SUPPORT
+    pCi->p_trace[pCi->pc] = 0;
+#endif
+}
+
+static void error(comp_inst_t *pCi, char *err, char *id) {
+    nb_print("Error in line %u: ", pCi->linenum);
+    if(id != NULL && id[0] != '\0') {
+        nb_print("%s '%s'\n", err, id);
     } else {
-        ACS16(pCi->p_code[pos1]) = pCi->pc;
+        nb_print("%s\n", err);
+    }
+    pCi->err_count++;
+    if(pCi->p_token != NULL) {
+        skip_line(pCi);
     }
-    match(ENDIF);
+    longjmp(pCi->jmp_buf, 0);
 }
 
-static void compile_if(void) {
-    uint8_t tok;
+static uint8_t get_num_vars(comp_inst_t *pCi) {
+    uint8_t idx = 0;
 
-    compile_expression(e_NUM);
-    pCi->p_code[pCi->pc++] = k_IF_N3;
-    uint16_t pos = pCi->pc; // end of if
-    pCi->pc += 2;
-    tok = lookahead();
-    if(tok == THEN) {
-        match(THEN);
-        if(end_of_line()) {
-            compile_if_V2(pos);
-            return;
+    for(uint16_t i = Setup.start_of_vars; i < pCi->num_sym; i++) {
+        if(pCi->p_symbol[i].name[0] != '\0' && pCi->p_symbol[i].type != LABEL)
+        {
+            idx++;
         }
-        compile_stmts();
-        ACS16(pCi->p_code[pos]) = pCi->pc;
-    } else if(tok == GOTO) {
-        match(GOTO);
-        compile_goto();
-        ACS16(pCi->p_code[pos]) = pCi->pc;
-    } else {
-        error("THEN or GOTO expected", pCi->a_buff);
     }
-    tok = lookahead();
-    if(tok == ELSE) {
-        match(ELSE);
-        pCi->p_code[pCi->pc++] = k_GOTO_N3; // goto END
-        ACS16(pCi->p_code[pos]) = pCi->pc + 2;
-        pos = pCi->pc; // end of else
-        pCi->pc += 2;
-        compile_stmts();
-        ACS16(pCi->p_code[pos]) = pCi->pc;
+    return idx;
+}
+
+static void add_default_params(comp_inst_t *pCi, uint8_t num) {
+    for(uint8_t i = 0; i < num; i++) {
+        pCi->p_code[pCi->pc++] = k_PUSH_NUM_N2;
+        pCi->p_code[pCi->pc++] = 0;
+        pCi->p_code[pCi->pc++] = k_PUSH_PARAM_N1;
     }
 }
 
-static void compile_goto(void) {
-    uint16_t addr;
-#ifdef cfg_LINE_NUMBERS
-    match(NUM);
-    pCi->sym_idx = sym_add(pCi->a_buff, 0, LABEL);
-    addr = 0;
-#else
-    label();
-    addr = a_Symbol[pCi->sym_idx].value;
-#endif
-    forward_declaration(pCi->sym_idx, pCi->pc + 1);
-    pCi->p_code[pCi->pc++] = k_GOTO_N3;
-    pCi->p_code[pCi->pc++] = addr & 0xFF;
-    pCi->p_code[pCi->pc++] = (addr >> 8) & 0xFF;
+// idx = index of symbol (SmyIdx)
+// pos = position in code array
+static void forward_declaration(comp_inst_t *pCi, uint16_t idx, nb_addr_t pos) {
+    if(pCi->num_fw_decls < cfg_MAX_FW_DECL) {
+        pCi->a_forward_decl[pCi->num_fw_decls].idx = idx;
+        pCi->a_forward_decl[pCi->num_fw_decls].pos = pos;
+        pCi->num_fw_decls++;
+    } else {
+        error(pCi, "too many forward declarations", NULL);
+    }
 }
 
-static void compile_gosub(void) {
-    uint16_t addr;
+static void resolve_forward_declarations(comp_inst_t *pCi) {
+    uint16_t idx;
+    nb_addr_t pos, addr;
+    for(uint8_t i = 0; i < pCi->num_fw_decls; i++) {
+        idx = pCi->a_forward_decl[i].idx;
+        pos = pCi->a_forward_decl[i].pos;
 #ifdef cfg_LINE_NUMBERS
-    match(NUM);
-    pCi->sym_idx = sym_add(pCi->a_buff, 0, LABEL);
-    addr = 0;
+        addr = line_get(pCi->p_line_map, pCi->num_line_map, idx);
+        if(addr == 0 && pCi->p_lazy != NULL) {
+            addr = lazy_stub(pCi, idx);
+        }
+        if(addr > 0) {
+            ACS_ADDR(pCi->p_code[pos]) = addr;
+        } else {
+            char a_num[8];
+            sprintf(a_num, "%u", idx);
+            error(pCi, "Line number not found", a_num);
+        }
 #else
-    label();
-    addr = a_Symbol[pCi->sym_idx].value;
+        if(pCi->p_symbol[idx].type == LABEL) {
+            addr = pCi->p_symbol[idx].value;
+            if(addr > 0) {
+                ACS_ADDR(pCi->p_code[pos]) = addr;
+            } else {
+                error(pCi, "Label not found", pCi->p_symbol[idx].name);
+            }
+        } else {
+
+            error(pCi, "forward declaration not resolved", pCi->p_symbol[idx].name);
+        }
 #endif
-    forward_declaration(pCi->sym_idx, pCi->pc + 1);
-    pCi->p_code[pCi->pc++] = k_GOSUB_N3;
-    pCi->p_code[pCi->pc++] = addr & 0xFF;
-    pCi->p_code[pCi->pc++] = (addr >> 8) & 0xFF;
+    }
+    pCi->num_fw_decls = 0;
 }
 
-static void compile_return(void) {
-    pCi->p_code[pCi->pc++] = k_RETURN_N1;
+static void append_data_to_code(comp_inst_t *pCi, t_VM *vm) {
+    pCi->p_code[pCi->pc++] = 0xFF;  // End tag before the data section starts
+    vm->data_start_addr = pCi->pc;
+    vm->data_read_offs = 0;
+    
+    if((pCi->pc + pCi->data_idx * 4) >= cfg_MAX_CODE_SIZE) {
+        error(pCi, "code size exceeded", NULL);
+    }
+    for(int i = 0; i < pCi->data_idx; i++) {
+        ACS32(pCi->p_code[pCi->pc]) = pCi->a_data[i];
+        pCi->pc += 4;
+    }
 }
 
-static void compile_var(uint8_t tok) {
-    uint16_t idx = pCi->sym_idx;
-    type_t type;
+// Continue with the string literals of the previous compilation or module
+static bool pool_init(comp_inst_t *pCi, const char *p_pool, uint32_t size) {
+    free(pCi->p_pool);
+    pCi->p_pool = malloc(size > 0 ? size : 1);
+    if(pCi->p_pool == NULL) {
+        pCi->pool_size = pCi->max_pool = 0;
+        return false;
+    }
+    memcpy(pCi->p_pool, p_pool, size);
+    pCi->pool_size = pCi->max_pool = size;
+    return true;
+}
 
-    if(tok == SID) { // let a$ = "string"
-        match(EQ);
-        compile_expression(e_STR);
-        // Var[value] = pop()
-        pCi->p_code[pCi->pc++] = k_POP_STR_N2;
-        pCi->p_code[pCi->pc++] = a_Symbol[idx].value;
-    } else if(tok == ID) { // let a = expression
-        match(EQ);
-        type = compile_expression(e_NUM);
-        if(type == e_NUM) {
-            // Var[value] = pop()
-            pCi->p_code[pCi->pc++] = k_POP_VAR_N2;
-            pCi->p_code[pCi->pc++] = a_Symbol[idx].value;
-        } else if(type == e_STR) {
-            // Var[value] = pop()
-            pCi->p_code[pCi->pc++] = k_POP_STR_N2;
-            pCi->p_code[pCi->pc++] = a_Symbol[idx].value;
-        } else {
-            error("type mismatch", pCi->a_buff);
+/*
+** Add a string literal to the pool and return its offset. Equal strings
+** and strings equal to the end of a longer one are stored only once.
+*/
+static uint16_t pool_string(comp_inst_t *pCi, const char *p_str) {
+    return pool_add(pCi, p_str, strlen(p_str) + 1);
+}
+
+// Add 'len' bytes (string literal or constant array) to the pool, equal bytes are reused
+static uint16_t pool_add(comp_inst_t *pCi, const void *p_data, uint32_t len) {
+    uint32_t pos;
+
+    for(pos = 0; pos + len <= pCi->pool_size; pos++) {
+        if(memcmp(&pCi->p_pool[pos], p_data, len) == 0) {
+            return pos;
         }
-    } else if(tok == ARR) { // let rx(0) = 1
-        match('(');
-        compile_expression(e_NUM);
-        match(')');
-        match(EQ);
-        compile_expression(e_NUM);
-        pCi->p_code[pCi->pc++] = k_SET_ARR_ELEM_N2;
-        pCi->p_code[pCi->pc++] = a_Symbol[idx].value;
-    } else {
-        error("unknown variable type", pCi->a_buff);
     }
+    if(pCi->pool_size + len > 0x10000) {
+        error(pCi, "string pool full", NULL);
+    }
+    if(pCi->pool_size + len > pCi->max_pool) {
+        uint32_t max = pCi->max_pool + MAX(len, POOL_GROW_SIZE);
+        char *p_pool = realloc(pCi->p_pool, max);
+        if(p_pool == NULL) {
+            error(pCi, "out of memory", NULL);
+        }
+        pCi->p_pool = p_pool;
+        pCi->max_pool = max;
+    }
+    pos = pCi->pool_size;
+    memcpy(&pCi->p_pool[pos], p_data, len);
+    pCi->pool_size += len;
+    return pos;
 }
 
-static void compile_dim(void) {
-    uint8_t tok = next();
-    if(tok == ID || tok == ARR) {
-        uint16_t idx = pCi->sym_idx;
-        a_Symbol[idx].type = ARR;
-        match('(');
-        compile_expression(e_NUM);        
-        match(')');
-        pCi->p_code[pCi->pc++] = k_DIM_ARR_N2;
-        pCi->p_code[pCi->pc++] = a_Symbol[idx].value;
-    } else {
-        error("unknown variable type", pCi->a_buff);
+// The string literals follow the data section
+static void append_pool_to_code(comp_inst_t *pCi, t_VM *vm) {
+    if(pCi->pc + pCi->pool_size >= cfg_MAX_CODE_SIZE) {
+        error(pCi, "code size exceeded", NULL);
+    }
+    vm->str_pool_addr = pCi->pc;
+    if(pCi->pool_size > 0) {
+        memcpy(&pCi->p_code[pCi->pc], pCi->p_pool, pCi->pool_size);
     }
+    pCi->pc += pCi->pool_size;
 }
 
-static void remark(void) {
-    // Skip to end of line
-    pCi->p_pos[0] = '\0';
-}
+#ifdef cfg_COMPACT_CODE
+/*
+** Compact encoding of the complete program: One byte instructions for the
+** variables and values 0..15, relative jumps for targets within -128..127
+** bytes. The jumps of ON...GOTO/GOSUB and SELECT lists and the jump over a module keep
+** their size, the jumps into the imported module stay absolute (the VM switches the
+** code segment only with them). All code addresses (jumps, line numbers, labels, trace,
+** DATA) are moved accordingly. Without memory, the code stays as it is.
+*/
+static void compact_code(comp_inst_t *pCi) {
+    nb_addr_t end = pCi->data_pc != 0 ? pCi->data_pc : pCi->pc; // (DATA strings are no instructions)
+    nb_addr_t start = pCi->mod_end > 0 ? pCi->mod_end : 1; // (the module code is never moved)
+    nb_addr_t *p_map = calloc(end + 1, sizeof(nb_addr_t));
+    uint8_t *p_size = calloc(end, sizeof(uint8_t)); // new instruction size, 0 = no instruction start
+    uint8_t *p_code = malloc(end);
+    nb_addr_t pos, addr, shrink = 0;
+    uint8_t list = 0;  // remaining jumps of an ON...GOTO/GOSUB or SELECT list
+    bool changed = true;
+    uint16_t i;
 
-static void compile_print(void) {
-    type_t type;
-    bool add_newline = true;
-    uint8_t tok = lookahead();
-    if(tok == 0) {
-        pCi->p_code[pCi->pc++] = k_PRINT_NEWL_N1;
+#define NEW_ADDR(addr)  ((addr) < end ? p_map[addr] : (addr) - shrink)
+#define JUMP_ADDR(pos)  ACS_ADDR(pCi->p_code[(pos) + 1])
+    if(p_map == NULL || p_size == NULL || p_code == NULL) {
+        free(p_map);
+        free(p_size);
+        free(p_code);
         return;
     }
-    while(tok && tok != ELSE && tok != ':') {
-        add_newline = true;
-        if(tok == STR) {
-            compile_string();
-            pCi->p_code[pCi->pc++] = k_PRINT_STR_N1;
-        } else if(tok == SID) {
-            pCi->p_code[pCi->pc++] = k_PUSH_VAR_N2;
-            pCi->p_code[pCi->pc++] = a_Symbol[pCi->sym_idx].value;
-            pCi->p_code[pCi->pc++] = k_PRINT_STR_N1;
-            match(SID);
-        } else if(tok == SPC) { // spc function
-            match(SPC);
-            match('(');
-            compile_expression(e_NUM);
-            match(')');
-            pCi->p_code[pCi->pc++] = k_PRINT_BLANKS_N1;
-        } else {
-            type = compile_expression(e_ANY);
-            if(type == e_NUM) {
-                pCi->p_code[pCi->pc++] = k_PRINT_VAL_N1;
-            } else if(type == e_STR) {
-                pCi->p_code[pCi->pc++] = k_PRINT_STR_N1;
+    for(pos = start; pos < end; pos += instr_len(&pCi->p_code[pos])) {
+        uint8_t instr = pCi->p_code[pos];
+        p_size[pos] = instr_len(&pCi->p_code[pos]);
+        if((instr == k_PUSH_VAR_N2 || instr == k_POP_VAR_N2 || instr == k_PUSH_NUM_N2) &&
+           pCi->p_code[pos + 1] < k_NUM_SHORT) {
+            p_size[pos] = 1;
+        } else if(instr == k_ON_GOTO_N2 || instr == k_ON_GOSUB_N2 || instr == k_SELECT_BIN_N2) {
+            list = pCi->p_code[pos + 1];
+        } else if(instr == k_SELECT_TAB_N6) {
+            list = pCi->p_code[pos + 5];
+        } else if(list > 0 && instr == k_GOTO_N3) {
+            list--;
+        } else if(is_jump(pCi, pos) && instr != k_GOSUB_N3 && !(pCi->module && pos == 1) && JUMP_ADDR(pos) >= start) {
+            p_size[pos] -= k_ADDR_LEN - 1; // relative first
+        }
+    }
+    // Relative jumps out of range become absolute, until all jumps fit
+    // (an address within an instruction is moved with the instruction)
+    for(pos = 1; pos < start; pos++) {
+        p_map[pos] = pos;
+    }
+    while(changed) {
+        changed = false;
+        addr = start;
+        for(pos = start; pos < end; pos++) {
+            if(p_size[pos] > 0) {
+                p_map[pos] = addr;
+                addr += p_size[pos];
             } else {
-                error("type mismatch", pCi->a_buff);
+                p_map[pos] = p_map[pos - 1];
             }
         }
-        tok = lookahead();
-        if(tok == ',') {
-            match(',');
-            pCi->p_code[pCi->pc++] = k_PRINT_TAB_N1;
-            add_newline = false;
-            tok = lookahead();
-        } else if(tok == ';') {
-            match(';');
-            tok = lookahead();
-            add_newline = false;
-        } else if(tok && tok != ELSE) {
-            pCi->p_code[pCi->pc++] = k_PRINT_SPACE_N1;
+        p_map[end] = addr;
+        shrink = end - addr;
+        for(pos = start; pos < end; pos++) {
+            if(p_size[pos] > 0 && is_jump(pCi, pos) && p_size[pos] < instr_len(&pCi->p_code[pos])) {
+                int32_t offs = (int32_t)NEW_ADDR(JUMP_ADDR(pos)) - (int32_t)p_map[pos];
+                if(offs < INT8_MIN || offs > INT8_MAX) {
+                    p_size[pos] += k_ADDR_LEN - 1;
+                    changed = true;
+                }
+            }
         }
     }
-    if(add_newline) {
-        pCi->p_code[pCi->pc++] = k_PRINT_NEWL_N1;
+    if(shrink == 0) {
+        free(p_map);
+        free(p_size);
+        free(p_code);
+        return;
     }
-}
 
-static void compile_string(void) {
-    match(STR);
-    // push string address
-    uint16_t len = strlen(pCi->a_buff);
-    pCi->a_buff[len - 1] = '\0';
-    pCi->p_code[pCi->pc++] = k_PUSH_STR_Nx;
-    pCi->p_code[pCi->pc++] = len - 1; // without quotes but with 0
-    strcpy((char*)&pCi->p_code[pCi->pc], pCi->a_buff + 1);
-    pCi->pc += len - 1;
-}
+    for(pos = start; pos < end; pos += instr_len(&pCi->p_code[pos])) {
+        uint8_t *p_src = &pCi->p_code[pos];
+        uint8_t *p_dst = &p_code[p_map[pos]];
+        uint16_t len = instr_len(p_src);
 
-static void compile_data(void) {
-    uint8_t tok;
-    if(pCi->first_data_declaration) {
-        pCi->first_data_declaration = false;
-    }
-    
-    while(1) {
-        tok = next();
-        if(tok == NUM) {
-            pCi->a_data[pCi->data_idx++] = pCi->value & ~k_DATA_STR_TAG;
-        } else if(tok == STR) {
-            // without quotes but with 0
-            uint16_t len = strlen(pCi->a_buff) - 1;
-            pCi->a_buff[len] = '\0';
-            if(pCi->pc + len >= cfg_MAX_CODE_SIZE) {
-                error("code size exceeded", NULL);
+        if(p_size[pos] == 1 && len == 2) {
+            switch(p_src[0]) {
+            case k_PUSH_VAR_N2: p_dst[0] = k_PUSH_VAR0_N1 + p_src[1]; break;
+            case k_POP_VAR_N2: p_dst[0] = k_POP_VAR0_N1 + p_src[1]; break;
+            default: p_dst[0] = k_PUSH_NUM0_N1 + p_src[1]; break;
             }
-            memcpy(&pCi->p_code[pCi->pc], pCi->a_buff + 1, len);
-            pCi->a_data[pCi->data_idx++] = pCi->pc | k_DATA_STR_TAG;
-            pCi->pc += len;
+        } else if(is_jump(pCi, pos) && p_size[pos] < len) {
+            switch(p_src[0]) {
+            case k_GOTO_N3: p_dst[0] = k_GOTO_R2; break;
+            case k_IF_N3: p_dst[0] = k_IF_R2; break;
+            case k_IF_TRUE_N3: p_dst[0] = k_IF_TRUE_R2; break;
+            default: p_dst[0] = k_NEXT_R3; p_dst[2] = p_src[k_NEXT_LEN - 1]; break;
+            }
+            p_dst[1] = (uint8_t)(NEW_ADDR(JUMP_ADDR(pos)) - p_map[pos]);
         } else {
-            error("syntax error", pCi->a_buff);
+            memcpy(p_dst, p_src, len);
+            if(is_jump(pCi, pos)) {
+                ACS_ADDR(p_dst[1]) = NEW_ADDR(JUMP_ADDR(pos));
+            }
         }
-        tok = lookahead();
-        if(tok == ',') {
-            match(',');
-        } else {
-            break;
+    }
+#ifdef cfg_TRACE_SUPPORT
+    // (the trace entries are moved in ascending order, the new address is never higher)
+    for(pos = 1; pos < pCi->pc; pos++) {
+        uint16_t linenum = pCi->p_trace[pos];
+        pCi->p_trace[pos] = 0;
+        if(linenum != 0 && (pos >= end || p_size[pos] > 0)) {
+            pCi->p_trace[NEW_ADDR(pos)] = linenum;
         }
     }
-}
-
-static void compile_read(void) {
-    uint8_t tok;
-    uint16_t idx;
+#endif
+    memcpy(&pCi->p_code[start], &p_code[start], p_map[end] - start);
+    memmove(&pCi->p_code[p_map[end]], &pCi->p_code[end], pCi->pc - end);
 
-    while(1) {
-        tok = lookahead();
-        if(tok == ID) {
-            match(ID);
-            idx = pCi->sym_idx;
-            pCi->p_code[pCi->pc++] = k_READ_NUM_N1;
-            pCi->p_code[pCi->pc++] = k_POP_VAR_N2;
-            pCi->p_code[pCi->pc++] = a_Symbol[idx].value;
-        } else if(tok == SID) {
-            match(SID);
-            idx = pCi->sym_idx;
-            pCi->p_code[pCi->pc++] = k_READ_STR_N1;
-            pCi->p_code[pCi->pc++] = k_POP_STR_N2;
-            pCi->p_code[pCi->pc++] = a_Symbol[idx].value;
+    for(i = 0; i < pCi->num_line_map; i++) {
+        pCi->p_line_map[i].pc = NEW_ADDR(pCi->p_line_map[i].pc);
+    }
+    for(i = 0; i < pCi->num_src_lines; i++) {
+        pCi->p_src_lines[i].pc = NEW_ADDR(pCi->p_src_lines[i].pc);
+    }
+    for(i = Setup.start_of_vars; i < pCi->num_sym; i++) {
+        sym_t *p_sym = &pCi->p_symbol[i];
+        if(p_sym->type == LABEL && (p_sym->flags & SYM_DEFINED) && p_sym->value > 0) {
+            p_sym->value = NEW_ADDR(p_sym->value);
         }
-        tok = lookahead();
-        if(tok == ',') {
-            match(',');
-        } else {
-            break;
+    }
+    for(i = 0; i < pCi->data_idx; i++) {
+        if(pCi->a_data[i] & k_DATA_STR_TAG) {
+            pCi->a_data[i] -= shrink;
         }
     }
+    if(pCi->data_pc != 0) {
+        pCi->data_pc -= shrink;
+    }
+    pCi->pc -= shrink;
+#undef NEW_ADDR
+#undef JUMP_ADDR
+    free(p_map);
+    free(p_size);
+    free(p_code);
 }
 
-static void compile_restore(void) {
-    uint8_t tok = lookahead();
-    if(tok == NUM) {
-        compile_expression(e_NUM);
-    } else {
-        pCi->p_code[pCi->pc++] = k_PUSH_NUM_N2;
-        pCi->p_code[pCi->pc++] = 0;
+// Instruction with an absolute jump address
+static bool is_jump(comp_inst_t *pCi, nb_addr_t pos) {
+    switch(pCi->p_code[pos]) {
+    case k_GOTO_N3:
+    case k_GOSUB_N3:
+    case k_IF_N3:
+    case k_IF_TRUE_N3:
+    case k_NEXT_N4:
+        return true;
+    default:
+        return false;
     }
-    pCi->p_code[pCi->pc++] = k_RESTORE_N1;
 }
+#endif
 
-static void compile_end(void) {
-    pCi->p_code[pCi->pc++] = k_END;
+/**************************************************************************************************
+ * Code optimizer
+ *************************************************************************************************/
+
+// Instruction size in bytes
+static uint16_t instr_len(const uint8_t *p_code) {
+    switch(p_code[0]) {
+    case k_MOD_MAGIC_N8:
+        return 8;
+    case k_DIV_MAGIC_N6:
+    case k_SELECT_TAB_N6:
+        return 6;
+    case k_SELECT_BIN_N2:
+        return k_SELECT_BIN_LEN(p_code[1]);
+    case k_PUSH_NUM_N5:
+        return 5;
+    case k_SET_STR_LIT_N4:
+        return 4;
+    case k_NEXT_N4:
+        return k_NEXT_LEN;
+    case k_PRINT_LIST_N2:
+        return k_PRINT_LIST_LEN(p_code[1]);
+    case k_GOTO_N3:
+    case k_GOSUB_N3:
+    case k_IF_N3:
+    case k_IF_TRUE_N3:
+    case k_LAZY_LINE_N3:
+        return k_JUMP_LEN;
+    case k_BREAK_INSTR_N3:
+    case k_PUSH_STR_N3:
+    case k_GET_CONST_ELEM_N3:
+    case k_STR_EQUAL_LIT_N3:
+    case k_STR_NOT_EQU_LIT_N3:
+    case k_PROFILE_N3:
+    case k_NEXT_R3:
+        return 3;
+    case k_PUSH_NUM_N2:
+    case k_PUSH_VAR_N2:
+    case k_POP_VAR_N2:
+    case k_POP_STR_N2:
+    case k_STORE_VAR_N2:
+    case k_DIM_ARR_N2:
+    case k_ON_GOTO_N2:
+    case k_ON_GOSUB_N2:
+    case k_SET_ARR_ELEM_N2:
+    case k_GET_ARR_ELEM_N2:
+    case k_SET_ARR_1BYTE_N2:
+    case k_GET_ARR_1BYTE_N2:
+    case k_SET_ARR_2BYTE_N2:
+    case k_GET_ARR_2BYTE_N2:
+    case k_SET_ARR_4BYTE_N2:
+    case k_GET_ARR_4BYTE_N2:
+    case k_XFUNC_N2:
+    case k_ERASE_ARR_N2:
+    case k_SHL_N2:
+    case k_DIV_POW2_N2:
+    case k_MOD_POW2_N2:
+    case k_GOTO_R2:
+    case k_IF_R2:
+    case k_IF_TRUE_R2:
+        return 2;
+    default:
+        return 1;
+    }
 }
 
-static type_t compile_xfunc(uint8_t type) {
-    uint8_t idx = sym_get(pCi->a_buff);
-    uint8_t tok;
-    if(idx >= NumXFuncs) {
-        error("unknown external function", pCi->a_buff);
+/*
+** Loop-invariant code motion for the loop body 'start'..pc.
+** Numeric expressions, which only read variables not written within the loop,
+** are computed once into hidden temporary variables in front of the body
+** and replaced by a variable push. Use 'map_code_addr(pCi)' to translate
+** code addresses of the body afterwards.
+*/
+static void hoist_loop_invariants(comp_inst_t *pCi, nb_addr_t start, uint8_t loop_var, bool while_loop) {
+    nb_addr_t end = pCi->pc;
+    nb_addr_t pos, addr;
+    bool a_written[cfg_NUM_VARS] = {0};
+    bool a_used[cfg_NUM_VARS] = {0};
+    expr_t a_expr[MAX_EXPRESSIONS];
+    uint8_t a_hoist[MAX_HOIST_EXPR];
+    uint8_t a_var[MAX_HOIST_EXPR];
+    uint8_t a_use[MAX_CODE_EDITS];
+    uint8_t a_idx[MAX_CODE_EDITS];
+    uint8_t num, num_hoist = 0, num_uses = 0;
+    bool has_label;
+    bool has_exit = false;
+
+    pCi->num_edits = 0;
+    if(end <= start) {
+        return;
+    }
+    uint8_t *p_target = calloc(end - start, 1);
+    if(p_target == NULL) {
+        return;
     }
-    if(type != e_ANY && type != a_XFuncs[idx].return_type) {
-        error("syntax error", pCi->a_buff);
+    if(!while_loop) {
+        a_written[loop_var] = true;
+        a_used[loop_var] = true;
     }
-    match('(');
-    for(uint8_t i = 0; i < a_XFuncs[idx].num_params; i++) {
-        compile_expression(a_XFuncs[idx].type[i]);
-        pCi->p_code[pCi->pc++] = k_PUSH_PARAM_N1;
-        tok = lookahead();
-        if(tok == ',') {
-            match(',');
-        } else if(tok == ')') {
-            add_default_params(a_XFuncs[idx].num_params - i - 1);
-            break;
-        } else {
-            error("syntax error", pCi->a_buff);
+    // The called code may change any variable
+    if(mark_block(pCi, start, end, p_target, a_written, a_used)) {
+        free(p_target);
+        return;
+    }
+    has_label = mark_labels(pCi, start, end, p_target);
+    for(uint8_t i = 0; i < pCi->num_fw_decls; i++) {
+        pos = pCi->a_forward_decl[i].pos;
+        if(pos > start && pos < end) {
+#ifdef cfg_LINE_NUMBERS
+            addr = line_get(pCi->p_line_map, pCi->num_line_map, pCi->a_forward_decl[i].idx);
+#else
+            addr = pCi->p_symbol[pCi->a_forward_decl[i].idx].value;
+#endif
+            if(addr < start || addr > end) {
+                has_exit = true;
+            }
         }
     }
-    pCi->p_code[pCi->pc++] = k_XFUNC_N2;
-    pCi->p_code[pCi->pc++] = idx;
-    match(')');
-    return a_XFuncs[idx].return_type;
-}
-
-static void compile_break(void) {
-    pCi->p_code[pCi->pc++] = k_BREAK_INSTR_N3;
-    ACS16(pCi->p_code[pCi->pc]) = pCi->linenum;
-    pCi->pc += 2;
-}
-
-#ifdef cfg_DATA_ACCESS
-static void compile_set1(void) {
-    compile_set(k_SET_ARR_1BYTE_N2);
-}
-
-static void compile_set2(void) {
-    compile_set(k_SET_ARR_2BYTE_N2);
-}
-
-static void compile_set4(void) {
-    compile_set(k_SET_ARR_4BYTE_N2);
-}
+    // Already resolved jumps
+    for(pos = start; pos < end; pos += instr_len(&pCi->p_code[pos])) {
+        addr = ACS_ADDR(pCi->p_code[pos + 1]);
+        if(pCi->p_code[pos] == k_GOTO_N3 && addr > 0 && (addr < start || addr > end)) {
+            has_exit = true;
+        }
+    }
+    // Code outside the loop could change variables and jump back into the body
+    if(has_label && (while_loop || has_exit)) {
+        free(p_target);
+        return;
+    }
+    num = scan_expressions(pCi, start, end, p_target, a_written, a_expr);
+    free(p_target);
 
-// copy(arr, offs, arr, offs, bytes)
-static void compile_copy(void) {
-    match('(');
-    compile_expression(e_REF);
-    match(',');
-    compile_expression(e_NUM);
-    match(',');
-    compile_expression(e_REF);
-    match(',');
-    compile_expression(e_NUM);
-    match(',');
-    compile_expression(e_NUM);
-    match(')');
-    pCi->p_code[pCi->pc++] = k_COPY_N1;
-}
+    // Equal expressions share the same temporary variable
+    for(uint8_t i = 0; i < num; i++) {
+        uint8_t k;
+        if(!a_expr[i].maximal || num_uses >= MAX_CODE_EDITS - MAX_HOIST_EXPR) {
+            continue;
+        }
+        for(k = 0; k < num_hoist; k++) {
+            if(same_expr(pCi, &a_expr[a_hoist[k]], &a_expr[i])) {
+                break;
+            }
+        }
+        if(k == num_hoist) {
+            if(num_hoist >= MAX_HOIST_EXPR) {
+                continue;
+            }
+            a_hoist[num_hoist++] = i;
+        }
+        a_use[num_uses] = i;
+        a_idx[num_uses++] = k;
+    }
+    if(num_uses == 0) {
+        return;
+    }
+    for(uint8_t k = 0; k < num_hoist; k++) {
+        if(!get_temp_var(pCi, a_used, &a_var[k])) {
+            return;
+        }
+    }
 
-static void compile_set(uint8_t instr) {
-    uint8_t idx;
-    match('(');
-    match(ARR);
-    idx = pCi->sym_idx;
-    match(',');
-    compile_expression(e_NUM);
-    match(',');
-    compile_expression(e_NUM);
-    match(')');
-    pCi->p_code[pCi->pc++] = instr;
-    pCi->p_code[pCi->pc++] = a_Symbol[idx].value;
+    // Pre-header: #tmp = expression, loop body: expression replaced by #tmp
+    for(uint8_t k = 0; k < num_hoist; k++) {
+        add_code_edit(pCi, start, 0, a_expr[a_hoist[k]].pos, a_expr[a_hoist[k]].len, k_POP_VAR_N2, a_var[k]);
+    }
+    for(uint8_t i = 0; i < num_uses; i++) {
+        add_code_edit(pCi, a_expr[a_use[i]].pos, a_expr[a_use[i]].len, 0, 0, k_PUSH_VAR_N2, a_var[a_idx[i]]);
+    }
+    apply_code_edits(pCi, start);
 }
 
-static void compile_get(uint8_t tok, uint8_t instr) {
-    uint8_t idx;
-    match(tok);
-    match('(');
-    match(ARR);
-    idx = pCi->sym_idx;
-    match(',');
-    compile_expression(e_NUM);
-    match(')');
-    pCi->p_code[pCi->pc++] = instr;
-    pCi->p_code[pCi->pc++] = a_Symbol[idx].value;
-}
+/*
+** Common subexpression elimination for the statements 'start'..pc of one line.
+** A repeated numeric expression is copied into a hidden temporary variable
+** at its first occurrence and replaced by a variable push afterwards,
+** as long as no variable of the expression is written in between.
+*/
+static void eliminate_common_subexpr(comp_inst_t *pCi, nb_addr_t start) {
+    nb_addr_t end = pCi->pc;
+    bool a_written[cfg_NUM_VARS] = {0};
+    bool a_used[cfg_NUM_VARS] = {0};
+    expr_t a_expr[MAX_EXPRESSIONS];
+    uint8_t a_order[MAX_EXPRESSIONS];
+    bool a_done[MAX_EXPRESSIONS] = {0};
+    uint8_t a_chain[MAX_CODE_EDITS] = {0};
+    uint8_t num, num_chain;
 
-static void compile_reti(void) {
-    pCi->p_code[pCi->pc++] = k_RETI_N1;
-}   
-#endif
+    pCi->num_edits = 0;
+    if(end <= start) {
+        return;
+    }
+    uint8_t *p_target = calloc(end - start, 1);
+    if(p_target == NULL) {
+        return;
+    }
+    mark_block(pCi, start, end, p_target, a_written, a_used);
+    mark_labels(pCi, start, end, p_target);
+    num = scan_expressions(pCi, start, end, p_target, NULL, a_expr);
+    free(p_target);
 
-static void compile_const(void) {
-    uint32_t factor = 1;
-    next();
-    uint16_t idx = pCi->sym_idx;
-    match(EQ);
-    uint8_t tok = lookahead();
-    if(tok == '-') {
-        match('-');
-        factor = -1;
+    // Larger expressions first, equal expressions in code order
+    for(uint8_t i = 0; i < num; i++) {
+        uint8_t j = i;
+        while(j > 0 && a_expr[a_order[j - 1]].len < a_expr[i].len) {
+            a_order[j] = a_order[j - 1];
+            j--;
+        }
+        a_order[j] = i;
     }
-    match(NUM);
-    a_Symbol[idx].type = e_CNST;
-    a_Symbol[idx].value = pCi->value * factor;
-}
-
-static void compile_erase(void) {
-    uint8_t tok = next();
-    if(tok == SID || tok == ARR) {
-        pCi->p_code[pCi->pc++] = k_ERASE_ARR_N2;
-        pCi->p_code[pCi->pc++] = a_Symbol[pCi->sym_idx].value;
-    } else {
-        error("unknown variable type", pCi->a_buff);
+    for(uint8_t i = 0; i < num; i++) {
+        uint8_t k = a_order[i];
+        if(a_done[k]) {
+            continue;
+        }
+        num_chain = 0;
+        for(uint8_t j = k; j < num; j++) {
+            expr_t *p_first = &a_expr[a_chain[0]];
+            if(a_done[j] || !same_expr(pCi, &a_expr[k], &a_expr[j])) {
+                continue;
+            }
+            a_done[j] = true;
+            if(is_replaced(pCi, a_expr[j].pos, a_expr[j].len)) {
+                continue; // part of a larger replaced expression
+            }
+            if(num_chain > 0 && num_chain < MAX_CODE_EDITS && a_expr[j].block == p_first->block &&
+               !is_modified(pCi, p_first, p_first->pos + p_first->len, a_expr[j].pos)) {
+                a_chain[num_chain++] = j;
+            } else {
+                add_common_subexpr(pCi, a_expr, a_chain, num_chain, a_used);
+                a_chain[0] = j;
+                num_chain = 1;
+            }
+        }
+        add_common_subexpr(pCi, a_expr, a_chain, num_chain, a_used);
+    }
+    if(pCi->num_edits > 0) {
+        apply_code_edits(pCi, start);
     }
 }
 
-static void compile_on(void) {
-    uint16_t pos;
-    uint8_t num;
+// Store the first expression of the chain and replace all others by the temporary variable
+static void add_common_subexpr(comp_inst_t *pCi, expr_t *p_expr, uint8_t *p_chain, uint8_t num, bool *p_used) {
+    expr_t *p_first = &p_expr[p_chain[0]];
+    uint16_t instrs = 0;
+    uint8_t var;
 
-    compile_expression(e_NUM);
-    uint8_t tok = lookahead();
-    if(tok == GOSUB) {
-        match(GOSUB);
-        pCi->p_code[pCi->pc++] = k_ON_GOSUB_N2;
-    } else if(tok == GOTO) {
-        match(GOTO);
-        pCi->p_code[pCi->pc++] = k_ON_GOTO_N2;
-    } else {
-        error("GOSUB or GOTO expected", pCi->a_buff);
+    if(num < 2) {
+        return;
+    }
+    for(nb_addr_t pos = p_first->pos; pos < p_first->pos + p_first->len; pos += instr_len(&pCi->p_code[pos])) {
+        instrs++;
+    }
+    // The additional store instruction has to pay off
+    if((instrs - 1) * (num - 1) <= 1 || pCi->num_edits + num > MAX_CODE_EDITS) {
+        return;
+    }
+    if(!get_temp_var(pCi, p_used, &var)) {
+        return;
+    }
+    add_code_edit(pCi, p_first->pos + p_first->len, 0, 0, 0, k_STORE_VAR_N2, var);
+    for(uint8_t i = 1; i < num; i++) {
+        add_code_edit(pCi, p_expr[p_chain[i]].pos, p_expr[p_chain[i]].len, 0, 0, k_PUSH_VAR_N2, var);
     }
-    pos = pCi->pc;
-    pCi->p_code[pCi->pc++] = 0; // number of elements
-    num = list_of_numbers();
-    pCi->p_code[pos] = num;
 }
 
-static uint8_t list_of_numbers(void) {
-    uint8_t num = 0;
+/*
+** Collect written and used variables and the jump targets of the code block 'start'..end.
+** Returns true, if the block calls code, which could change any variable.
+*/
+static bool mark_block(comp_inst_t *pCi, nb_addr_t start, nb_addr_t end, uint8_t *p_target, bool *p_written, bool *p_used) {
+    uint8_t *p_code = pCi->p_code;
+    nb_addr_t pos, addr;
+    bool calls = false;
 
-    while(1) {
-        compile_goto(); 
-        num++;
-        uint8_t tok = lookahead();
-        if(tok == ',') {
-            match(',');
-        } else {
+    for(pos = start; pos < end; pos += instr_len(&p_code[pos])) {
+        switch(p_code[pos]) {
+        case k_POP_VAR_N2:
+        case k_POP_STR_N2:
+        case k_SET_STR_LIT_N4:
+        case k_STORE_VAR_N2:
+        case k_DIM_ARR_N2:
+        case k_ERASE_ARR_N2:
+        case k_SET_ARR_ELEM_N2:
+        case k_SET_ARR_1BYTE_N2:
+        case k_SET_ARR_2BYTE_N2:
+        case k_SET_ARR_4BYTE_N2:
+            p_written[p_code[pos + 1]] = true;
+            p_used[p_code[pos + 1]] = true;
+            break;
+        case k_PUSH_VAR_N2:
+            p_used[p_code[pos + 1]] = true;
+            break;
+        case k_NEXT_N4:
+            p_written[p_code[pos + k_NEXT_LEN - 1]] = true;
+            p_used[p_code[pos + k_NEXT_LEN - 1]] = true;
+            // fall through
+        case k_GOTO_N3:
+        case k_GOSUB_N3:
+        case k_IF_N3:
+        case k_IF_TRUE_N3:
+            addr = ACS_ADDR(p_code[pos + 1]);
+            if(addr > start && addr < end) {
+                p_target[addr - start] = 1;
+            }
+            calls |= p_code[pos] == k_GOSUB_N3;
+            break;
+        case k_ON_GOSUB_N2:
+        case k_XFUNC_N2:
+        case k_RETI_N1:
+            calls = true;
+            break;
+        default:
             break;
         }
     }
-    return num;
-}
-
-static void compile_tron(void) {
-    pCi->p_code[pCi->pc++] = k_TRON_N1;
+    return calls;
 }
 
-static void compile_troff(void) {
-    pCi->p_code[pCi->pc++] = k_TROFF_N1;
-}
+// Labels within the code block are additional entry points
+static bool mark_labels(comp_inst_t *pCi, nb_addr_t start, nb_addr_t end, uint8_t *p_target) {
+    bool has_label = false;
 
-static void compile_free(void) {
-    pCi->p_code[pCi->pc++] = k_FREE_N1;
+#ifdef cfg_LINE_NUMBERS
+    for(uint16_t i = line_after(pCi, start); i < pCi->num_line_map && pCi->p_line_map[i].pc <= end; i++) {
+        has_label = true;
+        if(pCi->p_line_map[i].pc < end) {
+            p_target[pCi->p_line_map[i].pc - start] = 1;
+        }
+    }
+#else
+    for(uint16_t i = Setup.start_of_vars; i < pCi->num_sym; i++) {
+        if(pCi->p_symbol[i].type == LABEL && pCi->p_symbol[i].value > start && pCi->p_symbol[i].value <= end) {
+            has_label = true;
+            if(pCi->p_symbol[i].value < end) {
+                p_target[pCi->p_symbol[i].value - start] = 1;
+            }
+        }
+    }
+#endif
+    return has_label;
 }
 
-/**************************************************************************************************
- * Symbol table and other helper functions
- *************************************************************************************************/
-
 /*
-** Add symbol to symbol table
-** id = symbol name
-** val = value (in case of variable the index to vm->variables)
-** type = type of symbol (ID, SID, ARR, LABEL)
+** Simulate the data stack of the code block 'start'..end to find numeric
+** expressions (more than a single push) without side effects.
+** With 'p_written', expressions which only read variables not written
+** within the block are marked as invariant.
 */
-static uint16_t sym_add(char *id, uint32_t val, uint8_t type) {
-    uint16_t start = 0;
-    char sym[k_MAX_SYM_LEN];
+static uint8_t scan_expressions(comp_inst_t *pCi, nb_addr_t start, nb_addr_t end, uint8_t *p_target, bool *p_written, expr_t *p_expr) {
+    uint8_t *p_code = pCi->p_code;
+    value_t a_stack[cfg_STACK_SIZE];
+    value_t val1, val2, res;
+    nb_addr_t pos;
+    uint16_t len;
+    uint16_t block = 0;
+    uint8_t num = 0;
+    uint8_t sp = 0;
+    bool safe;
 
-    // Convert to lower case
-    for(uint16_t i = 0; i < k_MAX_SYM_LEN; i++) {
-        sym[i] = tolower(id[i]);
-        if(sym[i] == '\0') {
-            break;
+    for(pos = start; pos < end; pos += len) {
+        len = instr_len(&p_code[pos]);
+        if(p_target[pos - start] || sp >= cfg_STACK_SIZE) {
+            finish_values(a_stack, sp, p_expr);
+            sp = 0;
+            block += p_target[pos - start];
         }
-    }
-    sym[k_MAX_SYM_LEN - 1] = '\0';
-
-    // Search for existing symbol
-    for(uint16_t i = 0; i < cfg_MAX_NUM_SYM; i++) {
-        if(strcmp(a_Symbol[i].name, sym) == 0) {
-            if(a_Symbol[i].value == 0 && a_Symbol[i].type == LABEL && val > 0) {
-                a_Symbol[i].value = val;
+        switch(p_code[pos]) {
+        case k_PUSH_NUM_N2:
+        case k_PUSH_NUM_N5:
+            a_stack[sp++] = (value_t){pos, pos + len, true, true, true, NO_EXPR};
+            continue;
+        case k_PUSH_VAR_N2:
+            safe = p_written != NULL && !p_written[p_code[pos + 1]];
+            a_stack[sp++] = (value_t){pos, pos + len, true, safe, true, NO_EXPR};
+            continue;
+        case k_NOT_N1:
+        case k_NEG_N1:
+        case k_SHL_N2:
+        case k_DIV_POW2_N2:
+        case k_MOD_POW2_N2:
+        case k_DIV_MAGIC_N6:
+        case k_MOD_MAGIC_N8:
+        case k_GET_ARR_ELEM_N2:
+        case k_GET_CONST_ELEM_N3:
+            val1 = sp > 0 ? a_stack[--sp] : (value_t){0};
+            val2 = (value_t){0};
+            // An array access could fail and is therefore not moved in front of the loop
+            safe = p_code[pos] != k_GET_ARR_ELEM_N2 && p_code[pos] != k_GET_CONST_ELEM_N3;
+            res = (value_t){val1.start, pos + len, val1.pure, val1.invariant && safe, false, NO_EXPR};
+            break;
+        case k_ADD_N1:
+        case k_SUB_N1:
+        case k_MUL_N1:
+        case k_DIV_N1:
+        case k_MOD_N1:
+        case k_AND_N1:
+        case k_OR_N1:
+        case k_EQUAL_N1:
+        case k_NOT_EQUAL_N1:
+        case k_LESS_N1:
+        case k_LESS_EQU_N1:
+        case k_GREATER_N1:
+        case k_GREATER_EQU_N1:
+            val2 = sp > 0 ? a_stack[--sp] : (value_t){0};
+            val1 = sp > 0 ? a_stack[--sp] : (value_t){0};
+            safe = true;
+            if(p_code[pos] == k_DIV_N1 || p_code[pos] == k_MOD_N1) {
+                // Division is only optimized with a constant, non-zero divisor
+                safe = (val2.simple && p_code[val2.start] == k_PUSH_NUM_N2 && p_code[val2.start + 1] != 0) ||
+                       (val2.simple && p_code[val2.start] == k_PUSH_NUM_N5 && ACS32(p_code[val2.start + 1]) != 0);
             }
-            return i;
-        }
-        if(a_Symbol[i].name[0] == '\0') {
-            start = i;
+            res = (value_t){val1.start, pos + len, val1.pure && val2.pure && safe,
+                            val1.invariant && val2.invariant && safe, false, NO_EXPR};
             break;
+        default:
+            finish_values(a_stack, sp, p_expr);
+            sp = 0;
+            // The called code may change any variable
+            if(p_code[pos] == k_GOSUB_N3 || p_code[pos] == k_ON_GOSUB_N2 || p_code[pos] == k_XFUNC_N2) {
+                block++;
+            }
+            continue;
         }
+        if(!res.invariant) {
+            finish_values(&val1, 1, p_expr);
+            finish_values(&val2, 1, p_expr);
+        }
+        if(res.pure && num < MAX_EXPRESSIONS) {
+            p_expr[num] = (expr_t){res.start, res.end - res.start, block, res.invariant, false};
+            res.idx = num++;
+        }
+        a_stack[sp++] = res;
     }
+    finish_values(a_stack, sp, p_expr);
+    return num;
+}
 
-    // Add new symbol
-    for(uint16_t i = start; i < cfg_MAX_NUM_SYM; i++) {
-        if(a_Symbol[i].name[0] == '\0') {
-            strcpy(a_Symbol[i].name, sym);
-            a_Symbol[i].value = val;
-            a_Symbol[i].type = type;
-            if(type != LABEL) {
-                CurrVarIdx++;
-            }
-            return i;
+// Mark invariant values, which are not part of a larger invariant expression
+static void finish_values(value_t *p_val, uint8_t num, expr_t *p_expr) {
+    for(uint8_t i = 0; i < num; i++) {
+        if(p_val[i].invariant && !p_val[i].simple && p_val[i].idx != NO_EXPR) {
+            p_expr[p_val[i].idx].maximal = true;
         }
     }
-    error("symbol table full", NULL);
-    return 0;
 }
 
-static uint16_t sym_get(char *id) {
-    char sym[k_MAX_SYM_LEN];
+static bool same_expr(comp_inst_t *pCi, expr_t *p_expr1, expr_t *p_expr2) {
+    return p_expr1->len == p_expr2->len &&
+           memcmp(&pCi->p_code[p_expr1->pos], &pCi->p_code[p_expr2->pos], p_expr1->len) == 0;
+}
 
-    // Convert to lower case
-    for(uint16_t i = 0; i < k_MAX_SYM_LEN; i++) {
-        sym[i] = tolower(id[i]);
-        if(sym[i] == '\0') {
-            break;
-        }
-    }
-    sym[k_MAX_SYM_LEN - 1] = '\0';
+// Check if a variable or array read by the expression is written within 'from'..to
+static bool is_modified(comp_inst_t *pCi, expr_t *p_expr, nb_addr_t from, nb_addr_t to) {
+    uint8_t *p_code = pCi->p_code;
+    bool a_read[cfg_NUM_VARS] = {0};
+    nb_addr_t pos;
 
-    // Search for existing symbol
-    for(uint16_t i = 0; i < cfg_MAX_NUM_SYM; i++) {
-        if(strcmp(a_Symbol[i].name, sym) == 0) {
-            return a_Symbol[i].value;
+    for(pos = p_expr->pos; pos < p_expr->pos + p_expr->len; pos += instr_len(&p_code[pos])) {
+        if(p_code[pos] == k_PUSH_VAR_N2 || p_code[pos] == k_GET_ARR_ELEM_N2) {
+            a_read[p_code[pos + 1]] = true;
         }
-        if(a_Symbol[i].name[0] == '\0') {
+    }
+    for(pos = from; pos < to; pos += instr_len(&p_code[pos])) {
+        switch(p_code[pos]) {
+        case k_POP_VAR_N2:
+        case k_POP_STR_N2:
+        case k_SET_STR_LIT_N4:
+        case k_STORE_VAR_N2:
+        case k_DIM_ARR_N2:
+        case k_ERASE_ARR_N2:
+        case k_SET_ARR_ELEM_N2:
+        case k_SET_ARR_1BYTE_N2:
+        case k_SET_ARR_2BYTE_N2:
+        case k_SET_ARR_4BYTE_N2:
+            if(a_read[p_code[pos + 1]]) {
+                return true;
+            }
+            break;
+        case k_NEXT_N4:
+            if(a_read[p_code[pos + k_NEXT_LEN - 1]]) {
+                return true;
+            }
+            break;
+        case k_COPY_N1:
+            return true; // could change any array
+        default:
             break;
         }
     }
-    error("unknown symbol", id);
-    return 0;
-}
-
-static void trace_print(void) {
-#ifdef cfg_TRACE_SUPPORT
-    pCi->p_trace[pCi->pc] = pCi->linenum;
-#endif
+    return false;
 }
 
-static void remove_trace(void) {
-#ifdef cfg_TRACE_SUPPORT
-    pCi->p_trace[pCi->pc] = 0;
-#endif
+// Check if the code range overlaps a replaced expression
+static bool is_replaced(comp_inst_t *pCi, nb_addr_t pos, uint16_t len) {
+    for(uint8_t i = 0; i < pCi->num_edits; i++) {
+        edit_t *p_edit = &pCi->a_edit[i];
+        if(p_edit->len > 0 && pos < p_edit->pos + p_edit->len && p_edit->pos < pos + len) {
+            return true;
+        }
+    }
+    return false;
 }
 
-static void error(char *err, char *id) {
-    nb_print("Error in line %u: ", pCi->linenum);
-    if(id != NULL && id[0] != '\0') {
-        nb_print("%s '%s'\n", err, id);
-    } else {
-        nb_print("%s\n", err);
+static void add_code_edit(comp_inst_t *pCi, nb_addr_t pos, uint16_t len, nb_addr_t src, uint16_t num, uint8_t instr, uint8_t var) {
+    if(pCi->num_edits < MAX_CODE_EDITS) {
+        pCi->a_edit[pCi->num_edits++] = (edit_t){pos, len, src, num, instr, var};
     }
-    pCi->err_count++;
-    pCi->p_pos = pCi->p_next;
-    if(pCi->p_pos != NULL) {
-        pCi->p_pos[0] = '\0';
-    }
-    longjmp(pCi->jmp_buf, 0);
 }
 
-static uint8_t get_num_vars(void) {
-    uint8_t idx = 0;
+/*
+** Apply the code edits to the code block 'start'..pc and relocate jump addresses,
+** labels, forward declarations, and trace info.
+*/
+static bool apply_code_edits(comp_inst_t *pCi, nb_addr_t start) {
+    uint8_t *p_code = pCi->p_code;
+    edit_t *p_edit = pCi->a_edit;
+    uint8_t num = pCi->num_edits;
+    nb_addr_t end = pCi->pc;
+    nb_addr_t new_size = end - start;
+    nb_addr_t pos, offs;
+    uint16_t len;
+    uint8_t idx;
 
-    for(uint16_t i = StartOfVars; i < cfg_MAX_NUM_SYM; i++) {
-        if(a_Symbol[i].name[0] != '\0' && a_Symbol[i].type != LABEL)
-        {
-            idx++;
+    pCi->gosub_end = 0; // the code is moved
+    // Sort by code position, insertions in front of replacements
+    for(uint8_t i = 1; i < num; i++) {
+        edit_t tmp = p_edit[i];
+        uint8_t j = i;
+        while(j > 0 && (p_edit[j - 1].pos > tmp.pos ||
+                        (p_edit[j - 1].pos == tmp.pos && p_edit[j - 1].len > 0 && tmp.len == 0))) {
+            p_edit[j] = p_edit[j - 1];
+            j--;
         }
+        p_edit[j] = tmp;
     }
-    return idx;
-}
-
-static void add_default_params(uint8_t num) {
     for(uint8_t i = 0; i < num; i++) {
-        pCi->p_code[pCi->pc++] = k_PUSH_NUM_N2;
-        pCi->p_code[pCi->pc++] = 0;
-        pCi->p_code[pCi->pc++] = k_PUSH_PARAM_N1;
+        new_size += EDIT_SIZE(&p_edit[i]) - p_edit[i].len;
+    }
+    if(start + new_size >= cfg_MAX_CODE_SIZE - MAX_CODE_PER_LINE) {
+        pCi->num_edits = 0;
+        return false;
+    }
+    uint8_t *p_buff = malloc(new_size);
+    uint16_t *p_trace = calloc(new_size + 1, sizeof(uint16_t));
+    if(p_buff == NULL || p_trace == NULL) {
+        free(p_buff);
+        free(p_trace);
+        pCi->num_edits = 0;
+        return false;
     }
-}
 
-// idx = index of symbol (SmyIdx)
-// pos = position in code array
-static void forward_declaration(uint16_t idx, uint16_t pos) {
-    if(pCi->num_fw_decls < cfg_MAX_FW_DECL) {
-        pCi->a_forward_decl[pCi->num_fw_decls].idx = idx;
-        pCi->a_forward_decl[pCi->num_fw_decls].pos = pos;
-        pCi->num_fw_decls++;
-    } else {
-        error("too many forward declarations", NULL);
+    offs = 0;
+    idx = 0;
+    for(pos = start; pos < end || (idx < num && p_edit[idx].pos == pos); ) {
+        if(idx < num && p_edit[idx].pos == pos) {
+            memcpy(&p_buff[offs], &p_code[p_edit[idx].src], p_edit[idx].num);
+            offs += p_edit[idx].num;
+            if(p_edit[idx].instr != k_END) {
+                p_buff[offs++] = p_edit[idx].instr;
+                p_buff[offs++] = p_edit[idx].var;
+            }
+            pos += p_edit[idx].len;
+            idx++;
+        } else {
+            len = instr_len(&p_code[pos]);
+            memcpy(&p_buff[offs], &p_code[pos], len);
+            offs += len;
+            pos += len;
+        }
     }
-}
 
-static void resolve_forward_declarations(void) {
-    uint16_t idx, pos, addr;
-    for(uint8_t i = 0; i < pCi->num_fw_decls; i++) {
-        idx = pCi->a_forward_decl[i].idx;
-        pos = pCi->a_forward_decl[i].pos;
-        if(a_Symbol[idx].type == LABEL) {
-            addr = a_Symbol[idx].value;
-            if(addr > 0) {
-                pCi->p_code[pos + 0] = addr & 0xFF;
-                pCi->p_code[pos + 1] = (addr >> 8) & 0xFF;
-            } else {
+    pCi->edit_start = start;
+    pCi->edit_end = end;
+    for(pos = 0; pos < new_size; pos += instr_len(&p_buff[pos])) {
+        switch(p_buff[pos]) {
+        case k_GOTO_N3:
+        case k_GOSUB_N3:
+        case k_IF_N3:
+        case k_IF_TRUE_N3:
+        case k_NEXT_N4:
+            ACS_ADDR(p_buff[pos + 1]) = map_code_addr(pCi, ACS_ADDR(p_buff[pos + 1]));
+            break;
+        default:
+            break;
+        }
+    }
 #ifdef cfg_LINE_NUMBERS
-                error("Line number not found", a_Symbol[idx].name);
+    for(uint16_t i = line_after(pCi, start); i < pCi->num_line_map; i++) {
+        pCi->p_line_map[i].pc = map_code_addr(pCi, pCi->p_line_map[i].pc);
+    }
 #else
-                error("Label not found", a_Symbol[idx].name);
+    for(uint16_t i = Setup.start_of_vars; i < pCi->num_sym; i++) {
+        if(pCi->p_symbol[i].type == LABEL && pCi->p_symbol[i].value > start) {
+            pCi->p_symbol[i].value = map_code_addr(pCi, pCi->p_symbol[i].value);
+        }
+    }
 #endif
-            }
-        } else {
+    for(uint8_t i = 0; i < pCi->num_fw_decls; i++) {
+        pCi->a_forward_decl[i].pos = map_code_addr(pCi, pCi->a_forward_decl[i].pos);
+    }
+#ifdef cfg_TRACE_SUPPORT
+    // Including the trace info of the next line, starting at the block end
+    for(pos = start; pos <= end; pos++) {
+        if(pCi->p_trace[pos] != 0) {
+            p_trace[map_code_addr(pCi, pos) - start] = pCi->p_trace[pos];
+        }
+        pCi->p_trace[pos] = 0;
+    }
+    memcpy(&pCi->p_trace[start], p_trace, (new_size + 1) * sizeof(uint16_t));
+#endif
+    memcpy(&p_code[start], p_buff, new_size);
+    pCi->pc = start + new_size;
+    free(p_buff);
+    free(p_trace);
+    return true;
+}
 
-            error("forward declaration not resolved", a_Symbol[idx].name);
+// Translate a code address of the last optimized code block
+static nb_addr_t map_code_addr(comp_inst_t *pCi, nb_addr_t addr) {
+    if(pCi->num_edits == 0 || addr < pCi->edit_start || addr > pCi->edit_end) {
+        return addr;
+    }
+    nb_addr_t new_addr = addr;
+    for(uint8_t i = 0; i < pCi->num_edits; i++) {
+        edit_t *p_edit = &pCi->a_edit[i];
+        // Code inserted at 'addr' is executed before, a replaced expression has to end before
+        if(p_edit->len == 0 ? p_edit->pos <= addr : p_edit->pos + p_edit->len <= addr) {
+            new_addr += EDIT_SIZE(p_edit) - p_edit->len;
         }
     }
-    pCi->num_fw_decls = 0;
+    return new_addr;
 }
 
-static void append_data_to_code(t_VM *vm) {
-    pCi->p_code[pCi->pc++] = 0xFF;  // End tag before the data section starts
-    vm->data_start_addr = pCi->pc;
-    vm->data_read_offs = 0;
-    
-    if((pCi->pc + pCi->data_idx * 4) >= cfg_MAX_CODE_SIZE) {
-        error("code size exceeded", NULL);
+// Get a hidden temporary variable, which is not used within the code block
+static bool get_temp_var(comp_inst_t *pCi, bool *p_used, uint8_t *p_var) {
+    char name[k_MAX_SYM_LEN];
+
+    for(uint8_t i = 0; i < pCi->num_temps; i++) {
+        if(!p_used[pCi->a_temp[i]]) {
+            p_used[pCi->a_temp[i]] = true;
+            *p_var = pCi->a_temp[i];
+            return true;
+        }
     }
-    for(int i = 0; i < pCi->data_idx; i++) {
-        ACS32(pCi->p_code[pCi->pc]) = pCi->a_data[i];
-        pCi->pc += 4;
+    if(pCi->num_temps >= MAX_TEMP_VARS || pCi->curr_var_idx >= cfg_NUM_VARS - 1) {
+        return false;
     }
+    // '#' is no valid character for BASIC variable names
+    snprintf(name, sizeof(name), "#%u", pCi->num_temps);
+    uint16_t idx = sym_add(pCi, name, pCi->curr_var_idx, ID);
+    pCi->a_temp[pCi->num_temps++] = pCi->p_symbol[idx].value;
+    p_used[pCi->p_symbol[idx].value] = true;
+    *p_var = pCi->p_symbol[idx].value;
+    return true;
 }
 
 /**************************************************************************************************
  * Expression compiler
  *************************************************************************************************/
-static type_t compile_expression(type_t type) {
-    type_t type1 = compile_and_expr();
-    uint8_t op = lookahead();
+static type_t compile_expression(comp_inst_t *pCi, type_t type) {
+    nb_addr_t pos1 = pCi->pc;
+    type_t type1 = compile_and_expr(pCi);
+    uint8_t op = lookahead(pCi);
     while(op == OR) {
-        match(op);
-        type_t type2 = compile_and_expr();
+        match(pCi, op);
+        nb_addr_t pos2 = pCi->pc;
+        type_t type2 = compile_and_expr(pCi);
         if(type1 != e_NUM || type2 != e_NUM) {
-            error("type mismatch", NULL);
+            error(pCi, "type mismatch", NULL);
+        }
+        if(!fold_constants(pCi, pos1, pos2, k_OR_N1)) {
+            pCi->p_code[pCi->pc++] = k_OR_N1;
         }
-        pCi->p_code[pCi->pc++] = k_OR_N1;
-        op = lookahead();
+        op = lookahead(pCi);
     }
     if(type != e_ANY && type1 != type) {
-        error("type mismatch", pCi->a_buff);
+        error(pCi, "type mismatch", pCi->p_buff);
     }
     return type1;
 }
 
-static type_t compile_and_expr(void) {
-    type_t type1 = compile_not_expr();
-    uint8_t op = lookahead();
+static type_t compile_and_expr(comp_inst_t *pCi) {
+    nb_addr_t pos1 = pCi->pc;
+    type_t type1 = compile_not_expr(pCi);
+    uint8_t op = lookahead(pCi);
     while(op == AND) {
-        match(op);
-        type_t type2 = compile_not_expr();
+        match(pCi, op);
+        nb_addr_t pos2 = pCi->pc;
+        type_t type2 = compile_not_expr(pCi);
         if(type1 != e_NUM || type2 != e_NUM) {
-            error("type mismatch", pCi->a_buff);
+            error(pCi, "type mismatch", pCi->p_buff);
         }
-        pCi->p_code[pCi->pc++] = k_AND_N1;
-        op = lookahead();
+        if(!fold_constants(pCi, pos1, pos2, k_AND_N1)) {
+            pCi->p_code[pCi->pc++] = k_AND_N1;
+        }
+        op = lookahead(pCi);
     }
     return type1;
 }
 
-static type_t compile_not_expr(void) {
+static type_t compile_not_expr(comp_inst_t *pCi) {
+    nb_addr_t pos = pCi->pc;
     type_t type;
-    uint8_t op = lookahead();
+    uint8_t op = lookahead(pCi);
     if(op == NOT) {
-        match(op);
-        type = compile_comp_expr();
+        match(pCi, op);
+        type = compile_comp_expr(pCi);
         if(type != e_NUM) {
-            error("type mismatch", pCi->a_buff);
+            error(pCi, "type mismatch", pCi->p_buff);
+        }
+        if(!fold_constants(pCi, pos, pos, k_NOT_N1)) {
+            pCi->p_code[pCi->pc++] = k_NOT_N1;
         }
-          pCi->p_code[pCi->pc++] = k_NOT_N1;
     } else {
-        type = compile_comp_expr();
+        type = compile_comp_expr(pCi);
     }
     return type;
 }
 
-static type_t compile_comp_expr(void) {
-    type_t type1 = compile_add_expr();
-    uint8_t op = lookahead();
+static type_t compile_comp_expr(comp_inst_t *pCi) {
+    nb_addr_t pos1 = pCi->pc;
+    type_t type1 = compile_add_expr(pCi);
+    uint8_t op = lookahead(pCi);
     while(op == EQ || op == NQ || op == LE || op == LQ || op == GR || op == GQ) {
-        match(op);
-        type_t type2 = compile_add_expr();
+        match(pCi, op);
+        nb_addr_t pos2 = pCi->pc;
+        type_t type2 = compile_add_expr(pCi);
         if(type1 != type2) {
-            error("type mismatch", pCi->a_buff);
+            error(pCi, "type mismatch", pCi->p_buff);
         }
 #ifdef cfg_STRING_SUPPORT        
         if(type1 == e_STR) {
-            switch(op) {
-            case EQ: pCi->p_code[pCi->pc++] = k_STR_EQUAL_N1; break;
-            case NQ: pCi->p_code[pCi->pc++] = k_STR_NOT_EQU_N1; break;
-            case LE: pCi->p_code[pCi->pc++] = k_STR_LESS_N1; break;
-            case LQ: pCi->p_code[pCi->pc++] = k_STR_LESS_EQU_N1; break;
-            case GR: pCi->p_code[pCi->pc++] = k_STR_GREATER_N1; break;
-            case GQ: pCi->p_code[pCi->pc++] = k_STR_GREATER_EQU_N1; break;
-            default: error("unknown operator", pCi->a_buff); break;
+            uint16_t offs;
+            if((op == EQ || op == NQ) && literal_operand(pCi, pos1, pos2, &offs)) {
+                pCi->p_code[pCi->pc++] = op == EQ ? k_STR_EQUAL_LIT_N3 : k_STR_NOT_EQU_LIT_N3;
+                ACS16(pCi->p_code[pCi->pc]) = offs;
+                pCi->pc += 2;
+            } else {
+                switch(op) {
+                case EQ: pCi->p_code[pCi->pc++] = k_STR_EQUAL_N1; break;
+                case NQ: pCi->p_code[pCi->pc++] = k_STR_NOT_EQU_N1; break;
+                case LE: pCi->p_code[pCi->pc++] = k_STR_LESS_N1; break;
+                case LQ: pCi->p_code[pCi->pc++] = k_STR_LESS_EQU_N1; break;
+                case GR: pCi->p_code[pCi->pc++] = k_STR_GREATER_N1; break;
+                case GQ: pCi->p_code[pCi->pc++] = k_STR_GREATER_EQU_N1; break;
+                default: error(pCi, "unknown operator", pCi->p_buff); break;
+                }
             }
         } else {
 #else
         { 
 #endif
+            uint8_t instr = 0;
             switch(op) {
-            case EQ: pCi->p_code[pCi->pc++] = k_EQUAL_N1; break;
-            case NQ: pCi->p_code[pCi->pc++] = k_NOT_EQUAL_N1; break;
-            case LE: pCi->p_code[pCi->pc++] = k_LESS_N1; break;
-            case LQ: pCi->p_code[pCi->pc++] = k_LESS_EQU_N1; break;
-            case GR: pCi->p_code[pCi->pc++] = k_GREATER_N1; break;
-            case GQ: pCi->p_code[pCi->pc++] = k_GREATER_EQU_N1; break;
-            default: error("unknown operator", pCi->a_buff); break;
+            case EQ: instr = k_EQUAL_N1; break;
+            case NQ: instr = k_NOT_EQUAL_N1; break;
+            case LE: instr = k_LESS_N1; break;
+            case LQ: instr = k_LESS_EQU_N1; break;
+            case GR: instr = k_GREATER_N1; break;
+            case GQ: instr = k_GREATER_EQU_N1; break;
+            default: error(pCi, "unknown operator", pCi->p_buff); break;
+            }
+            if(!fold_constants(pCi, pos1, pos2, instr)) {
+                pCi->p_code[pCi->pc++] = instr;
             }
         }
-        op = lookahead();
+        type1 = e_NUM; // (also for compared strings)
+        op = lookahead(pCi);
     }
     return type1;
 }
 
-static type_t compile_add_expr(void) {
-    type_t type1 = compile_term();
-    uint8_t op = lookahead();
+static type_t compile_add_expr(comp_inst_t *pCi) {
+    nb_addr_t pos1 = pCi->pc;
+    type_t type1 = compile_term(pCi);
+    uint8_t op = lookahead(pCi);
     while(op == '+' || op == '-') {
-        match(op);
-        type_t type2 = compile_term();
+        match(pCi, op);
+        nb_addr_t pos2 = pCi->pc;
+        type_t type2 = compile_term(pCi);
         if(type1 != type2) {
-            error("type mismatch", pCi->a_buff);
+            error(pCi, "type mismatch", pCi->p_buff);
         }
         if(op == '+') {
             if(type1 == e_NUM) {
-              pCi->p_code[pCi->pc++] = k_ADD_N1;
+                if(!fold_constants(pCi, pos1, pos2, k_ADD_N1)) {
+                    pCi->p_code[pCi->pc++] = k_ADD_N1;
+                }
             } else {
 #ifdef cfg_STRING_SUPPORT                
                 pCi->p_code[pCi->pc++] = k_ADD_STR_N1;
 #else
-                error("type mismatch", pCi->a_buff);
+                error(pCi, "type mismatch", pCi->p_buff);
 #endif
             }
         } else {
             if(type1 == e_NUM) {
-              pCi->p_code[pCi->pc++] = k_SUB_N1;
+                if(!fold_constants(pCi, pos1, pos2, k_SUB_N1)) {
+                    pCi->p_code[pCi->pc++] = k_SUB_N1;
+                }
             } else {
-              error("type mismatch", pCi->a_buff);
+              error(pCi, "type mismatch", pCi->p_buff);
             }
         }
-        op = lookahead();
+        op = lookahead(pCi);
     }
     return type1;
 }
 
-static type_t compile_term(void) {
-    type_t type1 = compile_neg_factor();
-    uint8_t op = lookahead();
+static type_t compile_term(comp_inst_t *pCi) {
+    nb_addr_t pos1 = pCi->pc;
+    type_t type1 = compile_neg_factor(pCi);
+    uint8_t op = lookahead(pCi);
     while(op == '*' || op == '/' || op == MOD) {
-        match(op);
-        type_t type2 = compile_neg_factor();
+        match(pCi, op);
+        nb_addr_t pos2 = pCi->pc;
+        uint32_t value;
+        type_t type2 = compile_neg_factor(pCi);
         if(type1 != e_NUM || type2 != e_NUM) {
-            error("type mismatch", pCi->a_buff);
+            error(pCi, "type mismatch", pCi->p_buff);
         }
-        if(op == '*') {
-          pCi->p_code[pCi->pc++] = k_MUL_N1;
-        } else if(op == MOD) {
-          pCi->p_code[pCi->pc++] = k_MOD_N1;
+        uint8_t instr = (op == '*') ? k_MUL_N1 : (op == MOD) ? k_MOD_N1 : k_DIV_N1;
+        if(fold_constants(pCi, pos1, pos2, instr)) {
+            // Calculated at compile time
+        } else if(get_const_value(pCi, pos2, pCi->pc, &value) && reduce_strength(pCi, op, pos2, value)) {
+            // Replaced by a cheaper instruction
         } else {
-          pCi->p_code[pCi->pc++] = k_DIV_N1;
+            pCi->p_code[pCi->pc++] = instr;
         }
-        op = lookahead();
+        op = lookahead(pCi);
     }
     return type1;
 }
 
-static type_t compile_neg_factor(void) {
+// Check if the code at 'pos'..end is a single constant push
+static bool get_const_value(comp_inst_t *pCi, nb_addr_t pos, nb_addr_t end, uint32_t *p_value) {
+    if(end == pos + 2 && pCi->p_code[pos] == k_PUSH_NUM_N2) {
+        *p_value = pCi->p_code[pos + 1];
+        return true;
+    }
+    if(end == pos + 5 && pCi->p_code[pos] == k_PUSH_NUM_N5) {
+        *p_value = ACS32(pCi->p_code[pos + 1]);
+        return true;
+    }
+    return false;
+}
+
+// Check if the code 'pos'..end only pushes a string literal
+static bool get_string_literal(comp_inst_t *pCi, nb_addr_t pos, nb_addr_t end, uint16_t *p_offs) {
+    if(end == pos + 3 && pCi->p_code[pos] == k_PUSH_STR_N3) {
+        *p_offs = ACS16(pCi->p_code[pos + 1]);
+        return true;
+    }
+    return false;
+}
+
+#ifdef cfg_STRING_SUPPORT
+/*
+** Remove a string literal operand of the comparison 'pos1'..pos2 = 'pos2'..pc and
+** return its pool offset. The literal is part of the compare instruction then.
+*/
+static bool literal_operand(comp_inst_t *pCi, nb_addr_t pos1, nb_addr_t pos2, uint16_t *p_offs) {
+    if(get_string_literal(pCi, pos2, pCi->pc, p_offs)) {
+        pCi->pc = pos2;
+        return true;
+    }
+    if(get_string_literal(pCi, pos1, pos2, p_offs)) {
+        memmove(&pCi->p_code[pos1], &pCi->p_code[pos2], pCi->pc - pos2);
+        pCi->pc -= pos2 - pos1;
+        return true;
+    }
+    return false;
+}
+#endif
+
+/*
+** Evaluate the operation at compile time, if the operands 'pos1'..pos2 and 'pos2'..pc
+** (unary operation: 'pos1'..pc) are constants. Division by zero is left to the runtime.
+*/
+static bool fold_constants(comp_inst_t *pCi, nb_addr_t pos1, nb_addr_t pos2, uint8_t instr) {
+    uint32_t val1, val2 = 0;
+    int32_t res;
+
+    if(instr == k_NOT_N1 || instr == k_NEG_N1) {
+        if(!get_const_value(pCi, pos1, pCi->pc, &val1)) {
+            return false;
+        }
+    } else if(!get_const_value(pCi, pos1, pos2, &val1) || !get_const_value(pCi, pos2, pCi->pc, &val2)) {
+        return false;
+    }
+    switch(instr) {
+    case k_NOT_N1: res = !val1; break;
+    case k_NEG_N1: res = 0 - val1; break;
+    case k_ADD_N1: res = val1 + val2; break;
+    case k_SUB_N1: res = val1 - val2; break;
+    case k_MUL_N1: res = val1 * val2; break;
+    case k_DIV_N1:
+    case k_MOD_N1:
+        if(val2 == 0 || ((int32_t)val2 == -1 && val1 == 0x80000000)) {
+            return false;
+        }
+        res = (instr == k_DIV_N1) ? (int32_t)val1 / (int32_t)val2 : (int32_t)val1 % (int32_t)val2;
+        break;
+    case k_AND_N1: res = val1 && val2; break;
+    case k_OR_N1: res = val1 || val2; break;
+    case k_EQUAL_N1: res = (int32_t)val1 == (int32_t)val2; break;
+    case k_NOT_EQUAL_N1: res = (int32_t)val1 != (int32_t)val2; break;
+    case k_LESS_N1: res = (int32_t)val1 < (int32_t)val2; break;
+    case k_LESS_EQU_N1: res = (int32_t)val1 <= (int32_t)val2; break;
+    case k_GREATER_N1: res = (int32_t)val1 > (int32_t)val2; break;
+    case k_GREATER_EQU_N1: res = (int32_t)val1 >= (int32_t)val2; break;
+    default: return false;
+    }
+    pCi->pc = pos1;
+    emit_const(pCi, res);
+    return true;
+}
+
+static void emit_const(comp_inst_t *pCi, uint32_t value) {
+    if(value < 256)
+    {
+      pCi->p_code[pCi->pc++] = k_PUSH_NUM_N2;
+      pCi->p_code[pCi->pc++] = value;
+    }
+    else
+    {
+      pCi->p_code[pCi->pc++] = k_PUSH_NUM_N5;
+      pCi->p_code[pCi->pc++] = value & 0xFF;
+      pCi->p_code[pCi->pc++] = (value >> 8) & 0xFF;
+      pCi->p_code[pCi->pc++] = (value >> 16) & 0xFF;
+      pCi->p_code[pCi->pc++] = (value >> 24) & 0xFF;
+    }
+}
+
+/*
+** Replace the constant push at 'pos' and the multiplication/division by a
+** shift, mask, or multiply-high instruction. Only positive divisors are
+** handled, the division by zero check is not needed.
+*/
+static bool reduce_strength(comp_inst_t *pCi, uint8_t op, nb_addr_t pos, uint32_t value) {
+    uint8_t *p_code = pCi->p_code;
+    uint8_t shift = 0;
+    int32_t mul;
+
+    if(value == 0 || value > 0x7FFFFFFF) {
+        return false;
+    }
+    if((value & (value - 1)) == 0) {
+        while((1u << shift) != value) {
+            shift++;
+        }
+        pCi->pc = pos;
+        if(op == MOD) {
+            p_code[pCi->pc++] = k_MOD_POW2_N2;
+            p_code[pCi->pc++] = shift;
+        } else if(shift > 0) {
+            p_code[pCi->pc++] = op == '*' ? k_SHL_N2 : k_DIV_POW2_N2;
+            p_code[pCi->pc++] = shift;
+        }
+        return true;
+    }
+    if(op == '*' || (op == MOD && value > 0xFFFF)) {
+        return false;
+    }
+    magic_number(value, &mul, &shift);
+    pCi->pc = pos;
+    p_code[pCi->pc++] = op == MOD ? k_MOD_MAGIC_N8 : k_DIV_MAGIC_N6;
+    ACS32(p_code[pCi->pc]) = mul;
+    pCi->pc += 4;
+    p_code[pCi->pc++] = shift;
+    if(op == MOD) {
+        ACS16(p_code[pCi->pc]) = value;
+        pCi->pc += 2;
+    }
+    return true;
+}
+
+// Multiplier and shift for the signed division by a constant (Hacker's Delight, chapter 10)
+static void magic_number(uint32_t div, int32_t *p_mul, uint8_t *p_shift) {
+    const uint32_t two31 = 0x80000000;
+    uint32_t anc = two31 - 1 - two31 % div;
+    uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+    uint32_t q2 = two31 / div, r2 = two31 - q2 * div;
+    uint32_t delta;
+    uint8_t p = 31;
+
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if(r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if(r2 >= div) {
+            q2++;
+            r2 -= div;
+        }
+        delta = div - r2;
+    } while(q1 < delta || (q1 == delta && r1 == 0));
+    *p_mul = q2 + 1;
+    *p_shift = p - 32;
+}
+
+static type_t compile_neg_factor(comp_inst_t *pCi) {
+    nb_addr_t pos = pCi->pc;
     type_t type = 0;
-    uint8_t tok = lookahead();
+    uint8_t tok = lookahead(pCi);
     if(tok == '-') {
-        match('-');
-        type = compile_factor();
-        pCi->p_code[pCi->pc++] = k_NEG_N1;
+        match(pCi, '-');
+        type = compile_factor(pCi);
+        if(!fold_constants(pCi, pos, pos, k_NEG_N1)) {
+            pCi->p_code[pCi->pc++] = k_NEG_N1;
+        }
     } else {
-        type = compile_factor();
+        type = compile_factor(pCi);
     }
     return type;
 }
 
-static type_t compile_factor(void) {
+static type_t compile_factor(comp_inst_t *pCi) {
     type_t type = 0;
     uint8_t val;
-    uint8_t tok = lookahead();
+    uint16_t offs;
+    uint32_t value;
+    nb_addr_t pos;
+    uint8_t tok = lookahead(pCi);
     switch(tok) {
     case '(':
-        match('(');
-        type = compile_expression(e_NUM);
-        match(')');
+        match(pCi, '(');
+        type = compile_expression(pCi, e_NUM);
+        match(pCi, ')');
         break;
     case e_CNST:
-        pCi->value = a_Symbol[pCi->sym_idx].value;
-        match(e_CNST);
-        if(pCi->value < 256)
-        {
-          pCi->p_code[pCi->pc++] = k_PUSH_NUM_N2;
-          pCi->p_code[pCi->pc++] = pCi->value;
-        }
-        else
-        {
-          pCi->p_code[pCi->pc++] = k_PUSH_NUM_N5;
-          pCi->p_code[pCi->pc++] = pCi->value & 0xFF;
-          pCi->p_code[pCi->pc++] = (pCi->value >> 8) & 0xFF;
-          pCi->p_code[pCi->pc++] = (pCi->value >> 16) & 0xFF;
-          pCi->p_code[pCi->pc++] = (pCi->value >> 24) & 0xFF;
-        }
+        pCi->value = pCi->p_symbol[pCi->sym_idx].value;
+        match(pCi, e_CNST);
+        emit_const(pCi, pCi->value);
         type = e_NUM;
         break;
     case NUM: // number, like 1234
-        match(NUM);
-        if(pCi->value < 256)
-        {
-          pCi->p_code[pCi->pc++] = k_PUSH_NUM_N2;
-          pCi->p_code[pCi->pc++] = pCi->value;
-        }
-        else
-        {
-          pCi->p_code[pCi->pc++] = k_PUSH_NUM_N5;
-          pCi->p_code[pCi->pc++] = pCi->value & 0xFF;
-          pCi->p_code[pCi->pc++] = (pCi->value >> 8) & 0xFF;
-          pCi->p_code[pCi->pc++] = (pCi->value >> 16) & 0xFF;
-          pCi->p_code[pCi->pc++] = (pCi->value >> 24) & 0xFF;
-        }
+        match(pCi, NUM);
+        emit_const(pCi, pCi->value);
         type = e_NUM;
         break;
     case ID: // variable, like var1
-        match(ID);
+        match(pCi, ID);
         pCi->p_code[pCi->pc++] = k_PUSH_VAR_N2;
-        pCi->p_code[pCi->pc++] = a_Symbol[pCi->sym_idx].value;
+        pCi->p_code[pCi->pc++] = pCi->p_symbol[pCi->sym_idx].value;
         type = e_NUM;
         break;
     case ARR: // like A(0)
-        val = a_Symbol[pCi->sym_idx].value;
-        match(ARR);
-        tok = lookahead();
-        match('(');
-        compile_expression(e_NUM);
-        match(')');
+        val = pCi->p_symbol[pCi->sym_idx].value;
+        match(pCi, ARR);
+        tok = lookahead(pCi);
+        match(pCi, '(');
+        compile_expression(pCi, e_NUM);
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_GET_ARR_ELEM_N2;
         pCi->p_code[pCi->pc++] = val;
         type = e_NUM;
         break;
+    case e_CARR: // like T(0)
+        offs = pCi->p_symbol[pCi->sym_idx].value;
+        match(pCi, e_CARR);
+        match(pCi, '(');
+        pos = pCi->pc;
+        compile_expression(pCi, e_NUM);
+        match(pCi, ')');
+        // A constant index within the bounds reads the value at compile time
+        if(get_const_value(pCi, pos, pCi->pc, &value) && value < ACS32(pCi->p_pool[offs])) {
+            pCi->pc = pos;
+            emit_const(pCi, ACS32(pCi->p_pool[offs + (1 + value) * sizeof(uint32_t)]));
+        } else {
+            pCi->p_code[pCi->pc++] = k_GET_CONST_ELEM_N3;
+            ACS16(pCi->p_code[pCi->pc]) = offs;
+            pCi->pc += 2;
+        }
+        type = e_NUM;
+        break;
 #ifdef cfg_DATA_ACCESS        
     case GET1: // get1 function
-        compile_get(GET1, k_GET_ARR_1BYTE_N2);
+        compile_get(pCi, GET1, k_GET_ARR_1BYTE_N2);
         type = e_NUM;
         break;
     case GET2: // get2 function
-        compile_get(GET2, k_GET_ARR_2BYTE_N2);
+        compile_get(pCi, GET2, k_GET_ARR_2BYTE_N2);
         type = e_NUM;
         break;
     case GET4: // get4 function
-        compile_get(GET4, k_GET_ARR_4BYTE_N2);
+        compile_get(pCi, GET4, k_GET_ARR_4BYTE_N2);
         type = e_NUM;
         break;
     case REF: // ref(arr/str) function
-        match(REF);
-        match('(');
-        tok = lookahead();
+        match(pCi, REF);
+        match(pCi, '(');
+        tok = lookahead(pCi);
         if(tok == ARR || tok == SID) {
-            match(tok);
+            match(pCi, tok);
         } else {
-            error("syntax error", pCi->a_buff);
+            error(pCi, "syntax error", pCi->p_buff);
         }
-        match(')');
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_PUSH_VAR_N2;
-        pCi->p_code[pCi->pc++] = a_Symbol[pCi->sym_idx].value;
+        pCi->p_code[pCi->pc++] = pCi->p_symbol[pCi->sym_idx].value;
         type = e_REF;
         break;
 #endif
     case PARAMS: // Move value from (external) parameter stack to the data stack
-        match(PARAMS);
-        match('(');
-        match(')');
+        match(pCi, PARAMS);
+        match(pCi, '(');
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_PARAMS_N1;
         type = e_STR;
         break;
     case PARAM: // Move value from (external) parameter stack to the data stack
-        match(PARAM);
-        match('(');
-        match(')');
+        match(pCi, PARAM);
+        match(pCi, '(');
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_PARAM_N1;
         type = e_NUM;
         break;
     case STR: // string, like "Hello"
-        match(STR);
-        // push string address
-        uint16_t len = strlen(pCi->a_buff);
-        pCi->a_buff[len - 1] = '\0';
-        pCi->p_code[pCi->pc++] = k_PUSH_STR_Nx;
-        pCi->p_code[pCi->pc++] = len - 1; // without quotes but with 0
-        strcpy((char*)&pCi->p_code[pCi->pc], pCi->a_buff + 1);
-        pCi->pc += len - 1;
+        compile_string(pCi);
         type = e_STR;
         break;
     case SID: // string variable, like A$
-        match(SID);
+        match(pCi, SID);
         pCi->p_code[pCi->pc++] = k_PUSH_VAR_N2;
-        pCi->p_code[pCi->pc++] = a_Symbol[pCi->sym_idx].value;
+        pCi->p_code[pCi->pc++] = pCi->p_symbol[pCi->sym_idx].value;
         type = e_STR;
         break;
 #ifdef cfg_STRING_SUPPORT        
     case LEFTS: // left function
-        match(LEFTS);
-        match('(');
-        compile_expression(e_STR);
-        match(',');
-        compile_expression(e_NUM);
-        match(')');
+        match(pCi, LEFTS);
+        match(pCi, '(');
+        compile_expression(pCi, e_STR);
+        match(pCi, ',');
+        compile_expression(pCi, e_NUM);
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_LEFT_STR_N1;
         type = e_STR;
         break;
     case RIGHTS: // right function
-        match(RIGHTS);
-        match('(');
-        compile_expression(e_STR);
-        match(',');
-        compile_expression(e_NUM);
-        match(')');
+        match(pCi, RIGHTS);
+        match(pCi, '(');
+        compile_expression(pCi, e_STR);
+        match(pCi, ',');
+        compile_expression(pCi, e_NUM);
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_RIGHT_STR_N1;
         type = e_STR;
         break;
     case MIDS: // mid function
-        match(MIDS);
-        match('(');
-        compile_expression(e_STR);
-        match(',');
-        compile_expression(e_NUM);
-        match(',');
-        type = compile_expression(e_NUM);
-        match(')');
+        match(pCi, MIDS);
+        match(pCi, '(');
+        compile_expression(pCi, e_STR);
+        match(pCi, ',');
+        compile_expression(pCi, e_NUM);
+        match(pCi, ',');
+        type = compile_expression(pCi, e_NUM);
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_MID_STR_N1;
         type = e_STR;
         break;
     case LEN: // len function
-        match(LEN);
-        match('(');
-        compile_expression(e_STR);
-        match(')');
+        match(pCi, LEN);
+        match(pCi, '(');
+        compile_expression(pCi, e_STR);
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_STR_LEN_N1;
         type = e_NUM;
         break;
     case VAL: // val function
-        match(VAL);
-        match('(');
-        compile_expression(e_STR);
-        match(')');
+        match(pCi, VAL);
+        match(pCi, '(');
+        compile_expression(pCi, e_STR);
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_STR_TO_VAL_N1;
         type = e_NUM;
         break;
     case STRS: // str$ function
-        match(STRS);
-        match('(');
-        compile_expression(e_NUM);
-        match(')');
+        match(pCi, STRS);
+        match(pCi, '(');
+        compile_expression(pCi, e_NUM);
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_VAL_TO_STR_N1;
         type = e_STR;
         break;
     case HEXS: // hex function
-        match(HEXS);
-        match('(');
-        compile_expression(e_NUM);
-        match(')');
+        match(pCi, HEXS);
+        match(pCi, '(');
+        compile_expression(pCi, e_NUM);
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_VAL_TO_HEX_N1;
         type = e_STR;
         break;
     case INSTR: // instr function
-        match(INSTR);
-        match('(');
-        compile_expression(e_NUM);
-        match(',');
-        compile_expression(e_STR);
-        match(',');
-        compile_expression(e_STR);
-        match(')');
+        match(pCi, INSTR);
+        match(pCi, '(');
+        compile_expression(pCi, e_NUM);
+        match(pCi, ',');
+        compile_expression(pCi, e_STR);
+        match(pCi, ',');
+        compile_expression(pCi, e_STR);
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_INSTR_N1;
         type = e_NUM;
         break;
     case STRINGS: // string$ function
-        match(STRINGS);
-        match('(');
-        compile_expression(e_NUM);
-        match(',');
-        tok = lookahead();
-        compile_expression(e_STR);
-        match(')');
+        match(pCi, STRINGS);
+        match(pCi, '(');
+        compile_expression(pCi, e_NUM);
+        match(pCi, ',');
+        tok = lookahead(pCi);
+        compile_expression(pCi, e_STR);
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_ALLOC_STR_N1;
         type = e_STR;
         break;
 #endif        
     case RND: // Random number
-        match(RND);
-        match('(');
-        compile_expression(e_NUM);
-        match(')');
+        match(pCi, RND);
+        match(pCi, '(');
+        compile_expression(pCi, e_NUM);
+        match(pCi, ')');
         pCi->p_code[pCi->pc++] = k_RND_N1;
         type = e_NUM;
         break;
     case XFUNC:
-        match(XFUNC);
-        type = compile_xfunc(e_ANY);
+        match(pCi, XFUNC);
+        type = compile_xfunc(pCi, e_ANY);
         pCi->p_code[pCi->pc++] = k_PARAM_N1;
         break;
     case NIL:
-        match(NIL);
+        match(pCi, NIL);
         pCi->p_code[pCi->pc++] = k_PUSH_NUM_N2;
         pCi->p_code[pCi->pc++] = 0;
         type = e_REF;
         break;
     default:
-        error("syntax error", pCi->a_buff);
+        error(pCi, "syntax error", pCi->p_buff);
         break;
     }
     return type;
@@ -32,16 +32,41 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 #define MIN(a,b)  ((a) < (b) ? (a) : (b))
 #define MAX(a,b)  ((a) > (b) ? (a) : (b))
 
-// Opcode definitions
+#ifdef cfg_WIDE_ADDRESSES
+#define ACS_ADDR(x)         ACS32(x)
+#define k_ADDR_LEN          (4)          // Size of a code address operand
+#define k_HEAP_TAG          (0x80000000) // Heap references, lower values are code addresses
+#else
+#define ACS_ADDR(x)         ACS16(x)
+#define k_ADDR_LEN          (2)
+#define k_HEAP_TAG          (0x8000)
+#if cfg_MAX_CODE_SIZE > 0x7FF0
+#error "cfg_MAX_CODE_SIZE exceeds the 16 bit address range, use cfg_WIDE_ADDRESSES"
+#endif
+#endif
+#define k_HEAP_MASK         (k_HEAP_TAG - 1)
+#define k_JUMP_LEN          (1 + k_ADDR_LEN) // Size of GOTO, GOSUB, IF and IF_TRUE
+#define k_NEXT_LEN          (2 + k_ADDR_LEN) // Size of NEXT
+#define k_NUM_SHORT         (16)         // Variables and values with a one byte instruction (cfg_COMPACT_CODE)
+#define k_PRINT_LIST_LEN(num) (2 + ((num) + 1) / 2) // Size of PRINT_LIST with 'num' items
+#define k_SELECT_BIN_LEN(num) (2 + (num) * 4) // Size of SELECT_BIN with 'num' values
+
+// PRINT_LIST item formats (low nibble = first item, the values are popped from the stack)
+#define k_PRT_STR           (0x00) // string address
+#define k_PRT_VAL           (0x01) // number
+#define k_PRT_BLANKS        (0x02) // number of blanks (function spc)
+#define k_PRT_TYPE_MASK     (0x03)
+#define k_PRT_SPACE         (0x04) // followed by a blank
+#define k_PRT_TAB           (0x08) // followed by a tabulator
+#define k_PRT_NEWL          (0x0C) // followed by a new line
+#define k_PRT_SEP_MASK      (0x0C)
+
+// Opcode definitions (the sizes are for 16 bit addresses, see 'k_ADDR_LEN')
 enum {
     k_END,                // End of programm
-    k_PRINT_STR_N1,       // (pop addr from stack)
-    k_PRINT_VAL_N1,       // (pop value from stack)
+    k_PRINT_LIST_N2,      // (number of items, followed by 4 bit formats, see 'k_PRINT_LIST_LEN')
     k_PRINT_NEWL_N1,      // 
-    k_PRINT_TAB_N1,       // 
-    k_PRINT_SPACE_N1,     // 
-    k_PRINT_BLANKS_N1,    // (function spc)
-    k_PUSH_STR_Nx,        // nn S T R I N G 00 (push string address (16 bit))
+    k_PUSH_STR_N3,        // (16 bit string pool offset) (push string address)
     k_PUSH_NUM_N5,        // (push 4 byte const value)
     k_PUSH_NUM_N2,        // (push 1 byte const value)     
     k_PUSH_VAR_N2,        // (push variable)
@@ -110,6 +135,29 @@ enum {
     k_VAL_TO_HEX_N1,      // (hex$)
     k_INSTR_N1,           // (instr)
     k_ALLOC_STR_N1,       // (alloc string)
+    k_STORE_VAR_N2,       // (copy top of stack to variable)
+    k_SHL_N2,             // (multiply by 2^n)
+    k_DIV_POW2_N2,        // (divide by 2^n)
+    k_MOD_POW2_N2,        // (modulo 2^n)
+    k_DIV_MAGIC_N6,       // (32 bit multiplier, shift) (divide by constant)
+    k_MOD_MAGIC_N8,       // (32 bit multiplier, shift, 16 bit divisor) (modulo constant)
+    k_IF_TRUE_N3,         // (pop val, jump if true)
+    k_LAZY_LINE_N3,       // (16 bit line number) (compile the line on first use)
+    k_SELECT_TAB_N6,      // (32 bit first value, number of addresses) (pop val, jump table)
+    k_SELECT_BIN_N2,      // (number of values, followed by the sorted 32 bit values) (pop val, binary search)
+    k_GET_CONST_ELEM_N3,  // (16 bit pool offset) (get constant array element)
+    k_STR_EQUAL_LIT_N3,   // (16 bit pool offset) (compare string from stack with literal)
+    k_STR_NOT_EQU_LIT_N3, // (16 bit pool offset) (compare string from stack with literal)
+    k_SET_STR_LIT_N4,     // (variable, 16 bit pool offset) (assign string literal)
+    k_PROFILE_N3,         // (16 bit site number) (count the execution, cfg_PROFILE)
+    // Compact encoding (cfg_COMPACT_CODE)
+    k_GOTO_R2,            // (8 bit relative programm address)
+    k_IF_R2,              // (pop val, 8 bit relative END address)
+    k_IF_TRUE_R2,         // (pop val, jump if true)
+    k_NEXT_R3,            // (8 bit relative programm address), (variable)
+    k_PUSH_VAR0_N1,       // (push variable 0, followed by the short forms for the variables 1..15)
+    k_POP_VAR0_N1 = k_PUSH_VAR0_N1 + k_NUM_SHORT, // (pop variable 0..15)
+    k_PUSH_NUM0_N1 = k_POP_VAR0_N1 + k_NUM_SHORT, // (push the value 0..15)
 };
 
 // Token types
@@ -131,22 +179,65 @@ enum {
     FREE, RND, PARAMS, STRINGS, // 184 - 187
     WHILE, LOOP, ENDIF, DATA,   // 188 - 191
     READ, RESTORE, REF, RETI,   // 192 - 195
-    ELSEIF,                     // 196 - 198
+    ELSEIF, IMPORT, SELECT, CASE, // 196 - 199
 };
 
 // Symbol table
 typedef struct {
     char name[k_MAX_SYM_LEN];
     uint8_t  type;   // Token type
-    uint8_t  res;    // Reserved for future use
+    uint8_t  flags;  // SYM_DEFINED
     uint32_t value;  // Variable index (0..n) or label address
 } sym_t;
 
+#define SYM_DEFINED     0x01 // Label is defined (the address is valid)
+
+// Line number map entry (sorted by line numbers)
+typedef struct {
+    uint16_t linenum;
+    nb_addr_t pc;    // code address of the line
+} line_t;
+
+// Source line info for the incremental compilation (cfg_LINE_NUMBERS)
+typedef struct {
+    uint32_t hash;    // hash value of the line text
+    nb_addr_t pc;     // code address of the top-level statement the line belongs to
+    uint16_t map_idx; // number of line number map entries in front of the line
+    uint8_t  flags;   // first line of a top-level statement, line with declarations or DATA
+} src_line_t;
+
+// Line of the lazy compilation, compiled on first use (cfg_LINE_NUMBERS)
+typedef struct {
+    uint16_t linenum;
+    nb_addr_t stub;   // code address of the stub instruction, 0 = none
+    uint32_t src_pos; // start of the line in the source code buffer
+} lazy_line_t;
+
 // Virtual machine
 typedef struct {
-    uint16_t code_size; // size of the compiled byte code
+    nb_addr_t code_size; // size of the compiled byte code
     uint16_t num_vars;  // number of used variables
-    uint16_t pc;        // Programm counter
+    uint16_t num_symbols; // number of symbol table entries
+    sym_t   *p_symbol;  // symbol table of the last compilation (debug interface)
+    uint16_t num_lines; // number of line number map entries
+    line_t  *p_line_map; // line number map of the last compilation (cfg_LINE_NUMBERS)
+    uint16_t num_src_lines; // number of source code lines of the last compilation
+    src_line_t *p_src_lines; // source line info of the last compilation (cfg_LINE_NUMBERS)
+    nb_addr_t data_code_addr; // start of the DATA strings in the code, 0 = no DATA
+    uint16_t num_lazy;  // number of lines not compiled with the main program
+    lazy_line_t *p_lazy; // lines compiled on first use (cfg_LINE_NUMBERS)
+    const char *p_lazy_src; // source code buffer of the lazy compilation
+    size_t   lazy_src_len;
+#ifdef cfg_PROFILE
+    bool     prof_collect;  // compile with profile counters
+    uint16_t num_prof_cnt;  // number of profile counters of the compiled program
+    uint32_t *p_prof_cnt;   // execution counts of the profile sites
+    uint32_t prof_hash;     // source code hash of the compiled program
+    uint16_t num_profile;   // number of sites of the profile in use
+    uint16_t *p_profile;    // profile in use for the next compilations
+    uint32_t profile_hash;  // source code hash of the profile in use
+#endif
+    nb_addr_t pc;       // Programm counter
     uint16_t sp;        // Stack pointer
     uint8_t  psp;       // Parameter stack pointer
     uint8_t  nested_loop_idx;
@@ -154,12 +245,17 @@ typedef struct {
     int32_t  paramstack[cfg_PARAMSTACK_SIZE];
     uint32_t variables[cfg_NUM_VARS];
     uint8_t  code[cfg_MAX_CODE_SIZE];
+    const uint8_t *p_mod_code; // shared code of the imported module (addresses below 'mod_end')
+    nb_addr_t mod_end;  // start of the program code behind the module, 0 = no module
+    char     mod_name[k_MAX_SYM_LEN]; // imported module (see 'nb_link_module()')
+    uint32_t mod_hash;
 #ifdef cfg_TRACE_SUPPORT
     uint16_t trace[cfg_MAX_CODE_SIZE];
 #endif
     bool     trace_on;
     uint16_t mem_start_addr;    // Search start address for a free memory block
-    uint16_t data_start_addr;   // Data section start address
+    nb_addr_t data_start_addr;  // Data section start address
+    nb_addr_t str_pool_addr;    // String literal pool start address (behind the data section)
     uint16_t data_read_offs;    // Data section read offset
     uint8_t  heap[cfg_MEM_HEAP_SIZE];
 #ifdef cfg_STRING_SUPPORT    
@@ -169,14 +265,19 @@ typedef struct {
 #endif
 } t_VM;
 
+// Code segment of the address: the imported module code or the program code
+#define CODE_SEG(vm, addr)  ((addr) < (vm)->mod_end ? (vm)->p_mod_code : (vm)->code)
+
 char *nb_scanner(char *p_in, char *p_out);
-sym_t *nb_get_symbol_table(uint16_t *p_start_idx);
+nb_addr_t nb_compile_lazy_line(t_VM *p_vm, uint16_t linenum);
+uint16_t nb_instr_len(const uint8_t *p_code);
+sym_t *nb_get_symbol_table(void *pv_vm, uint16_t *p_start_idx, uint16_t *p_num_sym);
 int32_t nb_get_number(void *pv_vm, uint8_t var);
 char *nb_get_string(void *pv_vm, uint8_t var);
 int32_t nb_get_arr_elem(void *pv_vm, uint8_t var, uint16_t idx);
 void nb_mem_init(t_VM *p_vm);
-uint16_t nb_mem_alloc(t_VM *p_vm, uint16_t bytes);
-void nb_mem_free(t_VM *p_vm, uint16_t addr);
-uint16_t nb_mem_realloc(t_VM *p_vm, uint16_t addr, uint16_t bytes);
-uint16_t nb_mem_get_blocksize(t_VM *p_vm, uint16_t addr);
+nb_addr_t nb_mem_alloc(t_VM *p_vm, uint16_t bytes);
+void nb_mem_free(t_VM *p_vm, nb_addr_t addr);
+nb_addr_t nb_mem_realloc(t_VM *p_vm, nb_addr_t addr, uint16_t bytes);
+uint16_t nb_mem_get_blocksize(t_VM *p_vm, nb_addr_t addr);
 uint16_t nb_mem_get_free(t_VM *p_vm);
@@ -0,0 +1,170 @@
+/*
+** Perfect hash table of the BASIC keywords
+** Generated by 'test/gen_keywords.py', do not edit!
+*/
+
+#define KW_HASH_MUL         (1001u)
+#define KW_HASH_SLOT(hash)  (((uint32_t)((hash) * KW_HASH_MUL)) >> 24)
+
+typedef struct {
+    char    name[8];
+    uint8_t type;
+} keyword_t;
+
+// Keyword number + 1 for each hash slot, 0 = no keyword
+static const uint8_t a_KeywordHash[256] = {
+    55,  0,  0,  0,  0,  0,  0, 22,  0,  0,  0,  0,  0,  0, 49,  0,
+     0,  0,  0,  0,  0, 52,  0,  0,  0,  0, 56,  0,  0,  0,  0, 57,
+     4,  0,  0,  0,  0,  0, 51, 48,  0,  5,  0,  0,  0, 19,  0,  0,
+     0,  0,  0, 40,  0, 29,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  3,  0,  0,  0, 43,  0, 20, 46,  0, 32,  0,  0,
+     0,  0, 45,  0,  0, 33, 47,  0,  0, 25, 28,  0,  0, 44,  0,  0,
+     0,  0, 23,  0,  0,  0,  0,  0,  0,  0, 17,  0, 34,  0,  0,  0,
+    21, 58,  1,  0,  0,  0,  0, 27,  0, 24, 16,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  6,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 35,  0,  0, 50,  0,  0,
+     0,  0,  0,  0, 59,  0,  0, 11,  0,  0,  0,  0,  0,  0,  0,  0,
+    18,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  7,  0,  0,
+    30, 10,  0,  0,  0, 14,  0, 42,  0, 38,  0,  0, 13,  0, 37,  0,
+     0,  2,  0,  0,  0,  0,  0, 31,  0,  0,  0, 12,  0,  0,  0, 15,
+     0,  0,  0,  0,  0,  0,  0,  0, 26, 39,  0,  0,  0,  0,  0, 36,
+    54,  9,  0,  0, 41,  8,  0,  0,  0,  0,  0,  0, 53,  0,  0,  0,
+};
+
+static const keyword_t a_KeywordList[59] = {
+    {"let", LET},
+    {"dim", DIM},
+    {"for", FOR},
+    {"to", TO},
+    {"step", STEP},
+    {"next", NEXT},
+    {"if", IF},
+    {"then", THEN},
+    {"else", ELSE},
+    {"elseif", ELSEIF},
+    {"end", END},
+    {"while", WHILE},
+    {"loop", LOOP},
+    {"endif", ENDIF},
+    {"print", PRINT},
+    {"goto", GOTO},
+    {"gosub", GOSUB},
+    {"return", RETURN},
+    {"rem", REM},
+    {"and", AND},
+    {"or", OR},
+    {"not", NOT},
+    {"mod", MOD},
+    {"break", BREAK},
+    {"data", DATA},
+    {"read", READ},
+    {"restore", RESTORE},
+    {"param$", PARAMS},
+    {"param", PARAM},
+#ifdef cfg_DATA_ACCESS
+    {"set1", SET1},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_DATA_ACCESS
+    {"set2", SET2},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_DATA_ACCESS
+    {"set4", SET4},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_DATA_ACCESS
+    {"get1", GET1},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_DATA_ACCESS
+    {"get2", GET2},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_DATA_ACCESS
+    {"get4", GET4},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_DATA_ACCESS
+    {"copy", COPY},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_DATA_ACCESS
+    {"ref", REF},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_DATA_ACCESS
+    {"reti", RETI},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_STRING_SUPPORT
+    {"left$", LEFTS},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_STRING_SUPPORT
+    {"right$", RIGHTS},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_STRING_SUPPORT
+    {"mid$", MIDS},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_STRING_SUPPORT
+    {"len", LEN},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_STRING_SUPPORT
+    {"val", VAL},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_STRING_SUPPORT
+    {"str$", STRS},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_STRING_SUPPORT
+    {"spc", SPC},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_STRING_SUPPORT
+    {"hex$", HEXS},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_STRING_SUPPORT
+    {"nil", NIL},
+#else
+    {"", 0},
+#endif
+#ifdef cfg_STRING_SUPPORT
+    {"string$", STRINGS},
+#else
+    {"", 0},
+#endif
+    {"const", CONST},
+    {"erase", ERASE},
+    {"instr", INSTR},
+    {"on", ON},
+    {"tron", TRON},
+    {"troff", TROFF},
+    {"free", FREE},
+    {"rnd", RND},
+    {"import", IMPORT},
+    {"select", SELECT},
+    {"case", CASE},
+};
@@ -47,15 +47,15 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 
 typedef struct {
     void *pv_vm;
-    char *p_src;
-    int src_pos;
     char screen_buffer[MAX_LINES * MAX_LINE_LEN];
     uint8_t xpos;
     uint8_t ypos;
+    int src_ref;    // registry reference to the source code of the lazy compilation
 } nb_cpu_t;
 
 // Used to connect compile/run with nb_print, which should work on the same CPU instance
-static nb_cpu_t *p_Cpu = NULL;
+// (per thread, so that the VMs of different threads output into their own screen buffers)
+static _Thread_local nb_cpu_t *p_Cpu = NULL;
 
 /**************************************************************************************************
 ** Static helper functions
@@ -107,26 +107,6 @@ static void str_to_bin(uint8_t *p_dst_bin, char *p_src_str, uint32_t str_size) {
 /**************************************************************************************************
 ** External NanoBasic functions
 **************************************************************************************************/
-char *nb_get_code_line(void *fp, char *line, int max_line_len)
-{
-    nb_cpu_t *C = (nb_cpu_t *)fp;
-    if(C->p_src == NULL) {
-        return NULL;
-    }
-    if(C->p_src[C->src_pos] == '\0') {
-        return NULL;
-    }
-    int len = 0;
-    while(C->p_src[C->src_pos] != '\n' && C->p_src[C->src_pos] != '\0' && len < max_line_len) {
-        line[len++] = C->p_src[C->src_pos++];
-    }
-    line[len] = '\0';
-    if(C->p_src[C->src_pos] == '\n') {
-        C->src_pos++;
-    }
-    return line;
-}
-
 static void new_line(nb_cpu_t *C) {
     C->xpos = 0;
     C->ypos++;
@@ -140,7 +120,7 @@ static void new_line(nb_cpu_t *C) {
 
 void nb_print(const char * format, ...)
 {
-    char buffer[MAX_LINE_LEN + 1];
+    char buffer[k_MAX_LINE_LEN + 1]; // (the items of a PRINT statement are output at once)
     uint8_t pos;
     va_list args;
 
@@ -148,7 +128,6 @@ void nb_print(const char * format, ...)
         va_start(args, format);
         vsnprintf(buffer, sizeof(buffer), format, args);
         va_end(args);
-        buffer[MAX_LINE_LEN] = '\0';
         for(int i = 0; i < strlen(buffer); i++) {
             if (buffer[i] >= ' ' && buffer[i] <= '~') {
                 p_Cpu->screen_buffer[p_Cpu->ypos * MAX_LINE_LEN + p_Cpu->xpos] = buffer[i];
@@ -194,9 +173,19 @@ static int add_function(lua_State *L) {
     return 1;
 }
 
+static int add_module(lua_State *L) {
+    char *name = (char *)luaL_checkstring(L, 1);
+    size_t size;
+    const char *p_src = luaL_checklstring(L, 2, &size);
+    uint16_t errors = nb_define_module(name, p_src, size);
+    lua_pushinteger(L, errors);
+    return 1;
+}
+
 static int create(lua_State *L) {   
     size_t size;
     char *p_src = (char*)lua_tolstring(L, 1, &size);
+    bool lazy = lua_toboolean(L, 2) && p_src != NULL;
     nb_cpu_t *C = (nb_cpu_t *)lua_newuserdata(L, sizeof(nb_cpu_t));
     if(C != NULL) {
         C->pv_vm = nb_create();
@@ -206,8 +195,6 @@ static int create(lua_State *L) {
             lua_pushinteger(L, -1);
             return 2;
         }
-        C->p_src = p_src;
-        C->src_pos = 0;
         memset(C->screen_buffer, ' ', MAX_LINES * MAX_LINE_LEN);
         for(int i = 1; i < MAX_LINES; i++) {
             C->screen_buffer[i * MAX_LINE_LEN - 1] = '\n';
@@ -215,8 +202,17 @@ static int create(lua_State *L) {
         C->screen_buffer[MAX_LINES * MAX_LINE_LEN - 1] = '\0';
         C->xpos = 0;
         C->ypos = 0;
+        C->src_ref = LUA_NOREF;
         p_Cpu = C;
-        uint16_t errors = nb_compile(C->pv_vm, (void *)C);
+        uint16_t errors;
+        if(lazy) {
+            // The source code string has to stay alive for the lines compiled on first use
+            lua_pushvalue(L, 1);
+            C->src_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            errors = nb_compile_lazy(C->pv_vm, p_src, size);
+        } else {
+            errors = nb_compile_buffer(C->pv_vm, p_src != NULL ? p_src : "", p_src != NULL ? size : 0);
+        }
         p_Cpu = NULL;
         if(errors > 0) {
             luaL_getmetatable(L, "nb_cpu");
@@ -235,6 +231,26 @@ static int create(lua_State *L) {
     return 2;
 }
 
+// recompile(vm, src): compile the changed lines only and reset the VM, returns the number of errors
+static int recompile(lua_State *L) {
+    nb_cpu_t *C = check_vm(L);
+    size_t size;
+    char *p_src = (char*)lua_tolstring(L, 2, &size);
+    if(C != NULL) {
+        p_Cpu = C;
+        uint16_t errors = nb_recompile_buffer(C->pv_vm, p_src != NULL ? p_src : "", p_src != NULL ? size : 0);
+        p_Cpu = NULL;
+        // (the lazy compilation is replaced by the complete one)
+        luaL_unref(L, LUA_REGISTRYINDEX, C->src_ref);
+        C->src_ref = LUA_NOREF;
+        nb_reset(C->pv_vm);
+        lua_pushinteger(L, errors);
+        return 1;
+    }
+    lua_pushinteger(L, -1);
+    return 1;
+}
+
 static int run(lua_State *L) {
     nb_cpu_t *C = check_vm(L);
     uint16_t cycles = (uint16_t)luaL_checkinteger(L, 2);
@@ -348,6 +364,8 @@ static int destroy(lua_State *L) {
     if(C != NULL) {
         nb_destroy(C->pv_vm);
         C->pv_vm = NULL; 
+        luaL_unref(L, LUA_REGISTRYINDEX, C->src_ref);
+        C->src_ref = LUA_NOREF;
     }
     return 0;
 }
@@ -403,9 +421,26 @@ static int unpack_vm(lua_State *L) {
             }
             str_to_bin((uint8_t*)&cpu, (char*)s, sizeof(nb_cpu_t) * 2);
             str_to_bin((uint8_t*)p_vm, (char*)s + sizeof(nb_cpu_t) * 2, sizeof(t_VM) * 2);
+            // the symbol table is not part of the packed VM
+            p_vm->p_symbol = NULL;
+            p_vm->num_symbols = 0;
+            p_vm->p_line_map = NULL;
+            p_vm->num_lines = 0;
+            p_vm->p_src_lines = NULL;
+            p_vm->num_src_lines = 0;
+            // the lines of a lazy compilation can't be compiled any more
+            p_vm->p_lazy = NULL;
+            p_vm->num_lazy = 0;
+            p_vm->p_lazy_src = NULL;
+            p_vm->lazy_src_len = 0;
+            // the module code is shared, not part of the packed VM
+            if(!nb_link_module(p_vm)) {
+                printf("unpack_vm failed (module missing or changed)\n");
+                free(p_vm);
+                lua_pushboolean(L, 0);
+                return 1;
+            }
             C->pv_vm = p_vm;
-            C->p_src = cpu.p_src;
-            C->src_pos = cpu.src_pos;
             memcpy(C->screen_buffer, cpu.screen_buffer, sizeof(cpu.screen_buffer));
             C->xpos = cpu.xpos;
             C->ypos = cpu.ypos;
@@ -426,7 +461,7 @@ static int get_label_address(lua_State *L) {
     nb_cpu_t *C = check_vm(L);
     if(C != NULL) {
         char *name = (char *)luaL_checkstring(L, 2);
-        uint16_t res = nb_get_label_address(C->pv_vm, name);
+        nb_addr_t res = nb_get_label_address(C->pv_vm, name);
         lua_pushinteger(L, res);
         return 1;
     }
@@ -436,7 +471,7 @@ static int get_label_address(lua_State *L) {
 static int set_pc(lua_State *L) {
     nb_cpu_t *C = check_vm(L);
     if(C != NULL) {
-        uint16_t addr = luaL_checkinteger(L, 2);
+        nb_addr_t addr = luaL_checkinteger(L, 2);
         nb_set_pc(C->pv_vm, addr);
         return 0;
     }
@@ -510,7 +545,7 @@ static int pop_str(lua_State *L) {
 static int pop_arr_addr(lua_State *L) {
     nb_cpu_t *C = check_vm(L);
     if(C != NULL) {
-        uint16_t ref = nb_pop_arr_ref(C->pv_vm);
+        nb_addr_t ref = nb_pop_arr_ref(C->pv_vm);
         lua_pushinteger(L, ref);
         return 1;
     }
@@ -520,7 +555,7 @@ static int pop_arr_addr(lua_State *L) {
 static int read_arr(lua_State *L) {
     nb_cpu_t *C = check_vm(L);
     if(C != NULL) {
-        uint16_t addr = luaL_checkinteger(L, 2);
+        nb_addr_t addr = luaL_checkinteger(L, 2);
         uint8_t arr[256];
         uint16_t bytes = nb_read_arr(C->pv_vm, addr, arr, sizeof(arr));
         if(bytes > 0) {
@@ -538,7 +573,7 @@ static int read_arr(lua_State *L) {
 static int write_arr(lua_State *L) {
     nb_cpu_t *C = check_vm(L);
     if(C != NULL) {
-        uint16_t addr = luaL_checkinteger(L, 2);
+        nb_addr_t addr = luaL_checkinteger(L, 2);
         uint8_t arr[256];
         uint16_t num = table_to_bytes(L, 3, arr, sizeof(arr));
         uint16_t res = nb_write_arr(C->pv_vm, addr, arr, num);
@@ -554,14 +589,17 @@ static int write_arr(lua_State *L) {
 static int get_variable_list(lua_State *L) {
     nb_cpu_t *C = check_vm(L);
     uint16_t start_idx;
+    uint16_t num_sym;
     uint8_t idx = 0;
     uint8_t type;
 
     if(C != NULL) {
-        sym_t *p_sym = nb_get_symbol_table(&start_idx);
+        sym_t *p_sym = nb_get_symbol_table(C->pv_vm, &start_idx, &num_sym);
         lua_newtable(L);
-        for(int i = start_idx; i < cfg_MAX_NUM_SYM; i++) {
-            if(p_sym[i].name[0] != '\0' && p_sym[i].type != LABEL) {
+        for(int i = start_idx; i < num_sym; i++) {
+            if(p_sym[i].name[0] == '#') { // hidden temporary variable
+                idx++;
+            } else if(p_sym[i].name[0] != '\0' && p_sym[i].type != LABEL) {
                 // tbl[name] = {type, idx}
                 type = (p_sym[i].type == ID) ? NB_NUM : (p_sym[i].type == SID) ? NB_STR : NB_ARR;
                 lua_newtable(L);
@@ -654,7 +692,9 @@ static const luaL_Reg R[] = {
     {"version",                 version},
     {"free_mem",                free_mem},
     {"add_function",            add_function},
+    {"add_module",              add_module},
     {"create",                  create},
+    {"recompile",               recompile},
     {"reset",                   reset},
     {"destroy",                 destroy},
     {"pack_vm",                 pack_vm},
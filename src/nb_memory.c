@@ -42,7 +42,7 @@ void nb_mem_init(t_VM *p_vm) {
     p_vm->mem_start_addr = 0;
 }
 
-uint16_t nb_mem_alloc(t_VM *p_vm, uint16_t bytes) {
+nb_addr_t nb_mem_alloc(t_VM *p_vm, uint16_t bytes) {
 #ifdef cfg_STRING_SUPPORT
     if(bytes <= cfg_MAX_MEM_BLOCK_SIZE) {
         uint16_t num_blocks = NUM_BLOCKS(bytes);
@@ -67,7 +67,7 @@ uint16_t nb_mem_alloc(t_VM *p_vm, uint16_t bytes) {
                 if(count == num_blocks) {
                     p_vm->heap[start] = num_blocks;
                     p_vm->heap[start + 1] = num_words;
-                    return 0x8000 + start + HEADER_SIZE;
+                    return k_HEAP_TAG + start + HEADER_SIZE;
                 }
             } else {
                 blocked = p_vm->heap[i] - 1;
@@ -83,16 +83,16 @@ uint16_t nb_mem_alloc(t_VM *p_vm, uint16_t bytes) {
         uint16_t addr = p_vm->mem_start_addr;
         p_vm->mem_start_addr += bytes;
         p_vm->heap[addr + 1] = num_words;
-        return 0x8000 + addr + HEADER_SIZE;
+        return k_HEAP_TAG + addr + HEADER_SIZE;
     }
 #endif    
     return 0;
 }
 
 #ifdef cfg_STRING_SUPPORT
-void nb_mem_free(t_VM *p_vm, uint16_t addr) {
-    if(addr > 0x7FFF) {
-        addr = (addr & 0x7FFF) - HEADER_SIZE;
+void nb_mem_free(t_VM *p_vm, nb_addr_t ref) {
+    if(ref >= k_HEAP_TAG) {
+        uint16_t addr = (ref & k_HEAP_MASK) - HEADER_SIZE;
         if(addr < cfg_MEM_HEAP_SIZE) {
             uint16_t size = p_vm->heap[addr] * k_MEM_BLOCK_SIZE;
             if((addr + size) <= cfg_MEM_HEAP_SIZE) {
@@ -106,9 +106,9 @@ void nb_mem_free(t_VM *p_vm, uint16_t addr) {
 }
 
 // Allocate a bigger block if necessary
-uint16_t nb_mem_realloc(t_VM *p_vm, uint16_t addr, uint16_t bytes) {
-    if(addr > 0x7FFF && bytes <= cfg_MAX_MEM_BLOCK_SIZE) {
-        uint16_t buff_size = (p_vm->heap[(addr & 0x7FFF) - 1] * sizeof(uint32_t)) - HEADER_SIZE;
+nb_addr_t nb_mem_realloc(t_VM *p_vm, nb_addr_t addr, uint16_t bytes) {
+    if(addr >= k_HEAP_TAG && bytes <= cfg_MAX_MEM_BLOCK_SIZE) {
+        uint16_t buff_size = (p_vm->heap[(addr & k_HEAP_MASK) - 1] * sizeof(uint32_t)) - HEADER_SIZE;
         if(buff_size >= bytes) {
             return addr;
         }
@@ -120,8 +120,8 @@ uint16_t nb_mem_realloc(t_VM *p_vm, uint16_t addr, uint16_t bytes) {
 #endif
 
 // size in bytes
-uint16_t nb_mem_get_blocksize(t_VM *p_vm, uint16_t addr) {
-    addr = (addr & 0x7FFF) - HEADER_SIZE;
+uint16_t nb_mem_get_blocksize(t_VM *p_vm, nb_addr_t ref) {
+    uint16_t addr = (ref & k_HEAP_MASK) - HEADER_SIZE;
     return (p_vm->heap[addr + 1] * sizeof(uint32_t)) - HEADER_SIZE;
 }
 
@@ -166,7 +166,7 @@ void mem_dump(t_VM *p_vm) {
 }
 
 void test_memory(t_VM *p_vm) {
-    uint16_t addr1, addr2, addr3, addr4;
+    nb_addr_t addr1, addr2, addr3, addr4;
 
     mem_dump(p_vm);
     assert((addr1 = nb_mem_alloc(p_vm, 13)) != 0);
@@ -179,15 +179,15 @@ void test_memory(t_VM *p_vm) {
     assert(nb_mem_get_blocksize(p_vm, addr3) == 18);
     assert(nb_mem_get_blocksize(p_vm, addr4) == 130);
 
-    memset(p_vm->heap + (addr1 & 0x7FFF), 0x11, 13);
-    memset(p_vm->heap + (addr2 & 0x7FFF), 0x22, 14);
-    memset(p_vm->heap + (addr3 & 0x7FFF), 0x33, 15);
-    memset(p_vm->heap + (addr4 & 0x7FFF), 0x44, 128);
+    memset(p_vm->heap + (addr1 & k_HEAP_MASK), 0x11, 13);
+    memset(p_vm->heap + (addr2 & k_HEAP_MASK), 0x22, 14);
+    memset(p_vm->heap + (addr3 & k_HEAP_MASK), 0x33, 15);
+    memset(p_vm->heap + (addr4 & k_HEAP_MASK), 0x44, 128);
 
-    assert((uint64_t)(p_vm->heap + (addr1 & 0x7FFF)) % 4 == 0);
-    assert((uint64_t)(p_vm->heap + (addr2 & 0x7FFF)) % 4 == 0);
-    assert((uint64_t)(p_vm->heap + (addr3 & 0x7FFF)) % 4 == 0);
-    assert((uint64_t)(p_vm->heap + (addr4 & 0x7FFF)) % 4 == 0);
+    assert((uint64_t)(p_vm->heap + (addr1 & k_HEAP_MASK)) % 4 == 0);
+    assert((uint64_t)(p_vm->heap + (addr2 & k_HEAP_MASK)) % 4 == 0);
+    assert((uint64_t)(p_vm->heap + (addr3 & k_HEAP_MASK)) % 4 == 0);
+    assert((uint64_t)(p_vm->heap + (addr4 & k_HEAP_MASK)) % 4 == 0);
 
     mem_dump(p_vm);
     nb_mem_free(p_vm, addr2);
@@ -197,11 +197,11 @@ void test_memory(t_VM *p_vm) {
     nb_mem_free(p_vm, addr3);
     mem_dump(p_vm);
 
-    assert((addr1 = nb_mem_alloc(p_vm, 29)) == 0x8002);
-    assert((addr1 = nb_mem_realloc(p_vm, addr1, 14)) == 0x8002);
+    assert((addr1 = nb_mem_alloc(p_vm, 29)) == k_HEAP_TAG + 2);
+    assert((addr1 = nb_mem_realloc(p_vm, addr1, 14)) == k_HEAP_TAG + 2);
     mem_dump(p_vm);
-    assert((addr2 = nb_mem_alloc(p_vm, 12)) == 0x8012);
-    assert((addr2 = nb_mem_realloc(p_vm, addr2, 30)) == 0x8022);
+    assert((addr2 = nb_mem_alloc(p_vm, 12)) == k_HEAP_TAG + 0x12);
+    assert((addr2 = nb_mem_realloc(p_vm, addr2, 30)) == k_HEAP_TAG + 0x22);
     mem_dump(p_vm);
 }
 
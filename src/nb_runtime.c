@@ -28,24 +28,38 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 #include "nb.h"
 #include "nb_int.h"
 
-#define STRBUF1  0x7FF1 // temporary string buffers
-#define STRBUF2  0x7FF2
+#define STRBUF1  (k_HEAP_TAG - 0x0F) // temporary string buffers
+#define STRBUF2  (k_HEAP_TAG - 0x0E)
 
 #define PUSH(x) vm->stack[(uint16_t)(vm->sp++) % cfg_STACK_SIZE] = (x)
 #define POP()   vm->stack[(uint16_t)(--vm->sp) % cfg_STACK_SIZE]
 #define TOP()   vm->stack[(uint16_t)(vm->sp - 1) % cfg_STACK_SIZE]
 #define PEEK(x) vm->stack[(uint16_t)(vm->sp + (x)) % cfg_STACK_SIZE]
 
+// The 16 opcodes of a short form (k_NUM_SHORT)
+#define CASE_SHORT(op) case (op): case (op) + 1: case (op) + 2: case (op) + 3: \
+    case (op) + 4: case (op) + 5: case (op) + 6: case (op) + 7: case (op) + 8: case (op) + 9: \
+    case (op) + 10: case (op) + 11: case (op) + 12: case (op) + 13: case (op) + 14: case (op) + 15
+
+// Absolute jump, the only way into or out of the imported module code
+// (the relative jumps and the module end stay within the code segment)
+#define JUMP(addr) do { vm->pc = (addr); code = CODE_SEG(vm, vm->pc); } while(0)
+
 #define PPUSH(x) vm->paramstack[(uint8_t)(vm->psp++) % cfg_STACK_SIZE] = x
 #define PPOP()   vm->paramstack[(uint8_t)(--vm->psp) % cfg_STACK_SIZE]
 
 /***************************************************************************************************
 **    static function-prototypes
 ***************************************************************************************************/
-static char *get_string(t_VM *vm, uint16_t addr);
+static char *get_string(t_VM *vm, nb_addr_t addr);
+static bool next_iteration(t_VM *vm, uint8_t var);
+static uint8_t select_index(const uint8_t *p_values, uint8_t num, int32_t val);
+static void print_list(t_VM *vm, const uint8_t *p_format, uint8_t num);
+static uint16_t print_append(char *p_buff, uint16_t len, const char *p_str);
+static int32_t div_magic(int32_t val, int32_t mul, uint8_t shift);
 #ifdef cfg_STRING_SUPPORT
-static char *alloc_temp_string(t_VM *vm, uint16_t *p_addr);
-static uint16_t realloc_string(t_VM *vm);
+static char *alloc_temp_string(t_VM *vm, nb_addr_t *p_addr);
+static nb_addr_t realloc_string(t_VM *vm);
 #endif
 
 /***************************************************************************************************
@@ -89,8 +103,8 @@ int32_t nb_get_arr_elem(void *pv_vm, uint8_t var, uint16_t idx) {
     if(var >= cfg_NUM_VARS) {
         return 0;
     }
-    uint16_t addr = vm->variables[var];
-    return ACS32(vm->heap[(addr & 0x7FFF) + idx * sizeof(uint32_t)]);
+    nb_addr_t addr = vm->variables[var];
+    return ACS32(vm->heap[(addr & k_HEAP_MASK) + idx * sizeof(uint32_t)]);
 }
 
 /*
@@ -126,14 +140,14 @@ char *nb_pop_str(void *pv_vm, char *str, uint8_t len) {
     if(vm->psp == 0) {
         return NULL;
     }
-    uint16_t addr = PPOP();
+    nb_addr_t addr = PPOP();
     strncpy(str, get_string(vm, addr), len);
     return str;
 }
 
 void nb_push_str(void *pv_vm, char *str) {
     t_VM *vm = pv_vm;
-    uint16_t addr;
+    nb_addr_t addr;
     char *ptr;
     if(vm->psp < cfg_STACK_SIZE) {
         ptr = alloc_temp_string(vm, &addr);
@@ -143,17 +157,17 @@ void nb_push_str(void *pv_vm, char *str) {
 }
 #endif
 
-uint16_t nb_pop_arr_ref(void *pv_vm) {
+nb_addr_t nb_pop_arr_ref(void *pv_vm) {
     t_VM *vm = pv_vm;
     if(vm->psp == 0) {
         return 0;
     }
-    return (uint16_t)PPOP();
+    return (nb_addr_t)PPOP();
 }
 
-uint16_t nb_read_arr(void *pv_vm, uint16_t addr, uint8_t *arr, uint16_t bytes) {
+uint16_t nb_read_arr(void *pv_vm, nb_addr_t addr, uint8_t *arr, uint16_t bytes) {
     t_VM *vm = pv_vm;
-    if(addr < 0x8000) {
+    if(addr < k_HEAP_TAG) {
     	// Const string reference (code segment)
         addr = MIN(addr, vm->code_size);
         uint16_t size = MIN(strlen((char*)&vm->code[addr]) + 1, bytes);
@@ -166,13 +180,13 @@ uint16_t nb_read_arr(void *pv_vm, uint16_t addr, uint8_t *arr, uint16_t bytes) {
         return 0;
     }
     size = MIN(size, bytes);
-    memcpy(arr, &vm->heap[addr & 0x7FFF], size);
+    memcpy(arr, &vm->heap[addr & k_HEAP_MASK], size);
     return size;
 }
 
-uint16_t nb_write_arr(void *pv_vm, uint16_t addr, uint8_t *arr, uint16_t bytes) {
+uint16_t nb_write_arr(void *pv_vm, nb_addr_t addr, uint8_t *arr, uint16_t bytes) {
     t_VM *vm = pv_vm;
-    if(addr < 0x8000) {
+    if(addr < k_HEAP_TAG) {
         return 0;
     }
     uint16_t size = nb_mem_get_blocksize(vm, addr);
@@ -180,7 +194,7 @@ uint16_t nb_write_arr(void *pv_vm, uint16_t addr, uint8_t *arr, uint16_t bytes)
         return 0;
     }
     size = MIN(size, bytes);
-    memcpy(&vm->heap[addr & 0x7FFF], arr, size);
+    memcpy(&vm->heap[addr & k_HEAP_MASK], arr, size);
     return size;
 }
 
@@ -189,7 +203,7 @@ uint8_t nb_stack_depth(void *pv_vm) {
     return vm->psp;
 }
 
-void nb_set_pc(void * pv_vm, uint16_t addr) {
+void nb_set_pc(void * pv_vm, nb_addr_t addr) {
     t_VM *vm = pv_vm;
     PUSH(vm->pc);
     vm->pc = addr;
@@ -200,8 +214,9 @@ void nb_set_pc(void * pv_vm, uint16_t addr) {
 */
 uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
     int32_t tmp1, tmp2;
-    uint16_t idx;
-    uint16_t addr, size;
+    nb_addr_t idx;
+    nb_addr_t addr;
+    uint16_t size;
     uint16_t offs1;
 #ifdef cfg_DATA_ACCESS
     uint16_t offs2, size1, size2;
@@ -211,6 +226,7 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
     char *ptr, *str1, *str2;
 #endif
     t_VM *vm = pv_vm;
+    const uint8_t *code = CODE_SEG(vm, vm->pc);
 
     while((*p_cycles)-- > 1)
     {
@@ -225,73 +241,66 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
 #endif
         }
 
-        switch (vm->code[vm->pc])
+        switch (code[vm->pc])
         {
         case k_END:
             return NB_END;
-        case k_PRINT_STR_N1:
-            tmp1 = POP();
-            nb_print("%s", get_string(vm, tmp1));
-            vm->pc += 1;
-            break;
-        case k_PRINT_VAL_N1:
-            nb_print("%d ", POP());
-            vm->pc += 1;
+        case k_PRINT_LIST_N2:
+            print_list(vm, &code[vm->pc + 2], code[vm->pc + 1]);
+            vm->pc += k_PRINT_LIST_LEN(code[vm->pc + 1]);
             break;
         case k_PRINT_NEWL_N1:
             nb_print("\n");
             vm->pc += 1;
             break;
-        case k_PRINT_TAB_N1:
-            nb_print("\t");
-            vm->pc += 1;
-            break;
-        case k_PRINT_SPACE_N1:
-            nb_print(" ");
-            vm->pc += 1;
-            break;
-        case k_PRINT_BLANKS_N1:
-            val = POP();
-            for(uint8_t i = 0; i < val; i++) {
-                nb_print(" ");
-            }
-            vm->pc += 1;
-            break;
-        case k_PUSH_STR_Nx:
-            tmp1 = vm->code[vm->pc + 1]; // string length
-            PUSH(vm->pc + 2);  // push string address
-            vm->pc += tmp1 + 2;
+        case k_PUSH_STR_N3:
+            PUSH(vm->str_pool_addr + ACS16(code[vm->pc + 1]));  // push string address
+            vm->pc += 3;
             break;
         case k_PUSH_NUM_N5:
-            PUSH(ACS32(vm->code[vm->pc + 1]));
+            PUSH(ACS32(code[vm->pc + 1]));
             vm->pc += 5;
             break;
         case k_PUSH_NUM_N2:
-            PUSH(vm->code[vm->pc + 1]);
+            PUSH(code[vm->pc + 1]);
             vm->pc += 2;
             break;
         case k_PUSH_VAR_N2:
-            var = vm->code[vm->pc + 1];
+            var = code[vm->pc + 1];
             PUSH(vm->variables[var]);
             vm->pc += 2;
             break;
         case k_POP_VAR_N2:
-            var = vm->code[vm->pc + 1];
+            var = code[vm->pc + 1];
             vm->variables[var] = POP();
             vm->pc += 2;
             break;
+        case k_STORE_VAR_N2:
+            var = code[vm->pc + 1];
+            vm->variables[var] = TOP();
+            vm->pc += 2;
+            break;
 #ifdef cfg_STRING_SUPPORT
         case k_POP_STR_N2:
-            var  = vm->code[vm->pc + 1];
+            var  = code[vm->pc + 1];
             addr = realloc_string(vm);
             vm->variables[var] = addr;
             vm->pc += 2;
             break;
+        case k_SET_STR_LIT_N4:
+            // A literal needs no heap buffer, the old one is freed
+            var = code[vm->pc + 1];
+            if(vm->variables[var] >= k_HEAP_TAG) {
+                nb_mem_free(vm, vm->variables[var]);
+            }
+            vm->variables[var] = vm->str_pool_addr + ACS16(code[vm->pc + 2]);
+            vm->pc += 4;
+            break;
 #endif
         case k_DIM_ARR_N2:
-            var = vm->code[vm->pc + 1];
+            var = code[vm->pc + 1];
 #ifdef cfg_STRING_SUPPORT
-            if(vm->variables[var] > 0x7FFF) {
+            if(vm->variables[var] >= k_HEAP_TAG) {
                 nb_mem_free(vm, vm->variables[var]);
             }
 #else
@@ -306,12 +315,12 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
                 nb_print("Error: Out of memory\n");
                 return NB_ERROR;
             }
-            memset(&vm->heap[addr & 0x7FFF], 0, (size + 1) * sizeof(uint32_t));
+            memset(&vm->heap[addr & k_HEAP_MASK], 0, (size + 1) * sizeof(uint32_t));
             vm->variables[var] = addr;
             vm->pc += 2;
             break;
         case k_BREAK_INSTR_N3:
-            tmp1 = ACS16(vm->code[vm->pc + 1]);
+            tmp1 = ACS16(code[vm->pc + 1]);
             PPUSH(tmp1);
             vm->pc += 3; 
             return NB_BREAK;
@@ -357,6 +366,34 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             }
             vm->pc += 1;
             break;
+        case k_SHL_N2:
+            TOP() = (uint32_t)TOP() << code[vm->pc + 1];
+            vm->pc += 2;
+            break;
+        case k_DIV_POW2_N2:
+            // Round towards zero, like the division
+            val = code[vm->pc + 1];
+            tmp1 = TOP();
+            TOP() = (tmp1 + ((tmp1 >> 31) & ((1 << val) - 1))) >> val;
+            vm->pc += 2;
+            break;
+        case k_MOD_POW2_N2:
+            // Sign of the dividend, like the modulo operation
+            tmp1 = TOP();
+            tmp2 = (1 << code[vm->pc + 1]) - 1;
+            TOP() = tmp1 < 0 ? -(int32_t)(-(uint32_t)tmp1 & tmp2) : tmp1 & tmp2;
+            vm->pc += 2;
+            break;
+        case k_DIV_MAGIC_N6:
+            TOP() = div_magic(TOP(), ACS32(code[vm->pc + 1]), code[vm->pc + 5]);
+            vm->pc += 6;
+            break;
+        case k_MOD_MAGIC_N8:
+            tmp1 = TOP();
+            tmp2 = ACS16(code[vm->pc + 6]);
+            TOP() = tmp1 - div_magic(tmp1, ACS32(code[vm->pc + 1]), code[vm->pc + 5]) * tmp2;
+            vm->pc += 8;
+            break;
         case k_AND_N1:
             tmp2 = POP();
             TOP() = TOP() && tmp2;
@@ -406,22 +443,22 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             vm->pc += 1;
             break;
         case k_GOTO_N3:
-            vm->pc = ACS16(vm->code[vm->pc + 1]);
+            JUMP(ACS_ADDR(code[vm->pc + 1]));
             break;
         case k_GOSUB_N3:
             if(vm->sp < cfg_STACK_SIZE) {
-                PUSH(vm->pc + 3);
-                vm->pc = ACS16(vm->code[vm->pc + 1]);
+                PUSH(vm->pc + k_JUMP_LEN);
+                JUMP(ACS_ADDR(code[vm->pc + 1]));
             } else {
                 nb_print("Error: Call stack overflow\n");
                 return NB_ERROR;
             }
             break;
         case k_RETURN_N1:
-            vm->pc = (uint16_t)POP();
+            JUMP((nb_addr_t)POP());
             break;
         case k_RETI_N1:
-            vm->pc = (uint16_t)POP();
+            vm->pc = (nb_addr_t)POP();
             return NB_RETI;
         case k_FOR_N1:
             if(++vm->nested_loop_idx > cfg_MAX_FOR_LOOPS) {
@@ -431,37 +468,68 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             vm->pc += 1;
             break;
         case k_NEXT_N4:
-            // ID = ID + stack[-1]
-            // IF ID <= stack[-2] GOTO start
-            tmp1 = ACS16(vm->code[vm->pc + 1]);
-            var = vm->code[vm->pc + 3];
-            tmp2 = TOP(); // step value
-            vm->variables[var] = vm->variables[var] + tmp2;
-            if(tmp2 < 0) {
-                if(vm->variables[var] >= PEEK(-2)) {
-                    vm->pc = tmp1;
-                    break;
-                }
-            } else {
-                if(vm->variables[var] <= PEEK(-2)) {
-                    vm->pc = tmp1;
-                    break;
-                }
+            if(next_iteration(vm, code[vm->pc + k_NEXT_LEN - 1])) {
+                JUMP(ACS_ADDR(code[vm->pc + 1]));
+                break;
             }
-            vm->pc += 4;
+            vm->pc += k_NEXT_LEN;
             (void)POP();  // remove step value
             (void)POP();  // remove loop end value
             vm->nested_loop_idx--;
             break;
         case k_IF_N3:
             if(POP() == 0) {
-              vm->pc = ACS16(vm->code[vm->pc + 1]);
+              JUMP(ACS_ADDR(code[vm->pc + 1]));
             } else {
-              vm->pc += 3;
+              vm->pc += k_JUMP_LEN;
             }
             break;
+        case k_IF_TRUE_N3:
+            if(POP() != 0) {
+              JUMP(ACS_ADDR(code[vm->pc + 1]));
+            } else {
+              vm->pc += k_JUMP_LEN;
+            }
+            break;
+#ifdef cfg_COMPACT_CODE
+        case k_GOTO_R2:
+            vm->pc += (int8_t)code[vm->pc + 1];
+            break;
+        case k_IF_R2:
+            if(POP() == 0) {
+              vm->pc += (int8_t)code[vm->pc + 1];
+            } else {
+              vm->pc += 2;
+            }
+            break;
+        case k_IF_TRUE_R2:
+            if(POP() != 0) {
+              vm->pc += (int8_t)code[vm->pc + 1];
+            } else {
+              vm->pc += 2;
+            }
+            break;
+        case k_NEXT_R3:
+            if(next_iteration(vm, code[vm->pc + 2])) {
+                vm->pc += (int8_t)code[vm->pc + 1];
+                break;
+            }
+            vm->pc += 3;
+            (void)POP();  // remove step value
+            (void)POP();  // remove loop end value
+            vm->nested_loop_idx--;
+            break;
+#endif
+#ifdef cfg_LINE_NUMBERS
+        case k_LAZY_LINE_N3:
+            // Compile the line on first use, the stub becomes a jump to it
+            if(nb_compile_lazy_line(vm, ACS16(code[vm->pc + 1])) == 0) {
+                return NB_ERROR;
+            }
+            break;
+#endif
         case k_READ_NUM_N1:
-            if(vm->data_start_addr + vm->data_read_offs + 4 > vm->code_size) {
+            if(vm->data_start_addr + vm->data_read_offs + 4 > vm->str_pool_addr) {
                 nb_print("Error: Out of data\n");
                 return NB_ERROR;
             }
@@ -475,7 +543,7 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             vm->pc += 1;
             break;
         case k_READ_STR_N1:
-            if(vm->data_start_addr + vm->data_read_offs + 4 > vm->code_size) {
+            if(vm->data_start_addr + vm->data_read_offs + 4 > vm->str_pool_addr) {
                 nb_print("Error: Out of data\n");
                 return NB_ERROR;
             }
@@ -495,33 +563,60 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             break;
         case k_ON_GOTO_N2:
             idx = POP();
-            val = vm->code[vm->pc + 1];
+            val = code[vm->pc + 1];
             vm->pc += 2;
             if(idx == 0 || idx > val) {
-                vm->pc += val * 3;
+                vm->pc += val * k_JUMP_LEN;
             } else {
-                vm->pc += (idx - 1) * 3;
+                vm->pc += (idx - 1) * k_JUMP_LEN;
             }
             break;
         case k_ON_GOSUB_N2:
             idx = POP();
-            val = vm->code[vm->pc + 1];
+            val = code[vm->pc + 1];
             vm->pc += 2;
             if(idx == 0 || idx > val) {
-                vm->pc += val * 3;  // skip all addresses
+                vm->pc += val * k_JUMP_LEN;  // skip all addresses
             } else {
                 if(vm->sp < cfg_STACK_SIZE) {
-                    PUSH(vm->pc + val * 3);  // return address to the next instruction
-                    vm->pc += (idx - 1) * 3;  // jump to the selected address
+                    PUSH(vm->pc + val * k_JUMP_LEN);  // return address to the next instruction
+                    vm->pc += (idx - 1) * k_JUMP_LEN;  // jump to the selected address
                 } else {
                     nb_print("Error: Call stack overflow\n");
                     return NB_ERROR;
                 }
             }
             break;
+        case k_SELECT_TAB_N6:
+            // The values 'first'..'first + num - 1' select a GOTO of the list
+            tmp1 = (int32_t)((uint32_t)POP() - ACS32(code[vm->pc + 1]));
+            val = code[vm->pc + 5];
+            vm->pc += 6;
+            if((uint32_t)tmp1 < val) {
+                vm->pc += tmp1 * k_JUMP_LEN;
+            } else {
+                vm->pc += val * k_JUMP_LEN;
+            }
+            break;
+        case k_SELECT_BIN_N2:
+            val = code[vm->pc + 1];
+            tmp1 = select_index(&code[vm->pc + 2], val, POP());
+            vm->pc += k_SELECT_BIN_LEN(val) + tmp1 * k_JUMP_LEN;
+            break;
+        case k_GET_CONST_ELEM_N3:
+            // Number of values, followed by the values
+            addr = vm->str_pool_addr + ACS16(code[vm->pc + 1]);
+            tmp1 = POP();
+            if((uint32_t)tmp1 >= ACS32(vm->code[addr])) {
+                nb_print("Error: Array index out of bounds\n");
+                return NB_ERROR;
+            }
+            PUSH(ACS32(vm->code[addr + (1 + tmp1) * sizeof(uint32_t)]));
+            vm->pc += 3;
+            break;
         case k_SET_ARR_ELEM_N2:
-            var = vm->code[vm->pc + 1];
-            addr = vm->variables[var] & 0x7FFF;
+            var = code[vm->pc + 1];
+            addr = vm->variables[var] & k_HEAP_MASK;
             tmp1 = POP();
             tmp2 = POP() * sizeof(uint32_t);
             if(tmp2 >= nb_mem_get_blocksize(vm, addr)) {
@@ -532,8 +627,8 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             vm->pc += 2;
             break;
         case k_GET_ARR_ELEM_N2:
-            var = vm->code[vm->pc + 1];
-            addr = vm->variables[var] & 0x7FFF;
+            var = code[vm->pc + 1];
+            addr = vm->variables[var] & k_HEAP_MASK;
             tmp1 = POP() * sizeof(uint32_t);
             if(tmp1 >= nb_mem_get_blocksize(vm, addr)) {
                 nb_print("Error: Array index out of bounds\n");
@@ -544,8 +639,8 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             break;
 #ifdef cfg_DATA_ACCESS            
         case k_SET_ARR_1BYTE_N2:
-            var = vm->code[vm->pc + 1];
-            addr = vm->variables[var] & 0x7FFF;
+            var = code[vm->pc + 1];
+            addr = vm->variables[var] & k_HEAP_MASK;
             tmp1 = POP();
             tmp2 = POP();
             if(tmp2 >= nb_mem_get_blocksize(vm, addr)) {
@@ -556,8 +651,8 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             vm->pc += 2;
             break;
         case k_GET_ARR_1BYTE_N2:
-            var = vm->code[vm->pc + 1];
-            addr = vm->variables[var] & 0x7FFF;
+            var = code[vm->pc + 1];
+            addr = vm->variables[var] & k_HEAP_MASK;
             tmp1 = POP();
             if(tmp1 >= nb_mem_get_blocksize(vm, addr)) {
                 nb_print("Error: Array index out of bounds\n");
@@ -567,8 +662,8 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             vm->pc += 2;
             break;
         case k_SET_ARR_2BYTE_N2:
-            var = vm->code[vm->pc + 1];
-            addr = vm->variables[var] & 0x7FFF;
+            var = code[vm->pc + 1];
+            addr = vm->variables[var] & k_HEAP_MASK;
             tmp1 = POP();
             tmp2 = POP();
             if(tmp2 + 1 >= nb_mem_get_blocksize(vm, addr)) {
@@ -579,8 +674,8 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             vm->pc += 2;
             break;
         case k_GET_ARR_2BYTE_N2:
-            var = vm->code[vm->pc + 1];
-            addr = vm->variables[var] & 0x7FFF;
+            var = code[vm->pc + 1];
+            addr = vm->variables[var] & k_HEAP_MASK;
             tmp1 = POP();
             if(tmp1 + 1 >= nb_mem_get_blocksize(vm, addr)) {
                 nb_print("Error: Array index out of bounds\n");
@@ -590,8 +685,8 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             vm->pc += 2;
             break;
         case k_SET_ARR_4BYTE_N2:
-            var = vm->code[vm->pc + 1];
-            addr = vm->variables[var] & 0x7FFF;
+            var = code[vm->pc + 1];
+            addr = vm->variables[var] & k_HEAP_MASK;
             tmp1 = POP();
             tmp2 = POP();
             if(tmp2 + 3 >= nb_mem_get_blocksize(vm, addr)) {
@@ -602,8 +697,8 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             vm->pc += 2;
             break;
         case k_GET_ARR_4BYTE_N2:
-            var = vm->code[vm->pc + 1];
-            addr = vm->variables[var] & 0x7FFF;
+            var = code[vm->pc + 1];
+            addr = vm->variables[var] & k_HEAP_MASK;
             tmp1 = POP();
             if(tmp1 + 3 >= nb_mem_get_blocksize(vm, addr)) {
                 nb_print("Error: Array index out of bounds\n");
@@ -616,9 +711,9 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             // copy(arr, offs, arr, offs, bytes)
             size = POP();  // number of bytes
             offs2 = POP();  // source offset
-            tmp2 = POP() & 0x7FFF;  // source address
+            tmp2 = POP() & k_HEAP_MASK;  // source address
             offs1 = POP();  // destination offset
-            tmp1 = POP() & 0x7FFF;  // destination address
+            tmp1 = POP() & k_HEAP_MASK;  // destination address
             size1 = nb_mem_get_blocksize(vm, tmp1);
             size2 = nb_mem_get_blocksize(vm, tmp2);
             if(size + offs1 > size1 || size + offs2 > size2) {
@@ -640,7 +735,7 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             vm->pc += 1;
             break;
         case k_XFUNC_N2:
-            val = vm->code[vm->pc + 1];
+            val = code[vm->pc + 1];
             vm->pc += 2;
             return NB_XFUNC + val;
         case k_PUSH_PARAM_N1:
@@ -649,9 +744,9 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             break;
 #ifdef cfg_STRING_SUPPORT
         case k_ERASE_ARR_N2:
-            var = vm->code[vm->pc + 1];
+            var = code[vm->pc + 1];
             addr = vm->variables[var];
-            if(addr > 0x7FFF) {
+            if(addr >= k_HEAP_TAG) {
                 nb_mem_free(vm, addr);
             }
             vm->variables[var] = 0;
@@ -694,6 +789,18 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             PUSH(strcmp(get_string(vm, tmp1), get_string(vm, tmp2)) == 0 ? 0 : 1);
             vm->pc += 1;
             break;
+        case k_STR_EQUAL_LIT_N3:
+            str1 = (char*)&vm->code[vm->str_pool_addr + ACS16(code[vm->pc + 1])];
+            tmp1 = POP();
+            PUSH(strcmp(get_string(vm, tmp1), str1) == 0 ? 1 : 0);
+            vm->pc += 3;
+            break;
+        case k_STR_NOT_EQU_LIT_N3:
+            str1 = (char*)&vm->code[vm->str_pool_addr + ACS16(code[vm->pc + 1])];
+            tmp1 = POP();
+            PUSH(strcmp(get_string(vm, tmp1), str1) == 0 ? 0 : 1);
+            vm->pc += 3;
+            break;
         case k_STR_LESS_N1:
             tmp2 = POP();
             tmp1 = POP();
@@ -711,6 +818,7 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             tmp1 = POP();
             PUSH(strcmp(get_string(vm, tmp1), get_string(vm, tmp2)) > 0 ? 1 : 0);
             vm->pc += 1;
+            break;
         case k_STR_GREATER_EQU_N1:
             tmp2 = POP();
             tmp1 = POP();
@@ -804,9 +912,33 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
             PUSH(addr);
             vm->pc += 1;
             break;
+#endif
+#ifdef cfg_PROFILE
+        case k_PROFILE_N3:
+            tmp1 = ACS16(code[vm->pc + 1]);
+            if(tmp1 < vm->num_prof_cnt) {
+                vm->p_prof_cnt[tmp1]++;
+            }
+            vm->pc += 3;
+            break;
+#endif
+#ifdef cfg_COMPACT_CODE
+        // Short forms of the variable and value instructions
+        CASE_SHORT(k_PUSH_VAR0_N1):
+            PUSH(vm->variables[code[vm->pc] - k_PUSH_VAR0_N1]);
+            vm->pc += 1;
+            break;
+        CASE_SHORT(k_POP_VAR0_N1):
+            vm->variables[code[vm->pc] - k_POP_VAR0_N1] = POP();
+            vm->pc += 1;
+            break;
+        CASE_SHORT(k_PUSH_NUM0_N1):
+            PUSH(code[vm->pc] - k_PUSH_NUM0_N1);
+            vm->pc += 1;
+            break;
 #endif
         default:
-            nb_print("Error: unknown opcode '%u'\n", vm->code[vm->pc]);
+            nb_print("Error: unknown opcode '%u'\n", code[vm->pc]);
             return NB_ERROR;
         }
     }
@@ -814,37 +946,145 @@ uint16_t nb_run(void *pv_vm, uint16_t *p_cycles) {
 }
 
 void nb_destroy(void * pv_vm) {
+    t_VM *vm = pv_vm;
+    if(vm != NULL) {
+        free(vm->p_symbol);
+        free(vm->p_line_map);
+        free(vm->p_src_lines);
+        free(vm->p_lazy);
+#ifdef cfg_PROFILE
+        free(vm->p_prof_cnt);
+        free(vm->p_profile);
+#endif
+    }
     free(pv_vm);
 }
 
 /***************************************************************************************************
 * Static functions
 ***************************************************************************************************/
-static char *get_string(t_VM *vm, uint16_t addr) {
-#ifdef cfg_STRING_SUPPORT
-    if(addr == STRBUF1) {
-        return vm->strbuf1;
-    } else if(addr == STRBUF2) {
-        return vm->strbuf2;
-    } else 
-#endif
-    if(addr >= 0x8000) {
-        if(vm->heap[addr & 0x7FFF] == 0) {
-            return "";
+/*
+** NEXT: ID = ID + stack[-1]
+** Return true if ID <= stack[-2] (or >= for a negative step), to continue the loop
+*/
+static bool next_iteration(t_VM *vm, uint8_t var) {
+    int32_t step = TOP();
+    vm->variables[var] = vm->variables[var] + step;
+    if(step < 0) {
+        return vm->variables[var] >= PEEK(-2);
+    }
+    return vm->variables[var] <= PEEK(-2);
+}
+
+// Binary search in the sorted values of SELECT_BIN, return the GOTO index ('num' if not found)
+static uint8_t select_index(const uint8_t *p_values, uint8_t num, int32_t val) {
+    uint8_t lo = 0;
+    uint8_t hi = num;
+
+    while(lo < hi) {
+        uint8_t mid = (lo + hi) / 2;
+        if((int32_t)ACS32(p_values[mid * 4]) < val) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        return (char*)&vm->heap[addr & 0x7FFF];
-    } else if(addr == 0) {
-        return "";
-    } else {
-        if(vm->code[addr] == 0) {
-            return "";
+    }
+    if(lo < num && (int32_t)ACS32(p_values[lo * 4]) == val) {
+        return lo;
+    }
+    return num;
+}
+
+/*
+** PRINT_LIST: The items are formatted into one buffer, which is output at once
+** (or whenever it is full)
+*/
+static void print_list(t_VM *vm, const uint8_t *p_format, uint8_t num) {
+    static const char Blanks[] = "                ";
+    char buff[k_MAX_LINE_LEN];
+    char num_buff[16];
+    uint16_t len = 0;
+
+    for(uint8_t i = 0; i < num; i++) {
+        uint8_t format = (p_format[i / 2] >> ((i % 2) * 4)) & 0x0F;
+        int32_t val = PEEK(i - num);
+        uint8_t cnt;
+
+        switch(format & k_PRT_TYPE_MASK) {
+        case k_PRT_STR:
+            len = print_append(buff, len, get_string(vm, val));
+            break;
+        case k_PRT_VAL:
+            snprintf(num_buff, sizeof(num_buff), "%d ", val);
+            len = print_append(buff, len, num_buff);
+            break;
+        default: // k_PRT_BLANKS
+            for(cnt = (uint8_t)val; cnt > 0; cnt -= MIN(cnt, sizeof(Blanks) - 1)) {
+                len = print_append(buff, len, &Blanks[sizeof(Blanks) - 1 - MIN(cnt, sizeof(Blanks) - 1)]);
+            }
+            break;
+        }
+        switch(format & k_PRT_SEP_MASK) {
+        case k_PRT_SPACE: len = print_append(buff, len, " "); break;
+        case k_PRT_TAB: len = print_append(buff, len, "\t"); break;
+        case k_PRT_NEWL: len = print_append(buff, len, "\n"); break;
+        default: break;
+        }
+    }
+    vm->sp -= num;
+    if(len > 0) {
+        buff[len] = '\0';
+        nb_print("%s", buff);
+    }
+}
+
+// Append the string to the PRINT buffer, which is output before if it is full
+static uint16_t print_append(char *p_buff, uint16_t len, const char *p_str) {
+    uint16_t size = strlen(p_str);
+
+    if(len + size >= k_MAX_LINE_LEN) {
+        p_buff[len] = '\0';
+        nb_print("%s", p_buff);
+        len = 0;
+        if(size >= k_MAX_LINE_LEN) {
+            nb_print("%s", p_str);
+            return 0;
         }
-        return (char*)&vm->code[addr];
     }
+    memcpy(&p_buff[len], p_str, size);
+    return len + size;
+}
+
+/*
+** The address ranges in the order of frequency: code literals (0 = null string),
+** heap buffers, and the temporary buffers just below the heap tag.
+*/
+static char *get_string(t_VM *vm, nb_addr_t addr) {
+    if(addr < STRBUF1) {
+        return addr != 0 ? (char*)&vm->code[addr] : "";
+    }
+    if(addr >= k_HEAP_TAG) {
+        return (char*)&vm->heap[addr & k_HEAP_MASK];
+    }
+#ifdef cfg_STRING_SUPPORT
+    return addr == STRBUF1 ? vm->strbuf1 : vm->strbuf2;
+#else
+    return "";
+#endif
+}
+
+// Division by a constant with the multiplier and shift calculated by the compiler
+static int32_t div_magic(int32_t val, int32_t mul, uint8_t shift) {
+    int32_t quot = (int32_t)(((int64_t)mul * val) >> 32);
+    if(mul < 0) {
+        quot += val;
+    }
+    quot >>= shift;
+    return quot + ((uint32_t)val >> 31);
 }
 
 #ifdef cfg_STRING_SUPPORT
-static char *alloc_temp_string(t_VM *vm, uint16_t *p_addr) {
+static char *alloc_temp_string(t_VM *vm, nb_addr_t *p_addr) {
     if(vm->strbuf1_used) {
         vm->strbuf1_used = false;
         *p_addr = STRBUF2;
@@ -856,21 +1096,21 @@ static char *alloc_temp_string(t_VM *vm, uint16_t *p_addr) {
     }
 }
 
-static uint16_t realloc_string(t_VM *vm) {
-    uint8_t var  = vm->code[vm->pc + 1];
-    uint16_t addr = POP();
+static nb_addr_t realloc_string(t_VM *vm) {
+    uint8_t var  = CODE_SEG(vm, vm->pc)[vm->pc + 1];
+    nb_addr_t addr = POP();
     char *ptr = get_string(vm, addr);
     uint16_t len = strlen(ptr) + 1;
 
-    if(vm->variables[var] > 0x7FFF) { // heap buffer
+    if(vm->variables[var] >= k_HEAP_TAG) { // heap buffer
         if(addr >= STRBUF1) { // no static string
             // Allocate a new buffer and copy the string
-            uint16_t addr1 = nb_mem_realloc(vm, vm->variables[var], len);
+            nb_addr_t addr1 = nb_mem_realloc(vm, vm->variables[var], len);
             if(addr1 == 0) {
                 nb_print("Error: Out of memory\n");
                 return NB_ERROR;
             }
-            memcpy(&vm->heap[addr1 & 0x7FFF], ptr, len);
+            memcpy(&vm->heap[addr1 & k_HEAP_MASK], ptr, len);
             return addr1;
         } else {
             // Free the old buffer and use the static string
@@ -880,12 +1120,12 @@ static uint16_t realloc_string(t_VM *vm) {
     }
     if(addr >= STRBUF1) { // no static string
         // Allocate a new buffer and copy the string
-        uint16_t addr1 = nb_mem_alloc(vm, len);
+        nb_addr_t addr1 = nb_mem_alloc(vm, len);
         if(addr1 == 0) {
             nb_print("Error: Out of memory\n");
             return NB_ERROR;
         }
-        memcpy(&vm->heap[addr1 & 0x7FFF], ptr, len);
+        memcpy(&vm->heap[addr1 & k_HEAP_MASK], ptr, len);
         return addr1;
     } else {
         // Use the new buffer
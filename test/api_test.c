@@ -0,0 +1,341 @@
+/*
+
+Copyright 2024-2025 Joachim Stolberg
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+/*
+** Test of the compiler API for line-numbered programs (cfg_LINE_NUMBERS):
+** The programs are compiled and run, and their output is compared with the
+** expected output.
+*/
+
+#undef NDEBUG
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdarg.h>
+#include "nb.h"
+#include "nb_int.h"
+
+static char Output[1024];
+static uint16_t OutLen = 0;
+
+// The output of the compiler and the programs is collected for the comparison
+void nb_print(const char * format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(&Output[OutLen], sizeof(Output) - OutLen, format, args);
+    va_end(args);
+    if(len > 0) {
+        OutLen = MIN(OutLen + len, sizeof(Output) - 1);
+    }
+}
+
+static void check_output(const char *expected) {
+    if(strcmp(Output, expected) != 0) {
+        printf("Expected output:\n%s\nOutput:\n%s\n", expected, Output);
+        fflush(stdout);
+        assert(false);
+    }
+    OutLen = 0;
+    Output[0] = '\0';
+}
+
+// Run the program from the start, return the number of cycles
+static uint32_t run(void *instance) {
+    uint16_t res = NB_BUSY;
+    uint16_t cycles;
+    uint32_t count = 0;
+
+    nb_reset(instance);
+    while(res >= NB_BUSY) {
+        cycles = 5000;
+        res = nb_run(instance, &cycles);
+        count += 5000 - cycles;
+    }
+    assert(res == NB_END);
+    return count;
+}
+
+// Same code size and line addresses (jump targets) as the complete compilation
+// of the source code (the variables can have other indices), or the same code
+static void check_code(void *instance, const char *p_src, bool same_code) {
+    void *full = nb_create();
+    t_VM *vm1 = instance;
+    t_VM *vm2 = full;
+
+    assert(nb_compile_buffer(full, p_src, strlen(p_src)) == 0);
+    assert(vm1->code_size == vm2->code_size);
+    assert(vm1->num_lines == vm2->num_lines);
+    for(uint16_t i = 0; i < vm1->num_lines; i++) {
+        assert(vm1->p_line_map[i].linenum == vm2->p_line_map[i].linenum);
+        assert(vm1->p_line_map[i].pc == vm2->p_line_map[i].pc);
+    }
+    assert(!same_code || memcmp(vm1->code, vm2->code, vm1->code_size) == 0);
+    nb_destroy(full);
+}
+
+/*
+** Incremental compilation: Only the changed lines are compiled again, the code
+** behind is moved and the jumps to it are relinked.
+*/
+static void test_recompile(void) {
+    const char *p_src1 =
+        "10 N = 3\n"
+        "20 GOSUB 100\n"
+        "30 PRINT \"S=\"; S\n"
+        "40 END\n"
+        "100 S = 0\n"
+        "110 FOR I = 1 TO N\n"
+        "120 S = S + I\n"
+        "130 NEXT I\n"
+        "140 RETURN\n";
+    // Longer code in front of the subroutine
+    const char *p_src2 =
+        "10 N = 4 : M = 2\n"
+        "20 GOSUB 100\n"
+        "30 PRINT \"S=\"; S\n"
+        "40 END\n"
+        "100 S = 0\n"
+        "110 FOR I = 1 TO N\n"
+        "120 S = S + I\n"
+        "130 NEXT I\n"
+        "140 RETURN\n";
+    // Changed loop body
+    const char *p_src3 =
+        "10 N = 4 : M = 2\n"
+        "20 GOSUB 100\n"
+        "30 PRINT \"S=\"; S\n"
+        "40 END\n"
+        "100 S = 0\n"
+        "110 FOR I = 1 TO N\n"
+        "120 S = S + I * M\n"
+        "130 NEXT I\n"
+        "140 RETURN\n";
+    // A declaration needs the complete compilation
+    const char *p_src4 =
+        "5 DIM A(3)\n"
+        "10 N = 4 : M = 2\n"
+        "20 GOSUB 100\n"
+        "30 PRINT \"S=\"; S\n"
+        "40 END\n"
+        "100 S = 0\n"
+        "110 FOR I = 1 TO N\n"
+        "120 S = S + I * M\n"
+        "130 NEXT I\n"
+        "140 RETURN\n";
+    const char *p_err =
+        "5 DIM A(3)\n"
+        "10 N = 4 : M = 2\n"
+        "20 GOSUB 100\n"
+        "30 PRINT \"S=\"; S\n"
+        "40 END\n"
+        "100 S = 0\n"
+        "110 FOR I = 1 TO N\n"
+        "120 S = S +\n"
+        "130 NEXT I\n"
+        "140 RETURN\n";
+    void *instance = nb_create();
+    nb_addr_t addr;
+
+    assert(nb_compile_buffer(instance, p_src1, strlen(p_src1)) == 0);
+    run(instance);
+    check_output("S=6 \n");
+    addr = nb_get_label_address(instance, "100");
+
+    assert(nb_recompile_buffer(instance, p_src2, strlen(p_src2)) == 0);
+    run(instance);
+    check_output("S=10 \n");
+    assert(nb_get_label_address(instance, "100") > addr);
+    check_code(instance, p_src2, false);
+
+    assert(nb_recompile_buffer(instance, p_src3, strlen(p_src3)) == 0);
+    run(instance);
+    check_output("S=20 \n");
+    check_code(instance, p_src3, false);
+
+    assert(nb_recompile_buffer(instance, p_src4, strlen(p_src4)) == 0);
+    run(instance);
+    check_output("S=20 \n");
+    check_code(instance, p_src4, true);
+
+    // Nothing changed
+    assert(nb_recompile_buffer(instance, p_src4, strlen(p_src4)) == 0);
+    run(instance);
+    check_output("S=20 \n");
+
+    // The code is invalid after an error, the next compilation is complete
+    assert(nb_recompile_buffer(instance, p_err, strlen(p_err)) == 1);
+    check_output("Error in line 120: syntax error\n");
+    assert(nb_recompile_buffer(instance, p_src3, strlen(p_src3)) == 0);
+    run(instance);
+    check_output("S=20 \n");
+    check_code(instance, p_src3, true);
+    nb_destroy(instance);
+    printf("Recompile test passed\n");
+}
+
+// Stub instruction of the lazy compilation in front of the line
+static uint8_t lazy_stub(void *instance, uint16_t linenum) {
+    t_VM *vm = instance;
+    for(uint16_t i = 0; i < vm->num_lazy; i++) {
+        if(vm->p_lazy[i].linenum == linenum && vm->p_lazy[i].stub != 0) {
+            return vm->code[vm->p_lazy[i].stub];
+        }
+    }
+    return 0;
+}
+
+/*
+** Lazy compilation: Only the main program is compiled, the subroutines on
+** their first call. The stub of the call becomes a jump to the compiled line.
+*/
+static void test_lazy(void) {
+    const char *p_src =
+        "10 N = 3\n"
+        "20 GOSUB 100\n"
+        "30 PRINT S\n"
+        "40 GOSUB 100\n"
+        "50 PRINT S\n"
+        "60 END\n"
+        "100 S = S + N\n"
+        "110 RETURN\n";
+    // Line 210 is compiled first, then again as part of the subroutine at line 200
+    const char *p_block =
+        "10 GOSUB 210\n"
+        "20 GOSUB 200\n"
+        "30 END\n"
+        "200 IF X = 0 THEN\n"
+        "210   PRINT \"A\" : RETURN\n"
+        "220 ENDIF\n"
+        "230 RETURN\n";
+    void *instance = nb_create();
+    uint16_t res = NB_BUSY;
+    uint16_t cycles;
+
+    assert(nb_compile_lazy(instance, p_src, strlen(p_src)) == 0);
+    assert(lazy_stub(instance, 100) == k_LAZY_LINE_N3);
+    run(instance);
+    check_output("3 \n6 \n");
+    assert(lazy_stub(instance, 100) == k_GOTO_N3);
+    // Second run with the compiled subroutine
+    run(instance);
+    check_output("3 \n6 \n");
+
+    assert(nb_compile_lazy(instance, p_block, strlen(p_block)) == 0);
+    nb_reset(instance);
+    while(res >= NB_BUSY) {
+        cycles = 5000;
+        res = nb_run(instance, &cycles);
+    }
+    assert(res == NB_ERROR);
+    check_output("A \nError in line 230: jump into a block '210'\n");
+    nb_destroy(instance);
+    printf("Lazy compilation test passed\n");
+}
+
+#ifdef cfg_PROFILE
+/*
+** Profile-guided compilation: The counts of a run are used for the next
+** compilation of the same source code, the program output stays the same.
+*/
+static void test_profile(void) {
+    const char *p_src =
+        "10 N = 100000\n"
+        "20 S = 0 : I = 0\n"
+        "30 WHILE I < N\n"
+        "40 S = S + 2 : I = I + 1\n"
+        "50 LOOP\n"
+        "60 PRINT \"S=\"; S\n"
+        "70 END\n";
+    const char *p_other =
+        "10 N = 100000\n"
+        "20 S = 0 : I = 0\n"
+        "30 WHILE I < N\n"
+        "40 S = S + 3 : I = I + 1\n"
+        "50 LOOP\n"
+        "60 PRINT \"S=\"; S\n"
+        "70 END\n";
+    void *instance = nb_create();
+    t_VM *vm = instance;
+    uint8_t a_prof[64];
+    uint8_t a_bad[64];
+    uint16_t size;
+    uint16_t code_size;
+    uint32_t cycles;
+
+    nb_collect_profile(instance, true);
+    assert(nb_compile_buffer(instance, p_src, strlen(p_src)) == 0);
+    run(instance);
+    check_output("S=200000 \n");
+    // Header, hash, and two sites: the loop iterations and exits, scaled
+    // down by one bit to fit into 16 bits
+    size = nb_get_profile(instance, a_prof, sizeof(a_prof));
+    assert(size == 14);
+    assert(memcmp(a_prof, "NP\x01", 3) == 0);
+    assert((a_prof[10] | (a_prof[11] << 8)) == (100000 >> 1));
+    assert((a_prof[12] | (a_prof[13] << 8)) == (1 >> 1));
+    assert(nb_get_profile(instance, a_prof, size - 1) == 0);
+
+    nb_collect_profile(instance, false);
+    assert(nb_compile_buffer(instance, p_src, strlen(p_src)) == 0);
+    code_size = vm->code_size;
+    cycles = run(instance);
+    check_output("S=200000 \n");
+
+    // The hot loop is rotated
+    assert(nb_set_profile(instance, a_prof, size));
+    assert(nb_compile_buffer(instance, p_src, strlen(p_src)) == 0);
+    assert(vm->code_size != code_size);
+    assert(run(instance) < cycles);
+    check_output("S=200000 \n");
+
+    // The profile of another source code is ignored
+    assert(nb_compile_buffer(instance, p_other, strlen(p_other)) == 0);
+    check_code(instance, p_other, true);
+    run(instance);
+    check_output("S=300000 \n");
+
+    // Invalid header or size
+    memcpy(a_bad, a_prof, size);
+    a_bad[2]++;
+    assert(!nb_set_profile(instance, a_bad, size));
+    check_output("Error: invalid profile\n");
+    assert(!nb_set_profile(instance, a_prof, size - 1));
+    check_output("Error: invalid profile\n");
+    assert(!nb_set_profile(instance, a_prof, 4));
+    check_output("Error: invalid profile\n");
+    // (no profile is used after an error)
+    assert(nb_compile_buffer(instance, p_src, strlen(p_src)) == 0);
+    assert(vm->code_size == code_size);
+    nb_destroy(instance);
+    printf("Profile test passed\n");
+}
+#endif
+
+int main(void) {
+    nb_init();
+    test_recompile();
+    test_lazy();
+#ifdef cfg_PROFILE
+    test_profile();
+#endif
+    return 0;
+}
@@ -16,9 +16,10 @@ for line in open("../src/nb_int.h").readlines():
         if words[0] == "k_END,":
             opcode = words[0][2:-1]
             bytes = 1
-        elif words[0] == "k_PUSH_STR_Nx,":
-            opcode = words[0][2:-4]
-            bytes = 0
+        elif words[0].rstrip(",").endswith("0_N1"):
+            # Short form, one opcode for each of the values 0..15 (k_NUM_SHORT)
+            Opcodes.extend([(words[0].rstrip(",")[2:-4], 1)] * 16)
+            continue
         elif words[0][0] == "k":
             opcode = words[0][2:-4]
             bytes = words[0][-2]
@@ -39,17 +40,16 @@ while idx < len(words):
     byte = int(words[idx], 16)
     if byte < len(Opcodes):
         opcode, bytes = Opcodes[byte]
+        if opcode == "PRINT_LIST":
+            # Number of items, followed by 4 bit formats
+            bytes = 2 + (int(words[idx+1], 16) + 1) // 2
+        elif opcode == "SELECT_BIN":
+            # Number of values, followed by the 32 bit values
+            bytes = 2 + int(words[idx+1], 16) * 4
         print("%04X: %-14s %02X " % (index, opcode, byte), end="")
-        if bytes == 0:
-            bytes = int(words[idx+1], 16) + 2
-            print('"', end="")
-            for i in range(1, bytes):
-                print("%c" % int(words[idx+i+1], 16), end="")
-            print('"')
-        else:
-            for i in range(1, bytes):
-                print("%02X " % int(words[idx+i], 16), end="")
-            print()
+        for i in range(1, bytes):
+            print("%02X " % int(words[idx+i], 16), end="")
+        print()
         index += bytes
         idx += bytes
     elif byte == 0xFF:
@@ -0,0 +1,142 @@
+#
+# Generate the perfect hash table of the BASIC keywords (src/nb_keywords.h)
+#
+# The table is shared by all configurations. Keywords of an optional
+# feature are enclosed in '#ifdef' and are ordinary identifiers if the
+# feature is disabled.
+#
+# Usage: python3 gen_keywords.py
+#
+import os
+os.chdir(os.path.dirname(os.path.abspath(__file__)))
+
+# (keyword, token type, configuration switch)
+Keywords = [
+    ("let", "LET", None),
+    ("dim", "DIM", None),
+    ("for", "FOR", None),
+    ("to", "TO", None),
+    ("step", "STEP", None),
+    ("next", "NEXT", None),
+    ("if", "IF", None),
+    ("then", "THEN", None),
+    ("else", "ELSE", None),
+    ("elseif", "ELSEIF", None),
+    ("end", "END", None),
+    ("while", "WHILE", None),
+    ("loop", "LOOP", None),
+    ("endif", "ENDIF", None),
+    ("print", "PRINT", None),
+    ("goto", "GOTO", None),
+    ("gosub", "GOSUB", None),
+    ("return", "RETURN", None),
+    ("rem", "REM", None),
+    ("and", "AND", None),
+    ("or", "OR", None),
+    ("not", "NOT", None),
+    ("mod", "MOD", None),
+    ("break", "BREAK", None),
+    ("data", "DATA", None),
+    ("read", "READ", None),
+    ("restore", "RESTORE", None),
+    ("param$", "PARAMS", None),
+    ("param", "PARAM", None),
+    ("set1", "SET1", "cfg_DATA_ACCESS"),
+    ("set2", "SET2", "cfg_DATA_ACCESS"),
+    ("set4", "SET4", "cfg_DATA_ACCESS"),
+    ("get1", "GET1", "cfg_DATA_ACCESS"),
+    ("get2", "GET2", "cfg_DATA_ACCESS"),
+    ("get4", "GET4", "cfg_DATA_ACCESS"),
+    ("copy", "COPY", "cfg_DATA_ACCESS"),
+    ("ref", "REF", "cfg_DATA_ACCESS"),
+    ("reti", "RETI", "cfg_DATA_ACCESS"),
+    ("left$", "LEFTS", "cfg_STRING_SUPPORT"),
+    ("right$", "RIGHTS", "cfg_STRING_SUPPORT"),
+    ("mid$", "MIDS", "cfg_STRING_SUPPORT"),
+    ("len", "LEN", "cfg_STRING_SUPPORT"),
+    ("val", "VAL", "cfg_STRING_SUPPORT"),
+    ("str$", "STRS", "cfg_STRING_SUPPORT"),
+    ("spc", "SPC", "cfg_STRING_SUPPORT"),
+    ("hex$", "HEXS", "cfg_STRING_SUPPORT"),
+    ("nil", "NIL", "cfg_STRING_SUPPORT"),
+    ("string$", "STRINGS", "cfg_STRING_SUPPORT"),
+    ("const", "CONST", None),
+    ("erase", "ERASE", None),
+    ("instr", "INSTR", None),
+    ("on", "ON", None),
+    ("tron", "TRON", None),
+    ("troff", "TROFF", None),
+    ("free", "FREE", None),
+    ("rnd", "RND", None),
+    ("import", "IMPORT", None),
+    ("select", "SELECT", None),
+    ("case", "CASE", None),
+]
+
+HASH_SIZE = 256  # slots of the 8 bit index table
+MAX_KW_LEN = 8   # incl. '\0'
+
+def fnv1a(name):
+    # Same hash as used for the symbol table ('sym_hash()' in nb_compiler.c)
+    h = 2166136261
+    for c in name.encode():
+        h = ((h ^ c) * 16777619) & 0xFFFFFFFF
+    return h
+
+def slot(h, mul):
+    return ((h * mul) & 0xFFFFFFFF) >> 24
+
+def find_multiplier():
+    hashes = [fnv1a(kw) for kw, _, _ in Keywords]
+    for mul in range(1, 1 << 24, 2):
+        slots = set(slot(h, mul) for h in hashes)
+        if len(slots) == len(hashes):
+            return mul
+    raise Exception("no perfect hash found")
+
+for kw, _, _ in Keywords:
+    assert len(kw) < MAX_KW_LEN, kw
+    assert kw == kw.lower(), kw
+assert len(set(kw for kw, _, _ in Keywords)) == len(Keywords)
+
+mul = find_multiplier()
+index = [0] * HASH_SIZE
+for i, (kw, _, _) in enumerate(Keywords):
+    index[slot(fnv1a(kw), mul)] = i + 1
+
+lines = []
+lines.append("/*")
+lines.append("** Perfect hash table of the BASIC keywords")
+lines.append("** Generated by 'test/gen_keywords.py', do not edit!")
+lines.append("*/")
+lines.append("")
+lines.append("#define KW_HASH_MUL         (%du)" % mul)
+lines.append("#define KW_HASH_SLOT(hash)  (((uint32_t)((hash) * KW_HASH_MUL)) >> 24)")
+lines.append("")
+lines.append("typedef struct {")
+lines.append("    char    name[%d];" % MAX_KW_LEN)
+lines.append("    uint8_t type;")
+lines.append("} keyword_t;")
+lines.append("")
+lines.append("// Keyword number + 1 for each hash slot, 0 = no keyword")
+lines.append("static const uint8_t a_KeywordHash[%d] = {" % HASH_SIZE)
+for i in range(0, HASH_SIZE, 16):
+    lines.append("    " + " ".join("%2d," % v for v in index[i:i + 16]))
+lines.append("};")
+lines.append("")
+lines.append("static const keyword_t a_KeywordList[%d] = {" % len(Keywords))
+for kw, tok, cfg in Keywords:
+    if cfg:
+        lines.append("#ifdef %s" % cfg)
+        lines.append('    {"%s", %s},' % (kw, tok))
+        lines.append("#else")
+        lines.append('    {"", 0},')
+        lines.append("#endif")
+    else:
+        lines.append('    {"%s", %s},' % (kw, tok))
+lines.append("};")
+
+with open("../src/nb_keywords.h", "w") as f:
+    f.write("\n".join(lines) + "\n")
+
+print("%d keywords, multiplier %d" % (len(Keywords), mul))
@@ -45,10 +45,6 @@ int msleep(uint32_t msec)
     return res;
 }
 
-char *nb_get_code_line(void *fp, char *line, int max_line_len) {
-    return fgets(line, max_line_len, fp);
-}
-
 void nb_print(const char * format, ...) {
     va_list args;
     va_start(args, format);
@@ -105,23 +101,37 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    errors = nb_compile(instance, fp);
+    // Read the complete file, the compiler scans the buffer in place
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *p_src = malloc(size > 0 ? size : 1);
+    if(p_src == NULL) {
+        nb_print("Error: out of memory\n");
+        fclose(fp);
+        return -1;
+    }
+    size = fread(p_src, 1, size, fp);
     fclose(fp);
 
+    errors = nb_compile_buffer(instance, p_src, size);
+    free(p_src);
+
     if(errors > 0) {
         return 1;
     }
 
 #if defined(cfg_DATA_ACCESS) && !defined(cfg_STRING_SUPPORT)
-    uint16_t start = nb_get_label_address(instance, "start");
+    nb_addr_t start = nb_get_label_address(instance, "start");
 #endif
 #if defined(cfg_LINE_NUMBERS)
-    uint16_t error = nb_get_label_address(instance, "1000");
+    nb_addr_t error = nb_get_label_address(instance, "1000");
 #else
     uint16_t error = 0;
 #endif
 
     nb_output_symbol_table(instance);
+    nb_output_code_analysis(instance);
     nb_print("\nNanoBasic Interpreter V%s\n", SVERSION);
     nb_dump_code(instance);
 
@@ -148,7 +158,7 @@ int main(int argc, char* argv[]) {
             } else if(res == NB_XFUNC) {
                 // send
                 uint8_t arr[80];
-                uint16_t ref = nb_pop_arr_ref(instance);
+                nb_addr_t ref = nb_pop_arr_ref(instance);
                 nb_read_arr(instance, ref, arr, 80);
                 uint32_t id = nb_pop_num(instance);
                 uint8_t port = nb_pop_num(instance);
@@ -131,6 +131,95 @@ const min = -2147483648
 if -2147483647 > min then print "  16";
 print "   |"
 
+print "|";
+for i = 17 to 21
+  select case i * 1000
+  case 17000, 19000
+    print "  "; str$(i);
+  case 18000
+    print "  18";
+  case -1, 100000
+    print "Oops, should not happen"
+  case else
+    print "  "; str$(i);
+  end select
+next
+const tab() = 22, 23,
+  24
+for i = 0 to 2
+  print "  "; str$(tab(i));
+next
+u$ = "abc"
+if u$ = "abc" then print "  25";
+if "abd" > u$ and u$ <> "ab" then print "  26";
+print "                  |"
+
+a = 3 : b = 4 : s1 = 0 : s2 = 0 : s3 = 0
+for i = 1 to 5
+  s1 = s1 + a * b
+next i
+for i = 1 to 5
+  s2 = s2 + a * b
+  if i = 2 then a = 5
+next i
+a = 3 : i = 0
+while i < 5
+  s3 = s3 + a * b
+  if i = 2 then a = 5
+  i = i + 1
+loop
+print "| Loop invariants should be 60 84 76: "; s1; s2; s3; "            |"
+
+' The repeated 'D(A) * 10 + C' uses a hidden temporary variable, so the
+' symbol table (nb_output_symbol_table) reports 'Temporaries:'
+dim D(3)
+A = 2 : B = 7 : C = 5 : D(2) = 12
+F = D(A) * 10 + C : E = F / B : D(A) = F - E * B
+G = D(A) : X = D(A) * 10 + C : D(A) = 9 : Y = D(A) * 10 + C : Z = D(A) * 10 + C
+print "| CSE should be 125 17 6 65 95 95: "; F; E; G; X; Y; Z; "      |"
+
+' Constant conditions keep the right branch, the right operand of AND/OR is
+' skipped if the left one decides (otherwise 'Error: Division by zero')
+const MODE = 2
+zero = 0
+print "| Constant and short-circuit conditions:";
+if MODE = 1 then
+  print " ERROR";
+elseif MODE = 2 then
+  print " ok";
+else
+  print " ERROR";
+endif
+if MODE > 2 then print " ERROR"; else print " ok";
+if MODE < 2 and 1 / zero > 0 then print " ERROR"; else print " ok";
+if MODE = 2 or 1 / zero > 0 then print " ok"; else print " ERROR";
+if C1 = 0 and 1 / zero > 0 then print " ERROR"; else print " ok";
+if C1 = 100 or 1 / zero > 0 then print " ok"; else print " ERROR";
+print " |"
+
+print "| Tail calls should be 1 2 3 4 3 5:";
+gosub sub_a
+print " 4";
+gosub sub_c
+print " 5            |"
+
+cnt = 0
+print "| Inlining should be 2 3:";
+gosub inl_test
+print cnt; "                             |"
+
+print "| Division and mod by 4, 7, 1000, -3:";
+for s = -1 to 1 step 2
+  x = 123457 * s
+  ok = x / 4 = 30864 * s and x mod 4 = s and x / 7 = 17636 * s and x mod 7 = 5 * s
+  if ok and x / 1000 = 123 * s and x mod 1000 = 457 * s and x / -3 = -41152 * s and x mod -3 = s then
+    print "  ok";
+  else
+    print "  ERROR";
+  endif
+next
+print "              |"
+
 print "| Time since program start = "; time();:print "sec                         |"
 name$ = input$("| Your name")
 setcur(30,23)
@@ -153,6 +242,9 @@ print "|          v = 1234567890:";v;" l = 10:";l;"           |"
 print "| Wait a moment..." : setcur(60,30) : print "|"
 sleep(4)
 gosub prnt_line
+' The items in front of a runtime error are output
+print "Expected: abc1 2 Error: Array index out of bounds"
+print "abc"; 1; 2; AR(10)
 end
 
 label1:
@@ -166,6 +258,30 @@ next i
 print "+"
 return
 
+' 'add_one' is inlined in 'inl_test', the GOTO returns to its caller
+add_one:
+  cnt = cnt + 1
+  return
+
+inl_test:
+  gosub add_one
+  gosub add_one
+  print " "; cnt;
+  goto add_one
+
+' The last GOSUB of a subroutine is a jump (tail call)
+sub_a:
+  print " 1";
+  gosub sub_b : return
+
+sub_b:
+  print " 2";
+  gosub sub_c : return
+
+sub_c:
+  print " 3";
+  return
+
 test_i1:
   print "  8";
   goto test_on